@@ -0,0 +1,43 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <variant>
+
+#include <forest/forest.hpp>
+
+namespace forest::bench
+{
+  /**
+   * Context that does nothing, so that benchmarks of the table measure dispatch alone.
+   */
+  struct null_context
+  {
+    using cache_type = std::monostate;
+    using cache_reference = std::monostate&;
+
+    std::monostate* cache = nullptr;
+
+    auto get_cache () const -> cache_reference
+    {
+      return *cache;
+    }
+
+    auto set_cache (cache_type) const -> void
+    {}
+
+    auto send_message (std::string const&) const -> void
+    {}
+  };
+
+  template<std::size_t I>
+  struct numbered_state
+  {
+    void on_entry (null_context const&)
+    {}
+    void on_exit (null_context const&)
+    {}
+  };
+
+  // send rates that never throttle a benchmark
+  inline constexpr auto unthrottled = send_queue_options {.global_rate = 1e12, .chat_rate = 1e12, .max_in_flight = 4096};
+} // namespace forest::bench
@@ -0,0 +1,90 @@
+#include "common.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+  // a fresh database in the temporary directory, removed when the benchmark ends
+  struct scratch_database
+  {
+    std::filesystem::path path = std::filesystem::temp_directory_path () / "forest_bench.db3";
+
+    scratch_database ()
+    {
+      remove ();
+    }
+
+    ~scratch_database ()
+    {
+      remove ();
+    }
+
+    auto remove () -> void
+    {
+      for (auto suffix : {"", "-wal", "-shm"})
+        std::filesystem::remove (path.string () + suffix);
+    }
+  };
+
+  auto random_chats (std::size_t chats, std::size_t count) -> std::vector<banana::integer_t>
+  {
+    auto random = std::mt19937_64 (42);
+    auto result = std::vector<banana::integer_t> (count);
+    for (auto& chat : result)
+      chat = static_cast<banana::integer_t> (random () % chats);
+    return result;
+  }
+
+  /**
+   * Arguments: number of chats, size of the value in bytes, value cache enabled.
+   */
+  void persistence_get (benchmark::State& bench)
+  {
+    auto const chats = static_cast<std::size_t> (bench.range (0));
+    auto const value = std::string (static_cast<std::size_t> (bench.range (1)), 'x');
+    auto database = scratch_database ();
+    auto storage = forest::persistence (database.path.string (),
+      {.read_connections = 1, .cache_budget = bench.range (2) != 0 ? std::size_t {64} << 20 : 0});
+    for (std::size_t chat = 0; chat < chats; ++chat)
+      storage.set_value (static_cast<banana::integer_t> (chat), "key", value);
+
+    auto const order = random_chats (chats, 4096);
+    std::size_t i = 0;
+    for (auto _ : bench) {
+      benchmark::DoNotOptimize (storage.get_value (order[i], "key"));
+      i = (i + 1) % order.size ();
+    }
+    bench.SetItemsProcessed (bench.iterations ());
+    bench.SetBytesProcessed (bench.iterations () * bench.range (1));
+  }
+
+  /**
+   * Arguments: number of chats, size of the value in bytes, write-behind enabled.
+   */
+  void persistence_set (benchmark::State& bench)
+  {
+    auto const chats = static_cast<std::size_t> (bench.range (0));
+    auto const value = std::string (static_cast<std::size_t> (bench.range (1)), 'x');
+    auto database = scratch_database ();
+    auto storage = forest::persistence (database.path.string ());
+    if (bench.range (2) != 0)
+      storage.enable_write_behind ();
+
+    auto const order = random_chats (chats, 4096);
+    std::size_t i = 0;
+    for (auto _ : bench) {
+      benchmark::DoNotOptimize (storage.set_value (order[i], "key", value));
+      i = (i + 1) % order.size ();
+    }
+    bench.SetItemsProcessed (bench.iterations ());
+    bench.SetBytesProcessed (bench.iterations () * bench.range (1));
+  }
+
+  BENCHMARK (persistence_get)->ArgsProduct ({{100, 10000}, {16, 1024, 16384}, {0, 1}});
+  BENCHMARK (persistence_set)->ArgsProduct ({{100, 10000}, {16, 1024, 16384}, {0, 1}});
+} // namespace
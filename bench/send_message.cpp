@@ -0,0 +1,71 @@
+#include "common.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+namespace
+{
+  /**
+   * context::send_message up to the send queue: building the request and its inline keyboard, then queueing it.
+   * Messages are delivered by a fake agent on the queue's thread. The argument is the length of the text.
+   */
+  template<class Send>
+  void send_message (benchmark::State& bench, Send send)
+  {
+    auto const path = (std::filesystem::temp_directory_path () / "forest_bench_send.db3").string ();
+    auto agent = forest::fake_agent ();
+    auto storage = forest::persistence (path);
+    auto cache = std::monostate ();
+    auto const text = std::string (static_cast<std::size_t> (bench.range (0)), 'x');
+
+    // send_message may log to std::cerr, which would dominate the measure
+    auto discard = std::ostringstream ();
+    auto* const previous = std::cerr.rdbuf (discard.rdbuf ());
+    {
+      auto outbox = forest::send_queue (forest::make_transport (agent), forest::bench::unthrottled);
+      auto const context = forest::context<> (1, cache, outbox, storage);
+      for (auto _ : bench) {
+        send (context, text);
+        discard.str ({});
+      }
+    }
+    std::cerr.rdbuf (previous);
+    std::filesystem::remove (path);
+    bench.SetItemsProcessed (bench.iterations ());
+  }
+
+  auto const plain = [] (forest::context<> const& context, std::string const& text) {
+    context.send_message (text);
+  };
+
+  auto const keyboard_1x2 = [] (forest::context<> const& context, std::string const& text) {
+    context.send_message (text, {{{"yes", "Yes"}, {"no", "No"}}});
+  };
+
+  auto const keyboard_3x3 = [] (forest::context<> const& context, std::string const& text) {
+    context.send_message (text,
+      {
+        {{"1", "One"}, {"2", "Two"}, {"3", "Three"}},
+        {{"4", "Four"}, {"5", "Five"}, {"6", "Six"}},
+        {{"7", "Seven"}, {"8", "Eight"}, {"9", "Nine"}},
+      });
+  };
+
+  // the same keyboard, built once
+  auto const prebuilt_3x3 = [buttons = forest::keyboard ({
+                               {{"1", "One"}, {"2", "Two"}, {"3", "Three"}},
+                               {{"4", "Four"}, {"5", "Five"}, {"6", "Six"}},
+                               {{"7", "Seven"}, {"8", "Eight"}, {"9", "Nine"}},
+                             })] (forest::context<> const& context, std::string const& text) {
+    context.send_message (text, buttons);
+  };
+
+  BENCHMARK_CAPTURE (send_message, plain, plain)->Arg (16)->Arg (4096);
+  BENCHMARK_CAPTURE (send_message, keyboard_1x2, keyboard_1x2)->Arg (16)->Arg (4096);
+  BENCHMARK_CAPTURE (send_message, keyboard_3x3, keyboard_3x3)->Arg (16)->Arg (4096);
+  BENCHMARK_CAPTURE (send_message, prebuilt_3x3, prebuilt_3x3)->Arg (16)->Arg (4096);
+} // namespace
@@ -0,0 +1,72 @@
+#include "common.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+namespace
+{
+  // roughly the size of a session with a small cache and state
+  struct session
+  {
+    std::int64_t data[8] = {};
+  };
+
+  // chat ids are sparse and signed, like telegram's: users are positive, groups negative
+  auto chat_ids (std::size_t count) -> std::vector<std::int64_t>
+  {
+    auto random = std::mt19937_64 (42);
+    auto result = std::vector<std::int64_t> (count);
+    for (auto& id : result)
+      id = static_cast<std::int64_t> (random () >> 20) * (random () % 2 == 0 ? 1 : -1);
+    return result;
+  }
+
+  /**
+   * Lookup of an existing session, in random order. The argument is the number of sessions.
+   */
+  template<class Store>
+  void session_find (benchmark::State& bench)
+  {
+    auto const ids = chat_ids (static_cast<std::size_t> (bench.range (0)));
+    auto store = Store ();
+    for (auto id : ids)
+      store.find_or_emplace (id, [] { return session {}; });
+
+    auto order = ids;
+    std::ranges::shuffle (order, std::mt19937_64 (7));
+    std::size_t i = 0;
+    for (auto _ : bench) {
+      benchmark::DoNotOptimize (store.find (order[i]));
+      if (++i == order.size ())
+        i = 0;
+    }
+    bench.SetItemsProcessed (bench.iterations ());
+  }
+
+  /**
+   * Creation of a session for every chat, starting from an empty store. The argument is the number of sessions.
+   */
+  template<class Store>
+  void session_insert (benchmark::State& bench)
+  {
+    auto const ids = chat_ids (static_cast<std::size_t> (bench.range (0)));
+    for (auto _ : bench) {
+      auto store = Store ();
+      for (auto id : ids)
+        benchmark::DoNotOptimize (store.find_or_emplace (id, [] { return session {}; }).second);
+    }
+    bench.SetItemsProcessed (bench.iterations () * bench.range (0));
+  }
+
+  using flat_map = forest::flat_session_map<std::int64_t, session>;
+  using ordered_map = forest::ordered_session_map<std::int64_t, session>;
+
+  BENCHMARK_TEMPLATE (session_find, flat_map)->RangeMultiplier (10)->Range (1000, 1000000);
+  BENCHMARK_TEMPLATE (session_find, ordered_map)->RangeMultiplier (10)->Range (1000, 1000000);
+  BENCHMARK_TEMPLATE (session_insert, flat_map)->RangeMultiplier (10)->Range (1000, 100000);
+  BENCHMARK_TEMPLATE (session_insert, ordered_map)->RangeMultiplier (10)->Range (1000, 100000);
+} // namespace
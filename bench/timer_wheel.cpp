@@ -0,0 +1,66 @@
+#include "common.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+namespace
+{
+  // delays up to about an hour in 100ms ticks, spread over the first two levels of the wheel
+  auto delays (std::size_t count) -> std::vector<std::uint64_t>
+  {
+    auto random = std::mt19937_64 (42);
+    auto result = std::vector<std::uint64_t> (count);
+    for (auto& delay : result)
+      delay = random () % 36000;
+    return result;
+  }
+
+  /**
+   * Scheduling then cancelling a timer, as a state that is left before its timeout.
+   * The argument is the number of timers already pending.
+   */
+  void timer_schedule_cancel (benchmark::State& bench)
+  {
+    auto const pending = delays (static_cast<std::size_t> (bench.range (0)));
+    auto wheel = forest::timer_wheel<std::uint64_t> ();
+    for (auto delay : pending)
+      wheel.schedule (delay, delay);
+
+    std::size_t i = 0;
+    for (auto _ : bench) {
+      auto const handle = wheel.schedule (pending[i], i);
+      benchmark::DoNotOptimize (wheel.cancel (handle));
+      if (++i == pending.size ())
+        i = 0;
+    }
+    bench.SetItemsProcessed (bench.iterations ());
+  }
+
+  /**
+   * Turning the wheel until every pending timer has expired. The argument is the number of timers.
+   */
+  void timer_expire (benchmark::State& bench)
+  {
+    auto const pending = delays (static_cast<std::size_t> (bench.range (0)));
+    for (auto _ : bench) {
+      bench.PauseTiming ();
+      auto wheel = forest::timer_wheel<std::uint64_t> ();
+      for (auto delay : pending)
+        wheel.schedule (delay, delay);
+      bench.ResumeTiming ();
+
+      auto expired = std::uint64_t {0};
+      wheel.advance (36000, [&] (std::uint64_t&&) {
+        ++expired;
+      });
+      benchmark::DoNotOptimize (expired);
+    }
+    bench.SetItemsProcessed (bench.iterations () * bench.range (0));
+  }
+
+  BENCHMARK (timer_schedule_cancel)->RangeMultiplier (10)->Range (1000, 1000000);
+  BENCHMARK (timer_expire)->RangeMultiplier (10)->Range (1000, 1000000);
+} // namespace
@@ -0,0 +1,125 @@
+#include "common.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace
+{
+  using forest::bench::null_context;
+  using forest::bench::numbered_state;
+
+  auto transition_text (std::size_t index) -> std::string
+  {
+    return "/t" + std::to_string (index);
+  }
+
+  // fires from numbered_state<I % States> on the message "/tI", by comparing the text in accepts
+  template<std::size_t I, std::size_t States>
+  struct text_transition
+  {
+    std::string text = transition_text (I);
+
+    bool accepts (null_context const&, numbered_state<I % States>&, forest::events::message const& event) const
+    {
+      return event.text == text;
+    }
+
+    auto operator() (null_context const&, numbered_state<I % States>&, forest::events::message const&) const
+    {
+      return numbered_state<(I + 1) % States> {};
+    }
+  };
+
+  // same as text_transition, but matched through the command router of the table
+  template<std::size_t I, std::size_t States>
+  struct routed_transition : text_transition<I, States>
+  {
+    auto command_name () const -> std::string_view
+    {
+      return std::string_view (this->text).substr (1);
+    }
+  };
+
+  template<class Sequence>
+  struct state_variant_of;
+
+  template<std::size_t... Ss>
+  struct state_variant_of<std::index_sequence<Ss...>>
+  {
+    using type = std::variant<numbered_state<Ss>...>;
+  };
+
+  template<std::size_t States>
+  using state_variant = typename state_variant_of<std::make_index_sequence<States>>::type;
+
+  template<template<std::size_t, std::size_t> class T, std::size_t States, std::size_t Transitions>
+  auto make_table ()
+  {
+    return [&]<std::size_t... Ss, std::size_t... Is> (std::index_sequence<Ss...>, std::index_sequence<Is...>) {
+      return forest::make_transition_table<numbered_state<Ss>...> (T<Is, States> {}...);
+    }(std::make_index_sequence<States> (), std::make_index_sequence<Transitions> ());
+  }
+
+  /**
+   * Every message matches the last transition declared for the current state,
+   * the worst case of a scan over the candidates, and moves the session to the next state.
+   */
+  template<template<std::size_t, std::size_t> class T, std::size_t States, std::size_t Transitions>
+  void trigger_hit (benchmark::State& bench)
+  {
+    static_assert (Transitions >= States);
+    auto table = make_table<T, States, Transitions> ();
+    auto texts = std::vector<std::string> (States);
+    for (std::size_t i = 0; i < Transitions; ++i)
+      texts[i % States] = transition_text (i);
+
+    auto cache = std::monostate ();
+    auto const context = null_context {&cache};
+    auto chat_state = typename decltype (table)::chat_state_type ();
+    auto state = state_variant<States> ();
+    auto const on_exit = [] (auto&) {};
+
+    for (auto _ : bench) {
+      auto const event = forest::events::message {texts[state.index ()]};
+      benchmark::DoNotOptimize (table.trigger_in_place (context, state, event, chat_state, on_exit));
+    }
+    bench.SetItemsProcessed (bench.iterations ());
+  }
+
+  /**
+   * A message that no transition accepts, every candidate of the current state is tried.
+   */
+  template<template<std::size_t, std::size_t> class T, std::size_t States, std::size_t Transitions>
+  void trigger_miss (benchmark::State& bench)
+  {
+    auto table = make_table<T, States, Transitions> ();
+    auto cache = std::monostate ();
+    auto const context = null_context {&cache};
+    auto chat_state = typename decltype (table)::chat_state_type ();
+    auto state = state_variant<States> ();
+    auto const on_exit = [] (auto&) {};
+    auto const event = forest::events::message {"/unknown"};
+
+    for (auto _ : bench)
+      benchmark::DoNotOptimize (table.trigger_in_place (context, state, event, chat_state, on_exit));
+    bench.SetItemsProcessed (bench.iterations ());
+  }
+
+  // template arguments: transition kind, number of states, number of transitions
+  BENCHMARK_TEMPLATE (trigger_hit, text_transition, 1, 4);
+  BENCHMARK_TEMPLATE (trigger_hit, text_transition, 1, 32);
+  BENCHMARK_TEMPLATE (trigger_hit, text_transition, 8, 32);
+  BENCHMARK_TEMPLATE (trigger_hit, text_transition, 16, 128);
+  BENCHMARK_TEMPLATE (trigger_hit, routed_transition, 1, 4);
+  BENCHMARK_TEMPLATE (trigger_hit, routed_transition, 1, 32);
+  BENCHMARK_TEMPLATE (trigger_hit, routed_transition, 8, 32);
+  BENCHMARK_TEMPLATE (trigger_hit, routed_transition, 16, 128);
+
+  BENCHMARK_TEMPLATE (trigger_miss, text_transition, 1, 32);
+  BENCHMARK_TEMPLATE (trigger_miss, text_transition, 16, 128);
+  BENCHMARK_TEMPLATE (trigger_miss, routed_transition, 1, 32);
+  BENCHMARK_TEMPLATE (trigger_miss, routed_transition, 16, 128);
+} // namespace
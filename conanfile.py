@@ -10,7 +10,7 @@ class Forest(ConanFile):
     requires = ["sqlite3/3.37.2", "sqlitecpp/3.1.1"]
     settings = ["build_type", "os"]
 
-    exports_sources = "CMakeLists.txt", "include/*", "test/*", "cmake/*"
+    exports_sources = "CMakeLists.txt", "include/*", "test/*", "bench/*", "cmake/*"
     no_copy_source = True
 
     def layout(self):
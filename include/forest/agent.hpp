@@ -0,0 +1,126 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <banana/api.hpp>
+
+#include <forest/send_queue.hpp>
+
+namespace forest
+{
+  /**
+   * An agent delivering messages by itself, such as fake_agent.
+   */
+  template<class T>
+  concept MessageAgent = requires (T& agent, banana::api::send_message_args_t args) {
+    { agent.send_message (std::move (args)) } -> std::same_as<std::future<banana::api::message_t>>;
+  };
+
+  /**
+   * A banana agent, delivering messages through telegram's bot API.
+   */
+  template<class T>
+  concept BananaAgent = requires (T& agent, banana::api::send_message_args_t args) {
+    { banana::api::send_message (agent, std::move (args)) } -> std::same_as<std::future<banana::api::message_t>>;
+  };
+
+  template<class T>
+  concept Agent = MessageAgent<T> || BananaAgent<T>;
+
+  /**
+   * Wraps an agent into the transport used by send_queue. The agent must outlive the transport.
+   */
+  template<Agent T>
+  auto make_transport (T& agent) -> send_queue::transport_type
+  {
+    if constexpr (MessageAgent<T>) {
+      return [&agent] (send_queue::args_type args) {
+        return agent.send_message (std::move (args));
+      };
+    } else {
+      return [&agent] (send_queue::args_type args) {
+        return banana::api::send_message (agent, std::move (args));
+      };
+    }
+  }
+
+  struct fake_agent_options
+  {
+    // simulated round trip of each request, zero answers immediately
+    std::chrono::microseconds latency {0};
+    // keep a copy of every message sent, only useful for small runs
+    bool record = false;
+  };
+
+  /**
+   * In-process agent that never touches the network, for tests and benchmarks.
+   * Every message is answered successfully with a new message id.
+   */
+  class fake_agent
+  {
+  private:
+    fake_agent_options options;
+    std::atomic<std::uint64_t> count = 0;
+    std::mutex mutex;
+    std::vector<banana::api::send_message_args_t> recorded;
+
+  public:
+    explicit fake_agent (fake_agent_options options = {})
+      : options (options)
+    {}
+
+    fake_agent (fake_agent const&) = delete;
+    fake_agent& operator= (fake_agent const&) = delete;
+
+    auto send_message (banana::api::send_message_args_t args) -> std::future<banana::api::message_t>
+    {
+      auto message = banana::api::message_t {};
+      message.message_id = static_cast<banana::integer_t> (count.fetch_add (1, std::memory_order_relaxed) + 1);
+      if (auto const* id = std::get_if<banana::integer_t> (&args.chat_id))
+        message.chat.id = *id;
+      message.text = args.text;
+
+      if (options.record) {
+        auto guard = std::scoped_lock (mutex);
+        recorded.push_back (std::move (args));
+      }
+
+      if (options.latency.count () > 0) {
+        return std::async (std::launch::async, [message = std::move (message), latency = options.latency] {
+          std::this_thread::sleep_for (latency);
+          return message;
+        });
+      }
+      auto promise = std::promise<banana::api::message_t> ();
+      promise.set_value (std::move (message));
+      return promise.get_future ();
+    }
+
+    /**
+     * Number of messages sent so far.
+     */
+    auto sent_count () const -> std::uint64_t
+    {
+      return count.load (std::memory_order_relaxed);
+    }
+
+    /**
+     * Copy of the messages sent so far, empty unless options.record is set.
+     */
+    auto sent_messages () -> std::vector<banana::api::send_message_args_t>
+    {
+      auto guard = std::scoped_lock (mutex);
+      return recorded;
+    }
+  };
+} // namespace forest
@@ -0,0 +1,267 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <future>
+#include <optional>
+#include <stdexcept>
+#include <stop_token>
+#include <string>
+#include <vector>
+
+#include <banana/api.hpp>
+#include <nlohmann/json.hpp>
+
+#include <forest/keyboard.hpp>
+#include <forest/log.hpp>
+#include <forest/persistence.hpp>
+#include <forest/send_queue.hpp>
+#include <forest/value.hpp>
+
+namespace forest
+{
+  struct broadcast_message
+  {
+    std::string text;
+    std::optional<keyboard> buttons;
+  };
+
+  /**
+   * The listed chats or, when with_key is not empty, every chat that has a value stored under that key,
+   * such as context_handler's session_key to reach every chat that ever talked to the bot.
+   */
+  struct broadcast_recipients
+  {
+    std::vector<banana::integer_t> chats;
+    std::string with_key;
+  };
+
+  struct broadcast_options
+  {
+    // messages queued at a time, so that replies to users are not stuck behind the whole broadcast.
+    // Progress is committed after every batch, flushing the write-behind buffer of the storage:
+    // resuming after a crash sends at most one batch again
+    std::size_t batch = 256;
+    // failures kept in the report and in the persisted progress, all of them are counted
+    std::size_t max_failures_kept = 1000;
+    // checked between batches, a stopped broadcast can be resumed
+    std::stop_token stop;
+  };
+
+  struct broadcast_failure
+  {
+    banana::integer_t chat_id;
+    std::string error;
+  };
+
+  struct broadcast_report
+  {
+    std::size_t sent = 0;
+    std::size_t failed = 0;
+    std::vector<broadcast_failure> failures;
+    bool completed = false;
+  };
+
+  namespace detail
+  {
+    // broadcasts are stored under a chat id that telegram never assigns
+    inline constexpr banana::integer_t broadcast_chat = 0;
+    inline constexpr auto broadcast_prefix = "forest.broadcast.";
+    inline constexpr auto broadcast_recipients_prefix = "forest.broadcast_recipients.";
+
+    inline auto dump_keyboard (std::optional<keyboard> const& buttons) -> nlohmann::json
+    {
+      auto rows = nlohmann::json::array ();
+      if (buttons.has_value ()) {
+        for (auto const& row : buttons->markup ()->inline_keyboard) {
+          auto& dumped = rows.emplace_back (nlohmann::json::array ());
+          for (auto const& b : row)
+            dumped.push_back (nlohmann::json::array ({b.text, b.callback_data.value_or ("")}));
+        }
+      }
+      return rows;
+    }
+
+    inline auto load_keyboard (nlohmann::json const& rows) -> std::optional<keyboard>
+    {
+      if (rows.empty ())
+        return std::nullopt;
+      auto markup = keyboard::markup_type ();
+      for (auto const& row : rows) {
+        auto& loaded = markup.inline_keyboard.emplace_back ();
+        for (auto const& b : row)
+          loaded.push_back (banana::api::inline_keyboard_button_t {
+            .text = b[0].get<std::string> (),
+            .callback_data = b[1].get<std::string> (),
+          });
+      }
+      return keyboard (std::move (markup));
+    }
+
+    inline auto load_report (nlohmann::json const& progress) -> broadcast_report
+    {
+      auto report = broadcast_report {};
+      report.sent = progress.at ("sent").get<std::size_t> ();
+      report.failed = progress.at ("failed").get<std::size_t> ();
+      for (auto const& failure : progress.at ("failures"))
+        report.failures.push_back ({failure[0].get<banana::integer_t> (), failure[1].get<std::string> ()});
+      report.completed = progress.at ("completed").get<bool> ();
+      return report;
+    }
+
+    // sends to the recipients, which follow the persisted cursor, updating progress after every batch
+    inline auto run_broadcast (send_queue& outbox,
+      persistence& storage,
+      std::string const& id,
+      nlohmann::json& progress,
+      std::vector<banana::integer_t> const& recipients,
+      broadcast_options const& options) -> broadcast_report
+    {
+      auto const key = broadcast_prefix + id;
+      auto report = load_report (progress);
+
+      // the request is built once, recipients only change its chat id, the keyboard is shared
+      auto const buttons = load_keyboard (progress.at ("keyboard"));
+      auto const markup = buttons.has_value () ? buttons->markup () : nullptr;
+      auto request = send_queue::args_type {
+        .chat_id = broadcast_chat,
+        .text = progress.at ("text").get<std::string> (),
+      };
+
+      auto const batch = std::max<std::size_t> (options.batch, 1);
+      auto futures = std::vector<std::future<banana::api::message_t>> ();
+      for (std::size_t begin = 0; begin < recipients.size (); begin += batch) {
+        if (options.stop.stop_requested ())
+          return report;
+
+        auto const end = std::min (begin + batch, recipients.size ());
+        futures.clear ();
+        for (auto i = begin; i < end; ++i) {
+          request.chat_id = recipients[i];
+          futures.push_back (outbox.enqueue (request, markup));
+        }
+
+        for (auto i = begin; i < end; ++i) {
+          try {
+            futures[i - begin].get ();
+            ++report.sent;
+          } catch (std::exception& e) {
+            ++report.failed;
+            if (report.failures.size () < options.max_failures_kept) {
+              report.failures.push_back ({recipients[i], e.what ()});
+              progress["failures"].push_back (nlohmann::json::array ({recipients[i], e.what ()}));
+            }
+          }
+        }
+
+        progress["cursor"] = recipients[end - 1];
+        progress["sent"] = report.sent;
+        progress["failed"] = report.failed;
+        storage.set_value_json (broadcast_chat, key, progress);
+        storage.flush ();
+      }
+
+      report.completed = true;
+      progress["completed"] = true;
+      storage.set_value_json (broadcast_chat, key, progress);
+      storage.delete_value (broadcast_chat, broadcast_recipients_prefix + id);
+      storage.flush ();
+      log<log_level::info> (
+        "Broadcast ", id, " completed: ", report.sent, " sent, ", report.failed, " failed");
+      return report;
+    }
+  } // namespace detail
+
+  /**
+   * Sends the same message to many chats through a send queue, within its rate limits, blocking until done.
+   * Progress is persisted under id, which must be new, so that resume_broadcast can finish the broadcast
+   * after a crash or a stop request. Recipients are served in ascending chat id order, duplicates once.
+   * Throws std::invalid_argument if the id is taken, also by a broadcast starting concurrently.
+   */
+  inline auto broadcast (send_queue& outbox,
+    persistence& storage,
+    std::string const& id,
+    broadcast_message const& message,
+    broadcast_recipients recipients,
+    broadcast_options const& options = {}) -> broadcast_report
+  {
+    auto progress = nlohmann::json {
+      {"text", message.text},
+      {"keyboard", detail::dump_keyboard (message.buttons)},
+      {"with_key", recipients.with_key},
+      {"cursor", nullptr},
+      {"sent", 0},
+      {"failed", 0},
+      {"failures", nlohmann::json::array ()},
+      {"completed", false},
+    };
+    // the id is claimed before anything else is written under it
+    if (!storage.insert (detail::broadcast_chat, detail::broadcast_prefix + id, progress))
+      throw std::invalid_argument ("forest: broadcast " + id + " already exists");
+
+    auto& chats = recipients.chats;
+    if (recipients.with_key.empty ()) {
+      std::ranges::sort (chats);
+      chats.erase (std::ranges::unique (chats).begin (), chats.end ());
+      // the query is run again on resume, an explicit list has to be stored
+      storage.set_value_json (detail::broadcast_chat, detail::broadcast_recipients_prefix + id, chats);
+      storage.flush ();
+    } else {
+      chats = storage.chats_with (recipients.with_key);
+    }
+    return detail::run_broadcast (outbox, storage, id, progress, chats, options);
+  }
+
+  /**
+   * Continues a broadcast from the last persisted batch.
+   * Returns nullopt if there is no broadcast with this id, the final report if it had already completed.
+   */
+  inline auto resume_broadcast (send_queue& outbox,
+    persistence& storage,
+    std::string const& id,
+    broadcast_options const& options = {}) -> std::optional<broadcast_report>
+  {
+    auto const key = detail::broadcast_prefix + id;
+    auto progress = storage.get_value_json (detail::broadcast_chat, key);
+    if (!progress.has_value ())
+      return std::nullopt;
+
+    if (progress->at ("completed").get<bool> ())
+      return detail::load_report (*progress);
+
+    auto const with_key = progress->at ("with_key").get<std::string> ();
+    auto const cursor = progress->at ("cursor");
+    auto recipients = std::vector<banana::integer_t> ();
+    if (with_key.empty ()) {
+      auto const stored =
+        storage.get_value_json (detail::broadcast_chat, detail::broadcast_recipients_prefix + id);
+      recipients = stored.value_or (nlohmann::json::array ()).get<std::vector<banana::integer_t>> ();
+      if (!cursor.is_null ()) {
+        auto const done = std::ranges::upper_bound (recipients, cursor.get<banana::integer_t> ());
+        recipients.erase (recipients.begin (), done);
+      }
+    } else {
+      recipients = cursor.is_null () ? storage.chats_with (with_key)
+                                     : storage.chats_with (with_key, cursor.get<banana::integer_t> ());
+    }
+    return detail::run_broadcast (outbox, storage, id, *progress, recipients, options);
+  }
+
+  /**
+   * Ids of the broadcasts that were started and have not completed, to be resumed at startup.
+   */
+  inline auto unfinished_broadcasts (persistence& storage) -> std::vector<std::string>
+  {
+    auto result = std::vector<std::string> ();
+    auto const prefix = std::string (detail::broadcast_prefix);
+    for (auto const& [name, value] : storage.scan_prefix (detail::broadcast_chat, prefix)) {
+      try {
+        if (!value_traits<nlohmann::json>::decode (value).at ("completed").get<bool> ())
+          result.push_back (name.substr (prefix.size ()));
+      } catch (std::exception& e) {
+        log<log_level::warning> ("Skipping malformed broadcast ", name, ": ", e.what ());
+      }
+    }
+    return result;
+  }
+} // namespace forest
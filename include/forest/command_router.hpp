@@ -0,0 +1,198 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace forest
+{
+  /**
+   * A bot command split into its parts, as views into the text of the message.
+   */
+  struct command_line
+  {
+    // command name without the leading slash
+    std::string_view name;
+    // username following '@', empty when the command does not name a bot
+    std::string_view bot;
+    // text following the command, without surrounding whitespace
+    std::string_view arguments;
+  };
+
+  constexpr auto is_space (char c) -> bool
+  {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+  }
+
+  constexpr auto trim (std::string_view text) -> std::string_view
+  {
+    while (!text.empty () && is_space (text.front ()))
+      text.remove_prefix (1);
+    while (!text.empty () && is_space (text.back ()))
+      text.remove_suffix (1);
+    return text;
+  }
+
+  /**
+   * Parses "/name[@bot] arguments", returns nullopt if text is not a command.
+   */
+  constexpr auto parse_command (std::string_view text) -> std::optional<command_line>
+  {
+    if (!text.starts_with ('/'))
+      return std::nullopt;
+
+    auto const end = static_cast<std::size_t> (std::ranges::find_if (text, is_space) - text.begin ());
+    auto const token = text.substr (1, end - 1);
+    auto const at = token.find ('@');
+
+    auto result = command_line {token.substr (0, at), {}, trim (text.substr (end))};
+    if (at != std::string_view::npos)
+      result.bot = token.substr (at + 1);
+    if (result.name.empty ())
+      return std::nullopt;
+    return result;
+  }
+
+  /**
+   * Splits command arguments on whitespace.
+   * Double quotes group words into a single argument, a backslash escapes the character that follows it.
+   */
+  inline auto tokenize_arguments (std::string_view arguments) -> std::vector<std::string>
+  {
+    auto result = std::vector<std::string> ();
+    auto current = std::string ();
+    auto in_token = false;
+    auto quoted = false;
+
+    for (std::size_t i = 0; i < arguments.size (); ++i) {
+      char const c = arguments[i];
+      if (c == '\\' && i + 1 < arguments.size ()) {
+        current += arguments[++i];
+        in_token = true;
+      } else if (c == '"') {
+        quoted = !quoted;
+        in_token = true;
+      } else if (is_space (c) && !quoted) {
+        if (in_token)
+          result.push_back (std::exchange (current, {}));
+        in_token = false;
+      } else {
+        current += c;
+        in_token = true;
+      }
+    }
+    if (in_token)
+      result.push_back (std::move (current));
+    return result;
+  }
+
+  /**
+   * Trie of command names. A message is routed by walking its command token once,
+   * so dispatch costs O(length of the command) whatever the number of registered commands.
+   * Only a whole token matches: "/rollall" routes to rollall and never to roll.
+   */
+  class command_router
+  {
+  public:
+    static constexpr auto npos = static_cast<std::size_t> (-1);
+
+  private:
+    struct node
+    {
+      // sorted by character
+      std::vector<std::pair<char, std::uint32_t>> children;
+      std::size_t command = npos;
+    };
+
+    std::vector<node> nodes;
+    std::size_t commands = 0;
+    std::string username;
+
+    auto child (std::uint32_t parent, char c) const -> std::uint32_t
+    {
+      auto const& children = nodes[parent].children;
+      auto it = std::ranges::lower_bound (children, c, {}, &std::pair<char, std::uint32_t>::first);
+      return it != children.end () && it->first == c ? it->second : 0;
+    }
+
+    static auto equals_ignore_case (std::string_view lhs, std::string_view rhs) -> bool
+    {
+      auto const lower = [] (char c) {
+        return c >= 'A' && c <= 'Z' ? static_cast<char> (c - 'A' + 'a') : c;
+      };
+      return std::ranges::equal (lhs, rhs, {}, lower, lower);
+    }
+
+  public:
+    command_router ()
+      : nodes (1)
+    {}
+
+    /**
+     * Registers a command, with or without the leading slash, and returns its id.
+     * Registering the same name again returns the same id.
+     */
+    auto add (std::string_view name) -> std::size_t
+    {
+      if (name.starts_with ('/'))
+        name.remove_prefix (1);
+
+      std::uint32_t current = 0;
+      for (char c : name) {
+        auto next = child (current, c);
+        if (next == 0) {
+          next = static_cast<std::uint32_t> (nodes.size ());
+          nodes.emplace_back ();
+          auto& children = nodes[current].children;
+          children.insert (std::ranges::upper_bound (children, c, {}, &std::pair<char, std::uint32_t>::first),
+            {c, next});
+        }
+        current = next;
+      }
+
+      if (nodes[current].command == npos)
+        nodes[current].command = commands++;
+      return nodes[current].command;
+    }
+
+    /**
+     * Commands naming another bot with "/name@bot" are ignored once the username is set.
+     */
+    auto set_username (std::string name) -> void
+    {
+      username = std::move (name);
+    }
+
+    auto size () const -> std::size_t
+    {
+      return commands;
+    }
+
+    /**
+     * Id of the command addressed by text, or npos.
+     */
+    auto route (std::string_view text) const -> std::size_t
+    {
+      if (!text.starts_with ('/'))
+        return npos;
+
+      std::uint32_t current = 0;
+      std::size_t i = 1;
+      for (; i < text.size () && text[i] != '@' && !is_space (text[i]); ++i)
+        if ((current = child (current, text[i])) == 0)
+          return npos;
+
+      if (i < text.size () && text[i] == '@' && !username.empty ()) {
+        auto bot = text.substr (i + 1);
+        bot = bot.substr (0, static_cast<std::size_t> (std::ranges::find_if (bot, is_space) - bot.begin ()));
+        if (!equals_ignore_case (bot, username))
+          return npos;
+      }
+      return nodes[current].command;
+    }
+  };
+} // namespace forest
@@ -0,0 +1,184 @@
+#pragma once
+#include <concepts>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+#include <forest/in_place_state.hpp>
+#include <forest/task.hpp>
+
+namespace forest
+{
+  /**
+   * State owning a nested state machine: one of the states of Table, its active child, and the per_chat
+   * transitions of Table. Register Table in the parent table with sub_table.
+   * Events are offered to the transitions of Table from the active child first, those it does not handle
+   * bubble up to the transitions of the parent table from the composite, so that behaviour shared by
+   * every child, such as /cancel, is declared once. The command transitions of the composite itself are
+   * matched before the children, so that a child accepting any message does not hide them.
+   * A child transition returning a state of Table moves within the composite, one returning a state
+   * of the parent table leaves it. on_entry and on_exit are forwarded to the active child.
+   *
+   *   struct signup : forest::composite_state<signup_table>
+   *   {
+   *     using composite_state::composite_state;
+   *   };
+   */
+  template<class Table>
+  class composite_state
+  {
+  public:
+    using table_type = Table;
+    using child_type = typename Table::state_type;
+
+  private:
+    child_type current;
+    typename Table::chat_state_type transitions {};
+
+    template<class Ctx, class Hook>
+    static constexpr bool async_hook = []<std::size_t... Is> (std::index_sequence<Is...>) {
+      return (Task<std::invoke_result_t<Hook&, std::variant_alternative_t<Is, child_type>&, Ctx const&>> ||
+        ...);
+    }(std::make_index_sequence<std::variant_size_v<child_type>> ());
+
+    static auto completed () -> task<void>
+    {
+      co_return;
+    }
+
+    // a task if the hook of any child is a coroutine, so that the composite has a single hook type
+    template<class Ctx, class Hook>
+    auto forward (Ctx const& ctx, Hook hook)
+    {
+      return std::visit (
+        [&] (auto& child) {
+          if constexpr (!async_hook<Ctx, Hook>)
+            hook (child, ctx);
+          else if constexpr (Task<decltype (hook (child, ctx))>)
+            return hook (child, ctx);
+          else
+            return (hook (child, ctx), completed ());
+        },
+        current);
+    }
+
+  public:
+    template<class S>
+      requires (!std::derived_from<std::remove_cvref_t<S>, composite_state> &&
+        std::constructible_from<child_type, S &&>)
+    composite_state (S&& initial)
+      : current (std::forward<S> (initial))
+    {}
+
+    auto child () -> child_type&
+    {
+      return current;
+    }
+
+    auto child () const -> child_type const&
+    {
+      return current;
+    }
+
+    auto child_transitions () -> typename Table::chat_state_type&
+    {
+      return transitions;
+    }
+
+    template<class Ctx>
+    auto on_entry (Ctx const& ctx)
+    {
+      return forward (ctx, [] (auto& child, Ctx const& c) {
+        return child.on_entry (c);
+      });
+    }
+
+    template<class Ctx>
+    auto on_exit (Ctx const& ctx)
+    {
+      return forward (ctx, [] (auto& child, Ctx const& c) {
+        return child.on_exit (c);
+      });
+    }
+  };
+
+  template<class T>
+  concept CompositeState = requires
+  {
+    typename T::table_type;
+    requires std::derived_from<T, composite_state<typename T::table_type>>;
+  };
+
+  /**
+   * Entry of a parent transition_table holding the nested table of the composite state Composite.
+   */
+  template<class Composite, class Table>
+  struct nested_table
+  {
+    using composite_type = Composite;
+
+    Table table;
+  };
+
+  template<class Composite, class Table>
+    requires std::derived_from<Composite, composite_state<Table>>
+  auto sub_table (Table table) -> nested_table<Composite, Table>
+  {
+    return {std::move (table)};
+  }
+
+  /**
+   * Result of a nested table that stays within the composite: next replaces the active child.
+   * Built by transition_table, not by transitions.
+   */
+  template<class Composite, class Next>
+  struct nested_state
+  {
+    using composite_type = Composite;
+
+    Next next;
+  };
+
+  template<class T, class Composite>
+  inline constexpr bool is_sub_table_of = false;
+
+  template<class Composite, class Table>
+  inline constexpr bool is_sub_table_of<nested_table<Composite, Table>, Composite> = true;
+
+  template<class T>
+  struct is_nested_state : std::false_type
+  {};
+
+  template<class Composite, class Next>
+  struct is_nested_state<nested_state<Composite, Next>> : std::true_type
+  {};
+
+  namespace detail
+  {
+    // the state a transition result leads to
+    template<class R>
+    struct result_state
+    {
+      using type = R;
+    };
+
+    template<InPlaceState R>
+    struct result_state<R>
+    {
+      using type = typename R::state_type;
+    };
+
+    template<class Composite, class Next>
+    struct result_state<nested_state<Composite, Next>>
+    {
+      using type = Composite;
+    };
+
+    template<class T, class Variant>
+    inline constexpr bool is_alternative = false;
+
+    template<class T, class... Ts>
+    inline constexpr bool is_alternative<T, std::variant<Ts...>> = (std::same_as<T, Ts> || ...);
+  } // namespace detail
+} // namespace forest
@@ -0,0 +1,24 @@
+#pragma once
+#include <concepts>
+#include <type_traits>
+#include <utility>
+
+#include <nlohmann/json.hpp>
+
+namespace forest
+{
+  /**
+   * Types that can be stored in a session snapshot.
+   * Empty types (std::monostate, states without data) are trivially serializable,
+   * other types need nlohmann::json to_json/from_json overloads.
+   */
+  template<class T>
+  concept Serializable = (std::is_empty_v<T> && std::default_initializable<T>) || requires (nlohmann::json json, T value)
+  {
+    // clang-format off
+    requires std::default_initializable<T>;
+    nlohmann::to_json (json, std::as_const (value));
+    nlohmann::from_json (std::as_const (json), value);
+    // clang-format on
+  };
+} // namespace forest
@@ -7,7 +7,8 @@ namespace forest
   concept State = requires (T state)
   {
     // clang-format off
-    requires std::copy_constructible<T>;
+    // states are moved into the session, never copied
+    requires std::move_constructible<T>;
 
     requires requires (ContextType ctx) {
       { state.on_entry(ctx) };
@@ -1,22 +1,41 @@
 #pragma once
 #include <concepts>
+#include <type_traits>
 
 #include <forest/concepts/context.hpp>
 #include <forest/concepts/state.hpp>
+#include <forest/in_place_state.hpp>
+#include <forest/task.hpp>
 
 namespace forest
 {
+  template<class T, class ContextType>
+  concept NextState = State<T, ContextType> ||
+    (InPlaceState<T> && State<typename std::remove_cvref_t<T>::state_type, ContextType>);
+
+  /**
+   * A transition returns the next state by value, or an in_place_state constructing it in the session,
+   * or a task producing one of them when it has to wait for I/O (see context_handler).
+   */
+  template<class T, class ContextType>
+  concept TransitionResult = NextState<T, ContextType> ||
+    (Task<T> && NextState<typename std::remove_cvref_t<T>::value_type, ContextType>);
+
+  /**
+   * T may be const qualified: the transitions of a shared table are called through const references.
+   */
   template<class T, class ContextType, class StateType, class EventType>
-  concept Transition = requires (T transition)
+  concept Transition = requires (T& transition)
   {
     // clang-format off
-    requires std::copy_constructible<T>;
+    requires std::move_constructible<std::remove_cv_t<T>>;
     requires Context<ContextType>;
     requires State<StateType, ContextType>;
 
-    requires requires (ContextType ctx, StateType state, EventType event)
+    // contexts and events are passed by const reference along the dispatch path
+    requires requires (ContextType const& ctx, StateType& state, EventType const& event)
     {
-      { transition(ctx, state, event) } -> State<ContextType>;
+      { transition(ctx, state, event) } -> TransitionResult<ContextType>;
       { transition.accepts(ctx, state, event) } -> std::same_as<bool>;
     };
     // clang-format on
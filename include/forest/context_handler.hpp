@@ -1,36 +1,49 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <concepts>
-#include <iostream>
-#include <map>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
 #include <vector>
 
-#include <banana/agent/cpr.hpp>
 #include <banana/api.hpp>
 
+#include <forest/agent.hpp>
+#include <forest/broadcast.hpp>
 #include <forest/concepts/context.hpp>
 #include <forest/concepts/event.hpp>
 #include <forest/concepts/state.hpp>
 #include <forest/concepts/transition.hpp>
+#include <forest/dispatcher.hpp>
 #include <forest/events/button_pressed.hpp>
 #include <forest/events/message.hpp>
+#include <forest/events/timeout.hpp>
+#include <forest/events/update.hpp>
+#include <forest/keyboard.hpp>
+#include <forest/log.hpp>
+#include <forest/metrics.hpp>
 #include <forest/persistence.hpp>
+#include <forest/scheduler.hpp>
+#include <forest/send_queue.hpp>
+#include <forest/serialization.hpp>
+#include <forest/session_store.hpp>
+#include <forest/task.hpp>
 #include <forest/transition_table.hpp>
 
 namespace forest
 {
-  class button
-  {
-  public:
-    std::string id;
-    std::string text;
-
-    button (std::string id, std::string text)
-      : id (id)
-      , text (text)
-    {}
-  };
-
   template<std::copy_constructible T = std::monostate>
   class context
   {
@@ -41,17 +54,30 @@ namespace forest
   private:
     banana::integer_t chat_id;
     std::reference_wrapper<T> cache_ref;
-    std::reference_wrapper<banana::agent::cpr_async> agent_ref;
+    std::reference_wrapper<send_queue> outbox_ref;
     std::reference_wrapper<persistence> persistence_ref;
+    scheduler* timers = nullptr;
+
+    auto timer_scheduler () const -> scheduler&
+    {
+      if (timers == nullptr)
+        throw std::logic_error ("forest: this context has no scheduler");
+      return *timers;
+    }
 
   public:
     context () = default;
 
-    context (banana::integer_t chat_id, T& cache_ref, banana::agent::cpr_async& agent_ref, persistence& ref)
+    context (banana::integer_t chat_id,
+      T& cache_ref,
+      send_queue& outbox_ref,
+      persistence& ref,
+      scheduler* timers = nullptr)
       : chat_id (chat_id)
       , cache_ref (cache_ref)
-      , agent_ref (agent_ref)
+      , outbox_ref (outbox_ref)
       , persistence_ref (ref)
+      , timers (timers)
     {}
 
     auto get_cache () const -> cache_reference
@@ -64,24 +90,45 @@ namespace forest
       cache_ref.get () = std::move (cache);
     }
 
-    auto send_message (std::string text, std::initializer_list<std::initializer_list<button>> buttons = {}) const -> void
+    /**
+     * Queues the message on the handler's send queue without waiting for the network.
+     * The returned future can be ignored, or used to wait for delivery.
+     * Keyboards sent repeatedly are better built once, see the overload taking a keyboard.
+     */
+    auto send_message (std::string text, std::initializer_list<std::initializer_list<button>> buttons = {}) const
+      -> std::future<banana::api::message_t>
     {
-      if (buttons.size () == 0) {
-        banana::api::send_message (agent_ref.get (), {.chat_id = chat_id, .text = std::move (text)});
-      } else {
-        auto markup = banana::api::inline_keyboard_markup_t ();
-        for (auto row : buttons) {
-          auto curr_row = std::vector<banana::api::inline_keyboard_button_t> ();
-          for (auto button : row) {
-            curr_row.push_back (
-              banana::api::inline_keyboard_button_t {.text = button.text, .callback_data = button.id});
-          }
-          markup.inline_keyboard.push_back (curr_row);
-        }
-        std::cerr << "Sending message with " << markup.inline_keyboard.size () << " button rows" << std::endl;
-        banana::api::send_message (agent_ref.get (),
-          {.chat_id = chat_id, .text = std::move (text), .reply_markup = markup});
-      }
+      if (buttons.size () == 0)
+        return outbox_ref.get ().enqueue ({.chat_id = chat_id, .text = std::move (text)});
+      return send_message (std::move (text), keyboard (buttons));
+    }
+
+    /**
+     * Same as above, with a prebuilt keyboard that is shared with the request instead of being copied.
+     */
+    auto send_message (std::string text, keyboard const& buttons) const -> std::future<banana::api::message_t>
+    {
+      log<log_level::debug> ("Sending message with ", buttons.rows (), " button rows");
+      return outbox_ref.get ().enqueue ({.chat_id = chat_id, .text = std::move (text)}, buttons.markup ());
+    }
+
+    // === timers
+
+    /**
+     * Delivers events::timeout {id, payload} to this chat after delay, see timeout_transition.
+     * Timers are persisted: one that expires while the bot is down fires when it is back.
+     */
+    auto schedule (std::chrono::steady_clock::duration delay, std::string payload = {}) const -> timer_id
+    {
+      return timer_scheduler ().schedule (chat_id, delay, std::move (payload));
+    }
+
+    /**
+     * Cancels a timer of this chat, returns false if it has already fired.
+     */
+    auto cancel_timer (timer_id id) const -> bool
+    {
+      return timer_scheduler ().cancel (chat_id, id);
     }
 
     // === persistence
@@ -116,6 +163,33 @@ namespace forest
       return persistence_ref.get ().set_value_json (chat_id, kName, json);
     }
 
+    template<StorableValue V>
+    std::optional<V> get (std::string const& kName) const
+    {
+      return persistence_ref.get ().template get<V> (chat_id, kName);
+    }
+
+    template<StorableValue V>
+    bool set (std::string kName, V const& kValue) const
+    {
+      return persistence_ref.get ().set (chat_id, std::move (kName), kValue);
+    }
+
+    value_map get_values (std::vector<std::string> const& names) const
+    {
+      return persistence_ref.get ().get_values (chat_id, names);
+    }
+
+    bool set_values (value_map values) const
+    {
+      return persistence_ref.get ().set_values (chat_id, std::move (values));
+    }
+
+    value_map scan_prefix (std::string const& prefix) const
+    {
+      return persistence_ref.get ().scan_prefix (chat_id, prefix);
+    }
+
     bool delete_value (std::string kName) const
     {
       return persistence_ref.get ().delete_value (chat_id, kName);
@@ -124,113 +198,936 @@ namespace forest
 
   // ---
 
-  template<std::copy_constructible Cache, class Table>
+  template<std::copy_constructible Cache, class Table, template<class, class> class Store = flat_session_map>
   class context_handler;
 
-  template<std::copy_constructible Cache, class... States, class... Transitions>
-  class context_handler<Cache, transition_table<std::variant<States...>, Transitions...>>
+  template<std::copy_constructible Cache,
+    class... States,
+    class... Transitions,
+    template<class, class>
+    class Store>
+  class context_handler<Cache, transition_table<std::variant<States...>, Transitions...>, Store>
   {
   public:
     using cache_type = Cache;
     using table_type = transition_table<std::variant<States...>, Transitions...>;
     using state_type = std::variant<States...>;
     using chat_id_type = banana::integer_t;
-    using agent_type = banana::agent::cpr_async;
     using context_type = context<cache_type>;
+    using clock = std::chrono::steady_clock;
+
+    // number of independently locked partitions of the session map
+    static constexpr std::size_t session_shards = 64;
+
+    // sessions can be checkpointed and spilled to persistence, then restored
+    static constexpr bool serializable_sessions =
+      SerializableSession<cache_type> && SerializableSession<state_type>;
+
+    // persistence key under which the snapshot of a session is stored
+    static constexpr auto session_key = "forest.session";
 
   private:
+    using queued_event = std::variant<banana::api::update_t, fired_timer>;
+
     struct context_storage
     {
       cache_type cache;
-      table_type table;
       state_type state;
+      // copies of the per_chat transitions, the table itself is shared by every session
+      [[no_unique_address]] typename table_type::chat_state_type transitions {};
+      clock::time_point last_used {};
+      // changed since it was last written to persistence
+      bool dirty = true;
+      // set while a thread or a coroutine owns the session, holds the updates and timers of the chat arriving
+      // meanwhile. An owned session is used without the lock of its shard
+      std::unique_ptr<std::deque<queued_event>> busy {};
+    };
+
+    using store_type = Store<chat_id_type, context_storage>;
+    static_assert (SessionStore<store_type, chat_id_type, context_storage>);
+
+    struct handler_metrics
+    {
+      metric_counter updates;
+      // events for which no transition fired
+      metric_counter unhandled;
+      metric_counter timeouts;
+      latency_histogram update_duration;
+      // indexed by transition, the count of a histogram is the number of times the transition fired
+      std::array<latency_histogram, sizeof...(Transitions)> transitions;
+      // indexed by state
+      std::array<latency_histogram, sizeof...(States)> on_entry;
+      std::array<latency_histogram, sizeof...(States)> on_exit;
+    };
+
+    // snapshot taken under the lock of the shard, written to persistence after it is released
+    struct staged_snapshot
+    {
+      std::shared_ptr<nlohmann::json const> snapshot;
+      // incremented when a newer snapshot of the chat is staged while the previous one is being written
+      std::uint64_t version = 0;
+      bool writing = false;
     };
 
-    std::map<chat_id_type, context_storage> context_map;
-    std::reference_wrapper<agent_type> agent_ref;
+    struct session_shard
+    {
+      std::mutex mutex;
+      store_type context_map;
+      clock::time_point next_sweep {};
+      // sessions owned by a thread or a coroutine, which cannot be evicted
+      std::size_t busy = 0;
+      // snapshots not written yet, more recent than the ones in persistence
+      std::unordered_map<chat_id_type, staged_snapshot> staged;
+    };
+
+    std::array<session_shard, session_shards> shards;
     cache_type cache_init;
-    table_type table_init;
+    // read concurrently by the threads handling updates
+    table_type table;
     state_type state_init;
     persistence persistent_storage;
+    session_limits limits;
+    send_queue outbox;
+    handler_metrics metrics;
+    std::array<std::string, sizeof...(Transitions)> transition_names;
+    // sessions owned by a coroutine
+    std::atomic<std::size_t> suspended_sessions = 0;
+    scheduler timers;
+    std::jthread checkpointer;
+    // declared last: workers are joined before the sessions they operate on are destroyed
+    std::unique_ptr<dispatcher> workers;
 
   public:
-    context_handler (agent_type& agent, cache_type cache, table_type table, state_type state, std::string db_filename)
-      : context_map ()
-      , agent_ref (agent)
+    /**
+     * The agent delivers the messages sent by the bot and must outlive the handler:
+     * a banana agent talks to telegram, a fake_agent keeps everything in process.
+     */
+    template<Agent AgentType>
+    context_handler (AgentType& agent,
+      cache_type cache,
+      table_type table,
+      state_type state,
+      std::string db_filename,
+      send_queue_options outbox_options = {},
+      persistence_options storage_options = {})
+      : shards ()
       , cache_init (std::move (cache))
-      , table_init (std::move (table))
+      , table (std::move (table))
       , state_init (std::move (state))
-      , persistent_storage (db_filename)
+      , persistent_storage (db_filename, storage_options)
+      , limits ()
+      , outbox (make_transport (agent), outbox_options)
+      , metrics ()
+      , transition_names (this->table.transition_names ())
+      , suspended_sessions ()
+      , timers (persistent_storage)
+      , checkpointer ()
+      , workers ()
     {}
 
-    void handle_update (banana::api::update_t update)
+    ~context_handler ()
+    {
+      // expired timers are handed to the workers
+      timers.stop ();
+      workers.reset ();
+      wait_suspended ();
+      if constexpr (serializable_sessions) {
+        if (checkpointer.joinable ()) {
+          checkpointer.request_stop ();
+          checkpointer.join ();
+          checkpoint ();
+        }
+      }
+    }
+
+    /**
+     * Processes an update on the calling thread. Safe to call concurrently from multiple threads,
+     * updates for the same chat are serialized: one arriving while another thread handles the chat is queued,
+     * and handled by that thread before it returns. Transitions run without holding any lock shared with other chats,
+     * and so do the reads and writes of the snapshots of evicted sessions.
+     *
+     * Transitions may return a task, and on_entry and on_exit may return a task<void>, to wait for I/O
+     * without holding the thread: the chat is suspended until the coroutine completes, its updates are queued
+     * in the meantime and processed in order afterwards, by the thread that completed the coroutine.
+     * Other chats are served as usual. The state and the cache of a suspended chat stay in place,
+     * but views into the update, such as a std::string_view argument, do not outlive the first suspension,
+     * and coroutines should take the context by value.
+     */
+    void handle_update (banana::api::update_t const& update)
+    {
+      metrics.updates.add ();
+      auto timer = scoped_timer (metrics.update_duration);
+      route_update (update, false);
+    }
+
+    /**
+     * Starts a pool of worker threads used by dispatch_update.
+     * With a queue limit, dispatch_update blocks while the worker of the chat has that many updates queued,
+     * which propagates backpressure to the source of the updates.
+     * Must not be called while updates are being dispatched.
+     */
+    void enable_dispatcher (std::size_t num_workers = std::thread::hardware_concurrency (), std::size_t queue_limit = 0)
     {
-      if (auto message = update.message; message.has_value ()) {
-        auto chat_id = message->chat.id;
-        auto event = events::message {message->text.value ()};
+      workers = std::make_unique<dispatcher> (num_workers, dispatcher::error_handler_type (), queue_limit);
+    }
+
+    /**
+     * Queues the update on the worker owning its chat and returns immediately.
+     * Updates of the same chat are processed in order, different chats are processed in parallel.
+     * Falls back to handle_update when the dispatcher is not enabled.
+     */
+    void dispatch_update (banana::api::update_t update)
+    {
+      auto chat_id = update_chat_id (update);
+      if (!workers || !chat_id.has_value ()) {
+        handle_update (update);
+        return;
+      }
+
+      workers->post (static_cast<std::uint64_t> (chat_id.value ()), [this, update = std::move (update)] {
+        handle_update (update);
+      });
+    }
+
+    /**
+     * Blocks until all dispatched updates have been processed, including those of suspended chats.
+     */
+    void wait_idle ()
+    {
+      if (workers)
+        workers->wait_idle ();
+      wait_suspended ();
+    }
+
+    /**
+     * Bounds the number of sessions kept in memory, see session_limits.
+     * max_sessions is split evenly across the shards, so it is enforced approximately.
+     * Must not be called while updates are being processed.
+     */
+    void set_session_limits (session_limits new_limits)
+      requires (serializable_sessions)
+    {
+      limits = new_limits;
+    }
+
+    /**
+     * Makes the command transitions ignore commands addressed to other bots with "/command@username".
+     * Must not be called while updates are being processed.
+     */
+    void set_bot_username (std::string username)
+    {
+      table.set_bot_username (std::move (username));
+    }
+
+    /**
+     * Evicts the sessions idle for longer than the configured idle timeout.
+     * Sweeps also happen lazily while handling updates, this forces a sweep of every shard.
+     */
+    void evict_idle_sessions ()
+    {
+      auto const now = clock::now ();
+      for (auto& shard : shards) {
+        auto lock = std::unique_lock (shard.mutex);
+        shard.next_sweep = {};
+        auto const evicted = enforce_limits (shard, now);
+        lock.unlock ();
+        write_staged (shard, evicted);
+      }
+    }
+
+    /**
+     * Writes the snapshot of every session changed since the previous checkpoint.
+     * Sessions are restored lazily, when their chat sends the next update, so restarts do not load the whole table.
+     */
+    void checkpoint ()
+      requires (serializable_sessions)
+    {
+      for (auto& shard : shards) {
+        auto lock = std::unique_lock (shard.mutex);
+        // busy sessions are written by a later checkpoint, once released
+        shard.context_map.for_each ([&] (chat_id_type chat_id, context_storage& storage) {
+          if (!storage.busy)
+            stage (shard, chat_id, storage);
+        });
+        // including the snapshots whose write failed before
+        auto chats = std::vector<chat_id_type> ();
+        for (auto const& [chat_id, staged] : shard.staged)
+          chats.push_back (chat_id);
+        lock.unlock ();
+        write_staged (shard, chats);
+      }
+    }
+
+    /**
+     * Restores the timers persisted by a previous run and starts delivering the timers scheduled
+     * with context::schedule, as events::timeout. Expired timers are handled on the worker of their chat
+     * when the dispatcher is enabled, on the scheduler's thread otherwise.
+     * Timers scheduled before this call fire once it is made. Must be called after enable_dispatcher.
+     */
+    void enable_timers (scheduler_options options = {})
+    {
+      timers.start (
+        [this] (fired_timer timer) {
+          metrics.timeouts.add ();
+          if (!workers) {
+            route_timer (timer, false);
+            return;
+          }
+          auto const chat_id = static_cast<std::uint64_t> (timer.chat_id);
+          workers->post (chat_id, [this, timer = std::move (timer)] {
+            route_timer (timer, false);
+          });
+        },
+        options);
+    }
+
+    /**
+     * Starts a background thread running checkpoint() at the given interval.
+     * A last checkpoint is taken when the handler is destroyed.
+     */
+    void enable_checkpoints (clock::duration interval)
+      requires (serializable_sessions)
+    {
+      checkpointer = std::jthread ([this, interval] (std::stop_token stop) {
+        auto mutex = std::mutex ();
+        auto cv = std::condition_variable_any ();
+        auto lock = std::unique_lock (mutex);
+        while (!cv.wait_for (lock, stop, interval, [] {
+          return false;
+        }) && !stop.stop_requested ())
+          checkpoint ();
+      });
+    }
 
-        if (!context_map.contains (chat_id)) {
-          context_storage& storage =
-            context_map.emplace (chat_id, context_storage {cache_init, table_init, state_init}).first->second;
-          handle_on_entry (get_context (chat_id, storage), storage.state);
+    /**
+     * Number of sessions currently held in memory.
+     */
+    std::size_t session_count ()
+    {
+      std::size_t count = 0;
+      for (auto& shard : shards) {
+        auto guard = std::scoped_lock (shard.mutex);
+        count += shard.context_map.size ();
+      }
+      return count;
+    }
+
+    /**
+     * Key-value storage shared by the contexts of this handler.
+     */
+    persistence& storage ()
+    {
+      return persistent_storage;
+    }
+
+    /**
+     * Queue of the messages sent through the contexts of this handler.
+     */
+    send_queue& outbound ()
+    {
+      return outbox;
+    }
+
+    /**
+     * Sends message to every recipient through the send queue of the handler, blocking until done,
+     * see forest::broadcast. Meant to run on its own thread while the handler keeps serving updates.
+     */
+    broadcast_report broadcast (std::string const& id,
+      broadcast_message const& message,
+      broadcast_recipients recipients,
+      broadcast_options const& options = {})
+    {
+      return forest::broadcast (outbox, persistent_storage, id, message, std::move (recipients), options);
+    }
+
+    std::optional<broadcast_report> resume_broadcast (std::string const& id, broadcast_options const& options = {})
+    {
+      return forest::resume_broadcast (outbox, persistent_storage, id, options);
+    }
+
+    /**
+     * Broadcasts interrupted by a crash or a stop request, to be resumed with resume_broadcast.
+     */
+    std::vector<std::string> unfinished_broadcasts ()
+    {
+      return forest::unfinished_broadcasts (persistent_storage);
+    }
+
+    /**
+     * Current value of the metrics of the handler, of its storage and of its send queue,
+     * in the Prometheus text format. Serve it with prometheus_endpoint from <forest/prometheus.hpp>,
+     * or dump it with a periodic_task.
+     * States are labelled by their index in the state variant.
+     */
+    std::string metrics_text ()
+    {
+      auto writer = prometheus_writer ();
+      writer.header ("forest_updates_total", "counter", "Updates handled.");
+      writer.sample ("forest_updates_total", {}, metrics.updates.value ());
+      writer.header ("forest_events_unhandled_total", "counter", "Events for which no transition fired.");
+      writer.sample ("forest_events_unhandled_total", {}, metrics.unhandled.value ());
+      writer.header ("forest_update_duration_seconds", "histogram", "Time spent handling an update.");
+      writer.sample ("forest_update_duration_seconds", {}, metrics.update_duration.read ());
+
+      writer.header ("forest_transition_duration_seconds", "histogram", "Time spent in a transition, by transition.");
+      for (std::size_t i = 0; i < transition_names.size (); ++i)
+        writer.sample ("forest_transition_duration_seconds", {{"transition", transition_names[i]}},
+          metrics.transitions[i].read ());
+
+      for (auto [name, help, histograms] : {
+             std::tuple {"forest_state_entry_duration_seconds", "Time spent in on_entry, by state.", &metrics.on_entry},
+             std::tuple {"forest_state_exit_duration_seconds", "Time spent in on_exit, by state.", &metrics.on_exit},
+           }) {
+        writer.header (name, "histogram", help);
+        for (std::size_t i = 0; i < histograms->size (); ++i)
+          writer.sample (name, {{"state", std::to_string (i)}}, (*histograms)[i].read ());
+      }
+
+      auto const& storage_metrics = persistent_storage.metrics ();
+      writer.header ("forest_sqlite_duration_seconds", "histogram", "Latency of the operations reaching SQLite.");
+      for (auto [operation, latency] : {
+             std::pair {"read", &storage_metrics.read},
+             std::pair {"read_batch", &storage_metrics.read_batch},
+             std::pair {"scan", &storage_metrics.scan},
+             std::pair {"write", &storage_metrics.write},
+             std::pair {"write_batch", &storage_metrics.write_batch},
+             std::pair {"commit", &storage_metrics.commit},
+           })
+        writer.sample ("forest_sqlite_duration_seconds", {{"operation", operation}}, latency->read ());
+
+      auto const cache = persistent_storage.cache_statistics ();
+      writer.header ("forest_cache_hits_total", "counter", "Reads served by the value cache.");
+      writer.sample ("forest_cache_hits_total", {}, cache.hits);
+      writer.header ("forest_cache_misses_total", "counter", "Reads that missed the value cache.");
+      writer.sample ("forest_cache_misses_total", {}, cache.misses);
+
+      writer.header ("forest_outbound_queue_depth", "gauge", "Messages waiting in the send queue.");
+      writer.sample ("forest_outbound_queue_depth", {}, static_cast<std::uint64_t> (outbox.size ()));
+      writer.header ("forest_sessions_active", "gauge", "Sessions held in memory.");
+      writer.sample ("forest_sessions_active", {}, static_cast<std::uint64_t> (session_count ()));
+      writer.header ("forest_sessions_suspended", "gauge", "Sessions waiting for a coroutine.");
+      writer.sample ("forest_sessions_suspended", {}, static_cast<std::uint64_t> (suspended_sessions.load ()));
+      writer.header ("forest_timers_fired_total", "counter", "Timers delivered to their chat.");
+      writer.sample ("forest_timers_fired_total", {}, metrics.timeouts.value ());
+      writer.header ("forest_timers_pending", "gauge", "Timers waiting to expire.");
+      writer.sample ("forest_timers_pending", {}, static_cast<std::uint64_t> (timers.pending ()));
+      return std::move (writer).str ();
+    }
+
+    static std::optional<chat_id_type> update_chat_id (banana::api::update_t const& update)
+    {
+      auto result = std::optional<chat_id_type> ();
+      events::visit_update (update, [&] (chat_id_type chat_id, auto const&) {
+        result = chat_id;
+        return true;
+      });
+      return result;
+    }
+
+    /**
+     * Names of the update types carrying an event that a transition of the table can handle,
+     * to be passed as allowed_updates to long_polling_source, or to setWebhook,
+     * so that telegram does not send the others.
+     */
+    static std::vector<std::string> allowed_updates ()
+    {
+      auto result = std::vector<std::string> ();
+      auto const add = [&]<class E> () {
+        if constexpr (table_type::template handles<context_type, E>)
+          for (auto name : events::update_types<E>::names)
+            if (std::ranges::find (result, name) == result.end ())
+              result.emplace_back (name);
+      };
+      [&]<class... Es> (std::type_identity<std::tuple<Es...>>) {
+        (add.template operator()<Es> (), ...);
+      }(std::type_identity<events::update_events> ());
+      return result;
+    }
+
+  private:
+    // returns whether the chat was left suspended
+    bool route_update (banana::api::update_t const& update, bool resuming)
+    {
+      // events are views into the update, which outlives the handling of the event
+      return events::visit_update (update, [&]<class E> (chat_id_type chat_id, E const& event) {
+        // dropped before touching the session, see allowed_updates to not receive them at all
+        if constexpr (!table_type::template handles<context_type, E>)
+          return false;
+        else
+          return handle_event (chat_id, event, update, resuming);
+      });
+    }
+
+    // returns whether the chat was left suspended
+    bool route_timer (fired_timer const& timer, bool resuming)
+    {
+      // dropped before touching the session, as the updates no transition handles
+      if constexpr (!table_type::template handles<context_type, events::timeout>)
+        return false;
+      else
+        return handle_event (timer.chat_id, events::timeout {timer.id, timer.payload}, timer, resuming);
+    }
+
+    // source is the update or timer the event comes from, queued as is while the session is busy.
+    // resuming is set when processing the queue of a busy session, see resume
+    template<Event EventType, class Source>
+    bool handle_event (chat_id_type chat_id, EventType const& event, Source const& source, bool resuming)
+    {
+      session_shard& shard = shard_of (chat_id);
+      auto lock = std::unique_lock (shard.mutex);
+      auto const now = clock::now ();
+      auto const evicted = enforce_limits (shard, now);
+
+      // a new session is inserted as a placeholder, restored once the lock is released
+      auto [storage, inserted] = shard.context_map.find_or_emplace (chat_id, [this] {
+        return context_storage {cache_init, initial_state ()};
+      });
+      storage.last_used = now;
+      if (storage.busy && !resuming) {
+        storage.busy->push_back (source);
+        lock.unlock ();
+        write_staged (shard, evicted);
+        return true;
+      }
+      // the shard is only locked to find the session: it is owned by this thread until released,
+      // the events of the chat arriving meanwhile are queued
+      mark_busy (shard, storage);
+      storage.dirty = true;
+      auto staged = inserted ? staged_of (shard, chat_id) : nullptr;
+      lock.unlock ();
+      write_staged (shard, evicted);
+
+      auto created = false;
+      if (inserted) {
+        try {
+          created = !restore (chat_id, storage, std::move (staged));
+        } catch (...) {
+          discard (chat_id);
+          throw;
+        }
+      }
+
+      auto suspended = false;
+      try {
+        suspended = apply_event (chat_id, storage, event, source, created);
+      } catch (...) {
+        if (!resuming)
+          resume (chat_id);
+        throw;
+      }
+      // when resuming, the queue is processed by the caller
+      if (!suspended && !resuming)
+        resume (chat_id);
+      return suspended;
+    }
+
+    // runs the transition of the event on a session owned by the calling thread,
+    // returns whether the session was handed to a coroutine
+    template<Event EventType, class Source>
+    bool apply_event (
+      chat_id_type chat_id, context_storage& storage, EventType const& event, Source const& source, bool created)
+    {
+      context_type context = get_context (chat_id, storage);
+
+      if (created) {
+        if (auto entering = handle_on_entry (context, storage.state)) {
+          // the event is handled once on_entry has completed, before the events queued meanwhile
+          {
+            auto guard = std::scoped_lock (shard_of (chat_id).mutex);
+            storage.busy->push_front (source);
+          }
+          suspend (chat_id, std::move (*entering));
+          return true;
+        }
+      }
+
+      // set when the transition, on_exit or on_entry of the next state is a coroutine
+      auto pending = std::optional<task<void>> ();
+      auto const apply = [&] (std::size_t index, auto&& fire) {
+        if constexpr (Task<decltype (fire ())>) {
+          pending = complete_transition (storage, context, index, fire ());
+        } else {
+          auto const start = clock::now ();
+          decltype (auto) next = fire ();
+          metrics.transitions[index].record (clock::now () - start);
+          if (auto exiting = handle_on_exit (context, storage.state)) {
+            using next_type = std::remove_cvref_t<decltype (next)>;
+            auto owned = next_type (std::forward<decltype (next)> (next));
+            pending = change_state (storage, context, std::move (*exiting), std::move (owned));
+          } else {
+            table_type::replace_state (storage.state, std::forward<decltype (next)> (next));
+            pending = handle_on_entry (context, storage.state);
+          }
+        }
+      };
+      if (!table.trigger_with (context, storage.state, event, storage.transitions, apply)) {
+        metrics.unhandled.add ();
+        return false;
+      }
+      if (!pending)
+        return false;
+      suspend (chat_id, std::move (*pending));
+      return true;
+    }
+
+    /**
+     * Hands a busy session to a coroutine. Until resume, the session is only touched by the coroutine:
+     * it is neither evicted nor checkpointed, and the updates of the chat are queued.
+     */
+    void suspend (chat_id_type chat_id, task<void> work)
+    {
+      suspended_sessions.fetch_add (1);
+      spawn (std::move (work), [this, chat_id] (std::exception_ptr error) {
+        if (error) {
+          try {
+            std::rethrow_exception (error);
+          } catch (std::exception& e) {
+            log<log_level::error> ("Coroutine of chat ", chat_id, " failed: ", e.what ());
+          } catch (...) {
+            log<log_level::error> ("Coroutine of chat ", chat_id, " failed");
+          }
         }
+        resume (chat_id);
+        if (suspended_sessions.fetch_sub (1) == 1)
+          suspended_sessions.notify_all ();
+      });
+    }
 
-        context_storage& storage = context_map.at (chat_id);
-        context_type context = get_context (chat_id, storage);
+    // called with the shard locked
+    void mark_busy (session_shard& shard, context_storage& storage)
+    {
+      if (!storage.busy) {
+        storage.busy = std::make_unique<std::deque<queued_event>> ();
+        ++shard.busy;
+      }
+    }
 
-        if (auto new_state = storage.table.trigger (context, storage.state, event); new_state.has_value ()) {
-          handle_on_exit (context, storage.state);
-          storage.state = new_state.value ();
-          handle_on_entry (context, storage.state);
+    // processes the events queued while the session was busy, until none is left or one suspends it again,
+    // then releases the session
+    void resume (chat_id_type chat_id)
+    {
+      session_shard& shard = shard_of (chat_id);
+      while (true) {
+        auto lock = std::unique_lock (shard.mutex);
+        context_storage& storage = *shard.context_map.find (chat_id);
+        if (storage.busy->empty ()) {
+          storage.busy.reset ();
+          --shard.busy;
+          return;
         }
-      } else if (auto button = update.callback_query; button) {
-        auto chat_id = button->message->chat.id;
-        auto event = events::button_pressed (button->data.value ());
-
-        if (!context_map.contains (chat_id)) {
-          context_storage& storage =
-            context_map.emplace (chat_id, context_storage {cache_init, table_init, state_init}).first->second;
-          handle_on_entry (get_context (chat_id, storage), storage.state);
+        auto queued = std::move (storage.busy->front ());
+        storage.busy->pop_front ();
+        lock.unlock ();
+
+        try {
+          if (route_queued (queued, true))
+            return;
+        } catch (std::exception& e) {
+          log<log_level::error> ("Failed to handle a queued event of chat ", chat_id, ": ", e.what ());
+        } catch (...) {
+          log<log_level::error> ("Failed to handle a queued event of chat ", chat_id);
         }
+      }
+    }
+
+    // returns whether the chat was left suspended
+    bool route_queued (queued_event const& queued, bool resuming)
+    {
+      return std::holds_alternative<fired_timer> (queued)
+        ? route_timer (std::get<fired_timer> (queued), resuming)
+        : route_update (std::get<banana::api::update_t> (queued), resuming);
+    }
+
+    // removes a session whose snapshot could not be read, the events of the chat queued meanwhile
+    // are handled again from the start, each trying to restore it
+    void discard (chat_id_type chat_id)
+    {
+      session_shard& shard = shard_of (chat_id);
+      auto lock = std::unique_lock (shard.mutex);
+      auto queued = std::move (*shard.context_map.find (chat_id)->busy);
+      shard.context_map.erase (chat_id);
+      --shard.busy;
+      lock.unlock ();
 
-        context_storage& storage = context_map.at (chat_id);
-        context_type context = get_context (chat_id, storage);
-        if (auto new_state = storage.table.trigger (context, storage.state, event); new_state.has_value ()) {
-          handle_on_exit (context, storage.state);
-          storage.state = new_state.value ();
-          handle_on_entry (context, storage.state);
+      for (auto const& event : queued) {
+        try {
+          route_queued (event, false);
+        } catch (std::exception& e) {
+          log<log_level::error> ("Failed to handle a queued event of chat ", chat_id, ": ", e.what ());
+        } catch (...) {
+          log<log_level::error> ("Failed to handle a queued event of chat ", chat_id);
         }
       }
     }
 
-  private:
-    void handle_on_entry (context<cache_type> ctx, state_type& state)
+    void wait_suspended ()
     {
-      auto const visitor = [ctx] (auto& state) {
-        state.on_entry (ctx);
-      };
-      std::visit (visitor, state);
+      for (auto count = suspended_sessions.load (); count != 0; count = suspended_sessions.load ())
+        suspended_sessions.wait (count);
     }
 
-    void handle_on_exit (context<cache_type> ctx, state_type& state)
+    // awaits a transition, then leaves the current state and enters the next one
+    template<class Next>
+    auto complete_transition (
+      context_storage& storage, context_type context, std::size_t index, task<Next> transition) -> task<void>
     {
-      auto const visitor = [ctx] (auto& state) {
-        state.on_exit (ctx);
-      };
-      std::visit (visitor, state);
+      auto const start = clock::now ();
+      auto next = co_await std::move (transition);
+      metrics.transitions[index].record (clock::now () - start);
+      co_await change_state (storage, context, handle_on_exit (context, storage.state), std::move (next));
+    }
+
+    // awaits the on_exit of the current state, if it is a coroutine, then enters the next state
+    template<class Next>
+    auto change_state (
+      context_storage& storage, context_type context, std::optional<task<void>> exiting, Next next) -> task<void>
+    {
+      if (exiting)
+        co_await std::move (*exiting);
+      table_type::replace_state (storage.state, std::move (next));
+      if (auto entering = handle_on_entry (context, storage.state))
+        co_await std::move (*entering);
+    }
+
+    // loads the snapshot of a previously evicted session into the placeholder of a new one, returns whether
+    // there was one. Runs on a busy session without the lock of the shard. A staged snapshot is more recent
+    // than the one in persistence
+    bool restore (chat_id_type chat_id, context_storage& storage, std::shared_ptr<nlohmann::json const> staged)
+    {
+      if constexpr (serializable_sessions) {
+        auto snapshot = staged ? std::optional<nlohmann::json> (*staged)
+                               : persistent_storage.get_value_json (chat_id, session_key);
+        if (snapshot.has_value ()) {
+          try {
+            storage.cache = serializer<cache_type>::load (snapshot->at ("cache"));
+            storage.state = serializer<state_type>::load (snapshot->at ("state"));
+            return true;
+          } catch (std::exception& e) {
+            log<log_level::warning> ("Discarding session of chat ", chat_id, ": ", e.what ());
+            storage.cache = cache_init;
+            storage.state = initial_state ();
+          }
+        }
+      }
+      return false;
+    }
+
+    // states that cannot be copied are value-initialized when a session starts in them
+    auto initial_state () const -> state_type
+    {
+      if constexpr (std::copy_constructible<state_type>) {
+        return state_init;
+      } else {
+        return std::visit (
+          []<class S> (S const& state) -> state_type {
+            if constexpr (std::copy_constructible<S>)
+              return state;
+            else if constexpr (std::default_initializable<S>)
+              return S {};
+            else
+              throw std::logic_error ("forest: the initial state can be neither copied nor default constructed");
+          },
+          state_init);
+      }
+    }
+
+    // called with the shard locked, takes the snapshot of a session if it changed since the last one
+    void stage (session_shard& shard, chat_id_type chat_id, context_storage& storage)
+    {
+      if constexpr (serializable_sessions) {
+        if (storage.dirty) {
+          auto& staged = shard.staged[chat_id];
+          staged.snapshot =
+            std::make_shared<nlohmann::json const> (nlohmann::json {{"cache", serializer<cache_type>::dump (storage.cache)},
+              {"state", serializer<state_type>::dump (storage.state)}});
+          ++staged.version;
+          storage.dirty = false;
+        }
+      }
+    }
+
+    // called with the shard locked
+    auto staged_of (session_shard& shard, chat_id_type chat_id) -> std::shared_ptr<nlohmann::json const>
+    {
+      auto it = shard.staged.find (chat_id);
+      return it == shard.staged.end () ? nullptr : it->second.snapshot;
+    }
+
+    // writes the staged snapshots of the chats without holding the lock of the shard. A snapshot staged
+    // while the previous one of its chat is being written is written next by the same thread, so that
+    // persistence ends with the latest one. A failed write stays staged and is retried by the next checkpoint
+    void write_staged (session_shard& shard, std::vector<chat_id_type> const& chats)
+    {
+      if constexpr (serializable_sessions) {
+        for (auto chat_id : chats) {
+          auto lock = std::unique_lock (shard.mutex);
+          auto it = shard.staged.find (chat_id);
+          if (it == shard.staged.end () || it->second.writing)
+            continue;
+          it->second.writing = true;
+          while (true) {
+            auto const snapshot = it->second.snapshot;
+            auto const version = it->second.version;
+            lock.unlock ();
+            auto written = true;
+            try {
+              persistent_storage.set_value_json (chat_id, session_key, *snapshot);
+            } catch (std::exception& e) {
+              log<log_level::error> ("Failed to write the session of chat ", chat_id, ": ", e.what ());
+              written = false;
+            } catch (...) {
+              log<log_level::error> ("Failed to write the session of chat ", chat_id);
+              written = false;
+            }
+            lock.lock ();
+            // the map may have been rehashed meanwhile
+            it = shard.staged.find (chat_id);
+            if (!written) {
+              it->second.writing = false;
+              break;
+            }
+            if (it->second.version == version) {
+              shard.staged.erase (it);
+              break;
+            }
+          }
+        }
+      }
+    }
+
+    void evict (session_shard& shard, std::vector<chat_id_type> const& victims)
+    {
+      for (auto chat_id : victims) {
+        if (context_storage* storage = shard.context_map.find (chat_id)) {
+          stage (shard, chat_id, *storage);
+          shard.context_map.erase (chat_id);
+        }
+      }
+    }
+
+    // called with the shard locked, before a session may be inserted. Returns the chats whose snapshot
+    // is to be written with write_staged once the lock is released
+    auto enforce_limits (session_shard& shard, clock::time_point now) -> std::vector<chat_id_type>
+    {
+      auto evicted = std::vector<chat_id_type> ();
+      if constexpr (serializable_sessions) {
+        if (limits.idle_timeout > clock::duration::zero () && now >= shard.next_sweep) {
+          auto victims = std::vector<chat_id_type> ();
+          shard.context_map.for_each ([&] (chat_id_type chat_id, context_storage& storage) {
+            if (!storage.busy && now - storage.last_used >= limits.idle_timeout)
+              victims.push_back (chat_id);
+          });
+          evict (shard, victims);
+          evicted = std::move (victims);
+          shard.next_sweep = now + limits.idle_timeout / 4;
+        }
+
+        // a shard whose sessions are all busy has nothing to evict until one is released: skip the scan
+        auto const capacity = std::max<std::size_t> (limits.max_sessions / session_shards, 1);
+        if (limits.max_sessions > 0 && shard.context_map.size () >= capacity &&
+          shard.context_map.size () > shard.busy) {
+          // evict in batches, so that the linear scan is amortized over many insertions
+          auto const count = shard.context_map.size () - capacity + std::max<std::size_t> (capacity / 8, 1);
+          auto candidates = std::vector<std::pair<clock::time_point, chat_id_type>> ();
+          shard.context_map.for_each ([&] (chat_id_type chat_id, context_storage& storage) {
+            if (!storage.busy)
+              candidates.emplace_back (storage.last_used, chat_id);
+          });
+          if (candidates.empty ())
+            return evicted;
+
+          auto const last = candidates.begin () + std::min (count, candidates.size ());
+          std::nth_element (candidates.begin (), last - 1, candidates.end ());
+
+          auto victims = std::vector<chat_id_type> ();
+          for (auto it = candidates.begin (); it != last; ++it)
+            victims.push_back (it->second);
+          evict (shard, victims);
+          evicted.insert (evicted.end (), victims.begin (), victims.end ());
+        }
+      }
+      return evicted;
+    }
+
+    session_shard& shard_of (chat_id_type chat_id)
+    {
+      return shards[static_cast<std::uint64_t> (chat_id) % session_shards];
+    }
+
+    // returns the task to await when on_entry is a coroutine
+    auto handle_on_entry (context_type const& ctx, state_type& state) -> std::optional<task<void>>
+    {
+      auto& histogram = metrics.on_entry[state.index ()];
+      return std::visit (
+        [&] (auto& state) {
+          return run_hook (histogram, [&] {
+            return state.on_entry (ctx);
+          });
+        },
+        state);
+    }
+
+    // returns the task to await when on_exit is a coroutine
+    auto handle_on_exit (context_type const& ctx, state_type& state) -> std::optional<task<void>>
+    {
+      auto& histogram = metrics.on_exit[state.index ()];
+      return std::visit (
+        [&] (auto& state) {
+          return run_hook (histogram, [&] {
+            return state.on_exit (ctx);
+          });
+        },
+        state);
+    }
+
+    template<class Hook>
+    static auto run_hook (latency_histogram& histogram, Hook hook) -> std::optional<task<void>>
+    {
+      if constexpr (Task<std::invoke_result_t<Hook&>>) {
+        return timed (histogram, hook ());
+      } else {
+        auto timer = scoped_timer (histogram);
+        hook ();
+        return std::nullopt;
+      }
+    }
+
+    // a coroutine hook is timed until it completes
+    static auto timed (latency_histogram& histogram, task<void> hook) -> task<void>
+    {
+      auto const start = clock::now ();
+      co_await std::move (hook);
+      histogram.record (clock::now () - start);
     }
 
     context<cache_type> get_context (chat_id_type chat_id, context_storage& storage)
     {
-      return context<cache_type> (chat_id, storage.cache, agent_ref.get (), persistent_storage);
+      return context<cache_type> (chat_id, storage.cache, outbox, persistent_storage, &timers);
     }
   };
 
-  template<std::copy_constructible Cache = std::monostate, class... States, class... Transitions, class StateStart>
-  context_handler (banana::agent::cpr_async& agent,
+  template<std::copy_constructible Cache = std::monostate, class... States, class... Transitions, class StateStart, Agent AgentType>
+  context_handler (AgentType& agent,
     Cache cache,
     transition_table<std::variant<States...>, Transitions...> table,
     StateStart state,
     std::string) -> context_handler<Cache, transition_table<std::variant<States...>, Transitions...>>;
 
+  template<std::copy_constructible Cache = std::monostate, class... States, class... Transitions, class StateStart, Agent AgentType>
+  context_handler (AgentType& agent,
+    Cache cache,
+    transition_table<std::variant<States...>, Transitions...> table,
+    StateStart state,
+    std::string,
+    send_queue_options) -> context_handler<Cache, transition_table<std::variant<States...>, Transitions...>>;
+
+  template<std::copy_constructible Cache = std::monostate, class... States, class... Transitions, class StateStart, Agent AgentType>
+  context_handler (AgentType& agent,
+    Cache cache,
+    transition_table<std::variant<States...>, Transitions...> table,
+    StateStart state,
+    std::string,
+    send_queue_options,
+    persistence_options) -> context_handler<Cache, transition_table<std::variant<States...>, Transitions...>>;
+
 } // namespace forest
@@ -0,0 +1,168 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <typeinfo>
+#include <vector>
+
+#include <forest/log.hpp>
+
+namespace forest
+{
+  /**
+   * Fixed pool of worker threads. Tasks posted with the same key always run on the same worker,
+   * so they are executed in posting order, while tasks with different keys run in parallel.
+   * With a queue limit, post blocks while the queue of the target worker is full,
+   * tasks must then not post to their own dispatcher.
+   */
+  class dispatcher
+  {
+  public:
+    using task_type = std::function<void ()>;
+    using error_handler_type = std::function<void (std::exception_ptr)>;
+
+  private:
+    struct worker
+    {
+      std::mutex mutex;
+      std::condition_variable cv_task;
+      std::condition_variable cv_idle;
+      std::condition_variable cv_space;
+      std::deque<task_type> tasks;
+      bool busy = false;
+      bool stopping = false;
+      std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<worker>> workers;
+    error_handler_type error_handler;
+    // tasks queued on a single worker, zero for no limit
+    std::size_t queue_limit;
+
+    static auto default_error_handler (std::exception_ptr error) -> void
+    {
+      try {
+        std::rethrow_exception (error);
+      } catch (std::exception& e) {
+        log<log_level::error> ("dispatcher: ", typeid (e).name (), ": ", e.what ());
+      } catch (...) {
+        log<log_level::error> ("dispatcher: unknown exception");
+      }
+    }
+
+    static auto mix (std::uint64_t key) -> std::uint64_t
+    {
+      // splitmix64 finalizer, spreads sequential and negative chat ids evenly
+      key += 0x9e3779b97f4a7c15ull;
+      key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ull;
+      key = (key ^ (key >> 27)) * 0x94d049bb133111ebull;
+      return key ^ (key >> 31);
+    }
+
+    auto run (worker& w) -> void
+    {
+      auto lock = std::unique_lock (w.mutex);
+      while (true) {
+        w.cv_task.wait (lock, [&] {
+          return w.stopping || !w.tasks.empty ();
+        });
+        if (w.tasks.empty ())
+          return;
+
+        auto task = std::move (w.tasks.front ());
+        w.tasks.pop_front ();
+        w.busy = true;
+        if (queue_limit != 0)
+          w.cv_space.notify_one ();
+        lock.unlock ();
+
+        try {
+          task ();
+        } catch (...) {
+          error_handler (std::current_exception ());
+        }
+
+        lock.lock ();
+        w.busy = false;
+        if (w.tasks.empty ())
+          w.cv_idle.notify_all ();
+      }
+    }
+
+  public:
+    explicit dispatcher (std::size_t num_workers = std::thread::hardware_concurrency (),
+      error_handler_type on_error = default_error_handler,
+      std::size_t queue_limit = 0)
+      : workers ()
+      , error_handler (on_error ? std::move (on_error) : default_error_handler)
+      , queue_limit (queue_limit)
+    {
+      num_workers = std::max<std::size_t> (num_workers, 1);
+      for (std::size_t i = 0; i < num_workers; ++i)
+        workers.push_back (std::make_unique<worker> ());
+      for (auto& w : workers)
+        w->thread = std::thread ([this, &w = *w] {
+          run (w);
+        });
+    }
+
+    dispatcher (dispatcher const&) = delete;
+    dispatcher& operator= (dispatcher const&) = delete;
+
+    /**
+     * Runs the tasks already queued, then joins the workers.
+     */
+    ~dispatcher ()
+    {
+      for (auto& w : workers) {
+        auto guard = std::scoped_lock (w->mutex);
+        w->stopping = true;
+        w->cv_task.notify_one ();
+      }
+      for (auto& w : workers)
+        w->thread.join ();
+    }
+
+    auto size () const -> std::size_t
+    {
+      return workers.size ();
+    }
+
+    auto worker_index (std::uint64_t key) const -> std::size_t
+    {
+      return mix (key) % workers.size ();
+    }
+
+    auto post (std::uint64_t key, task_type task) -> void
+    {
+      worker& w = *workers[worker_index (key)];
+      auto lock = std::unique_lock (w.mutex);
+      if (queue_limit != 0)
+        w.cv_space.wait (lock, [&] {
+          return w.tasks.size () < queue_limit;
+        });
+      w.tasks.push_back (std::move (task));
+      w.cv_task.notify_one ();
+    }
+
+    /**
+     * Blocks until every task posted before the call has completed.
+     */
+    auto wait_idle () -> void
+    {
+      for (auto& w : workers) {
+        auto lock = std::unique_lock (w->mutex);
+        w->cv_idle.wait (lock, [&] {
+          return w->tasks.empty () && !w->busy;
+        });
+      }
+    }
+  };
+} // namespace forest
@@ -1,15 +1,18 @@
 #pragma once
-#include <string>
+#include <string_view>
 
 namespace forest::events
 {
+  /**
+   * Views into the update being handled, valid until the transition returns.
+   */
   struct button_pressed
   {
-    std::string id;
+    std::string_view id;
 
     button_pressed () = default;
 
-    button_pressed (std::string id)
+    button_pressed (std::string_view id)
       : id (id)
     {}
   };
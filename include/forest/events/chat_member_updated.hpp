@@ -0,0 +1,17 @@
+#pragma once
+#include <banana/api.hpp>
+
+namespace forest::events
+{
+  /**
+   * The status of a member of the chat changed. References the update being handled,
+   * valid until the transition returns.
+   */
+  struct chat_member_updated
+  {
+    banana::api::chat_member_updated_t const& update;
+    // the member is the bot itself, for instance blocked by the user of a private chat.
+    // The changes of the other members are only sent to administrator bots
+    bool bot = false;
+  };
+} // namespace forest::events
@@ -0,0 +1,25 @@
+#pragma once
+#include <string_view>
+
+#include <banana/api.hpp>
+
+namespace forest::events
+{
+  /**
+   * A message carrying a file. References the update being handled, valid until the transition returns.
+   */
+  struct document
+  {
+    banana::api::message_t const& message;
+
+    auto file () const -> banana::api::document_t const&
+    {
+      return *message.document;
+    }
+
+    auto caption () const -> std::string_view
+    {
+      return message.caption.has_value () ? std::string_view (*message.caption) : std::string_view ();
+    }
+  };
+} // namespace forest::events
@@ -0,0 +1,24 @@
+#pragma once
+#include <string_view>
+
+#include <banana/api.hpp>
+
+namespace forest::events
+{
+  /**
+   * A message of the chat was edited.
+   * References the update being handled, valid until the transition returns.
+   */
+  struct edited_message
+  {
+    banana::api::message_t const& message;
+
+    /**
+     * New text of the message, empty if it has none, such as a photo whose caption was edited.
+     */
+    auto text () const -> std::string_view
+    {
+      return message.text.has_value () ? std::string_view (*message.text) : std::string_view ();
+    }
+  };
+} // namespace forest::events
@@ -0,0 +1,14 @@
+#pragma once
+#include <banana/api.hpp>
+
+namespace forest::events
+{
+  /**
+   * A query typed after the username of the bot in any chat, delivered to the private chat of its author.
+   * References the update being handled, valid until the transition returns.
+   */
+  struct inline_query
+  {
+    banana::api::inline_query_t const& query;
+  };
+} // namespace forest::events
@@ -1,10 +1,13 @@
 #pragma once
-#include <string>
+#include <string_view>
 
 namespace forest::events
 {
+  /**
+   * Views into the update being handled, valid until the transition returns.
+   */
   struct message
   {
-    std::string text;
+    std::string_view text;
   };
 } // namespace forest::events
@@ -0,0 +1,28 @@
+#pragma once
+#include <string_view>
+
+#include <banana/api.hpp>
+
+namespace forest::events
+{
+  /**
+   * A message carrying a photo. References the update being handled, valid until the transition returns.
+   */
+  struct photo
+  {
+    banana::api::message_t const& message;
+
+    /**
+     * The photo in its largest size: telegram sends every size, in ascending order.
+     */
+    auto largest () const -> banana::api::photo_size_t const&
+    {
+      return message.photo->back ();
+    }
+
+    auto caption () const -> std::string_view
+    {
+      return message.caption.has_value () ? std::string_view (*message.caption) : std::string_view ();
+    }
+  };
+} // namespace forest::events
@@ -0,0 +1,16 @@
+#pragma once
+#include <cstdint>
+#include <string_view>
+
+namespace forest::events
+{
+  /**
+   * A timer scheduled with context::schedule expired.
+   * The payload is a view valid until the transition returns.
+   */
+  struct timeout
+  {
+    std::uint64_t id = 0;
+    std::string_view payload;
+  };
+} // namespace forest::events
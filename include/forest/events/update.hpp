@@ -0,0 +1,105 @@
+#pragma once
+#include <array>
+#include <string_view>
+#include <tuple>
+
+#include <banana/api.hpp>
+
+#include <forest/events/button_pressed.hpp>
+#include <forest/events/chat_member_updated.hpp>
+#include <forest/events/document.hpp>
+#include <forest/events/edited_message.hpp>
+#include <forest/events/inline_query.hpp>
+#include <forest/events/message.hpp>
+#include <forest/events/photo.hpp>
+
+namespace forest::events
+{
+  /**
+   * The events carried by telegram updates, see visit_update.
+   */
+  using update_events =
+    std::tuple<message, photo, document, edited_message, button_pressed, inline_query, chat_member_updated>;
+
+  /**
+   * Names of the update types carrying an event, as expected by allowed_updates, none for other events.
+   */
+  template<class EventType>
+  struct update_types
+  {
+    static constexpr std::array<std::string_view, 0> names {};
+  };
+
+  template<>
+  struct update_types<message>
+  {
+    static constexpr std::array<std::string_view, 1> names {"message"};
+  };
+
+  template<>
+  struct update_types<photo> : update_types<message>
+  {};
+
+  template<>
+  struct update_types<document> : update_types<message>
+  {};
+
+  template<>
+  struct update_types<edited_message>
+  {
+    static constexpr std::array<std::string_view, 1> names {"edited_message"};
+  };
+
+  template<>
+  struct update_types<button_pressed>
+  {
+    static constexpr std::array<std::string_view, 1> names {"callback_query"};
+  };
+
+  template<>
+  struct update_types<inline_query>
+  {
+    static constexpr std::array<std::string_view, 1> names {"inline_query"};
+  };
+
+  template<>
+  struct update_types<chat_member_updated>
+  {
+    static constexpr std::array<std::string_view, 2> names {"my_chat_member", "chat_member"};
+  };
+
+  /**
+   * Calls visit (chat_id, event) with the event carried by the update and returns its result,
+   * or returns false without calling it if the update carries none of the events in update_events.
+   * Events are built in place, referencing the update: nothing is copied out of it.
+   */
+  template<class Visitor>
+  auto visit_update (banana::api::update_t const& update, Visitor&& visit) -> bool
+  {
+    if (auto const& m = update.message; m.has_value ()) {
+      if (m->text.has_value ())
+        return visit (m->chat.id, message {*m->text});
+      if (m->photo.has_value () && !m->photo->empty ())
+        return visit (m->chat.id, photo {*m});
+      if (m->document.has_value ())
+        return visit (m->chat.id, document {*m});
+      return false;
+    }
+    if (auto const& query = update.callback_query; query.has_value ()) {
+      // buttons of messages sent inline, through an inline query, belong to no chat
+      if (!query->message.has_value ())
+        return false;
+      auto const id = query->data.has_value () ? std::string_view (*query->data) : std::string_view ();
+      return visit (query->message->chat.id, button_pressed (id));
+    }
+    if (auto const& m = update.edited_message; m.has_value ())
+      return visit (m->chat.id, edited_message {*m});
+    if (auto const& query = update.inline_query; query.has_value ())
+      return visit (query->from.id, inline_query {*query});
+    if (auto const& member = update.my_chat_member; member.has_value ())
+      return visit (member->chat.id, chat_member_updated {*member, true});
+    if (auto const& member = update.chat_member; member.has_value ())
+      return visit (member->chat.id, chat_member_updated {*member, false});
+    return false;
+  }
+} // namespace forest::events
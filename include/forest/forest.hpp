@@ -1,12 +1,38 @@
 #pragma once
+#include <forest/command_router.hpp>
 #include <forest/concepts/context.hpp>
+#include <forest/concepts/serializable.hpp>
 #include <forest/concepts/state.hpp>
 #include <forest/concepts/transition.hpp>
 
+#include <forest/agent.hpp>
+#include <forest/broadcast.hpp>
+#include <forest/composite_state.hpp>
 #include <forest/context_handler.hpp>
+#include <forest/dispatcher.hpp>
+#include <forest/events/update.hpp>
+#include <forest/in_place_state.hpp>
+#include <forest/keyboard.hpp>
+#include <forest/log.hpp>
+#include <forest/metrics.hpp>
+#include <forest/per_chat.hpp>
 #include <forest/persistence.hpp>
+#include <forest/replay.hpp>
+#include <forest/scheduler.hpp>
+#include <forest/send_queue.hpp>
+#include <forest/serialization.hpp>
+#include <forest/session_store.hpp>
+#include <forest/task.hpp>
+#include <forest/timer_wheel.hpp>
 #include <forest/transition_table.hpp>
+#include <forest/update_source.hpp>
+#include <forest/value.hpp>
+#include <forest/value_cache.hpp>
 
 #include <forest/transitions/button.hpp>
 #include <forest/transitions/command.hpp>
+#include <forest/transitions/event.hpp>
 #include <forest/transitions/message.hpp>
+#include <forest/transitions/timeout.hpp>
+
+// not included, they need POSIX sockets: <forest/http.hpp>, <forest/prometheus.hpp> and <forest/webhook.hpp>
@@ -0,0 +1,292 @@
+#pragma once
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <forest/log.hpp>
+
+namespace forest
+{
+  struct http_server_options
+  {
+    // address to listen on, TLS is expected to be terminated by a reverse proxy in front of it
+    std::string address = "127.0.0.1";
+    // zero lets the system pick a free port, see http_server::port
+    std::uint16_t port = 8080;
+    // larger request bodies are rejected
+    std::size_t max_body = 1 << 20;
+    // a connection that stays silent for this long is dropped
+    std::chrono::milliseconds read_timeout {5000};
+  };
+
+  /**
+   * A request as views into the receive buffer, valid only while it is being handled.
+   */
+  struct http_request
+  {
+    std::string_view method;
+    std::string_view target;
+    // header names are lowercase
+    std::vector<std::pair<std::string, std::string_view>> headers;
+    std::string_view body;
+
+    /**
+     * Target without the query string.
+     */
+    auto path () const -> std::string_view
+    {
+      return target.substr (0, target.find ('?'));
+    }
+
+    auto header (std::string_view name) const -> std::optional<std::string_view>
+    {
+      for (auto const& [key, value] : headers)
+        if (key == name)
+          return value;
+      return std::nullopt;
+    }
+  };
+
+  struct http_response
+  {
+    std::string status = "200 OK";
+    std::string content_type;
+    std::string body;
+  };
+
+  /**
+   * Minimal HTTP/1.1 server for the endpoints of a bot, such as webhook deliveries and metrics.
+   * Connections are served one at a time on a background thread and closed after the response.
+   */
+  class http_server
+  {
+  public:
+    using handler_type = std::function<http_response (http_request const&)>;
+
+  private:
+    http_server_options options;
+    handler_type handler;
+    int listener = -1;
+    std::jthread server;
+
+    struct socket_guard
+    {
+      int fd;
+
+      ~socket_guard ()
+      {
+        ::close (fd);
+      }
+    };
+
+    static auto lowercase (std::string_view text) -> std::string
+    {
+      auto result = std::string (text);
+      std::ranges::transform (result, result.begin (), [] (unsigned char c) {
+        return static_cast<char> (std::tolower (c));
+      });
+      return result;
+    }
+
+    static auto wait_readable (int fd, std::chrono::milliseconds timeout) -> bool
+    {
+      auto descriptor = pollfd {fd, POLLIN, 0};
+      return ::poll (&descriptor, 1, static_cast<int> (timeout.count ())) > 0;
+    }
+
+    // reads until the buffer holds at least size bytes, returns false on timeout or disconnection
+    auto read_until (int fd, std::string& buffer, std::size_t size) -> bool
+    {
+      char chunk[4096];
+      while (buffer.size () < size) {
+        if (!wait_readable (fd, options.read_timeout))
+          return false;
+        auto const count = ::recv (fd, chunk, sizeof (chunk), 0);
+        if (count <= 0)
+          return false;
+        buffer.append (chunk, static_cast<std::size_t> (count));
+      }
+      return true;
+    }
+
+    static auto respond (int fd, http_response const& response) -> void
+    {
+      auto text = "HTTP/1.1 " + response.status + "\r\n";
+      if (!response.content_type.empty ())
+        text += "Content-Type: " + response.content_type + "\r\n";
+      text += "Content-Length: " + std::to_string (response.body.size ()) + "\r\nConnection: close\r\n\r\n";
+      text += response.body;
+
+      auto data = std::string_view (text);
+      while (!data.empty ()) {
+        auto const count = ::send (fd, data.data (), data.size (), MSG_NOSIGNAL);
+        if (count <= 0)
+          return;
+        data.remove_prefix (static_cast<std::size_t> (count));
+      }
+    }
+
+    static auto status (std::string status) -> http_response
+    {
+      return http_response {std::move (status), {}, {}};
+    }
+
+    // fills method, target and headers from the head of a request, returns false if it is malformed
+    static auto parse_head (std::string_view head, http_request& request) -> bool
+    {
+      auto const line_end = head.find ("\r\n");
+      auto const request_line = head.substr (0, line_end);
+      auto const method_end = request_line.find (' ');
+      auto const target_end = request_line.find (' ', method_end + 1);
+      if (method_end == std::string_view::npos || target_end == std::string_view::npos)
+        return false;
+      request.method = request_line.substr (0, method_end);
+      request.target = request_line.substr (method_end + 1, target_end - method_end - 1);
+
+      request.headers.clear ();
+      for (auto rest = line_end == std::string_view::npos ? std::string_view () : head.substr (line_end + 2);
+           !rest.empty ();) {
+        auto const end = std::min (rest.find ("\r\n"), rest.size ());
+        auto const header = rest.substr (0, end);
+        rest.remove_prefix (std::min (end + 2, rest.size ()));
+
+        auto const colon = header.find (':');
+        if (colon == std::string_view::npos)
+          continue;
+        auto value = header.substr (colon + 1);
+        value.remove_prefix (std::min (value.find_first_not_of (' '), value.size ()));
+        request.headers.emplace_back (lowercase (header.substr (0, colon)), value);
+      }
+      return true;
+    }
+
+    auto serve (int fd) -> http_response
+    {
+      auto buffer = std::string ();
+      auto header_end = std::string::npos;
+      while ((header_end = buffer.find ("\r\n\r\n")) == std::string::npos) {
+        if (buffer.size () > 16 * 1024)
+          return status ("431 Request Header Fields Too Large");
+        if (!read_until (fd, buffer, buffer.size () + 1))
+          return status ("408 Request Timeout");
+      }
+
+      auto request = http_request {};
+      if (!parse_head (std::string_view (buffer).substr (0, header_end), request))
+        return status ("400 Bad Request");
+
+      auto content_length = std::size_t {0};
+      if (auto length = request.header ("content-length"); length.has_value ()) {
+        auto const end = length->data () + length->size ();
+        if (std::from_chars (length->data (), end, content_length).ptr != end)
+          return status ("400 Bad Request");
+      } else if (request.method == "POST" || request.method == "PUT")
+        return status ("411 Length Required");
+      if (content_length > options.max_body)
+        return status ("413 Content Too Large");
+
+      auto const body_start = header_end + 4;
+      if (!read_until (fd, buffer, body_start + content_length))
+        return status ("408 Request Timeout");
+
+      // reading the body may have moved the buffer, the views are taken again
+      parse_head (std::string_view (buffer).substr (0, header_end), request);
+      request.body = std::string_view (buffer).substr (body_start, content_length);
+      return handler (request);
+    }
+
+    auto run (std::stop_token stop) -> void
+    {
+      while (!stop.stop_requested ()) {
+        // wake up regularly to observe stop requests
+        if (!wait_readable (listener, std::chrono::milliseconds (200)))
+          continue;
+        auto const fd = ::accept (listener, nullptr, nullptr);
+        if (fd < 0)
+          continue;
+        auto guard = socket_guard {fd};
+        try {
+          respond (fd, serve (fd));
+        } catch (std::exception& e) {
+          log<log_level::warning> ("http_server: ", e.what ());
+          respond (fd, status ("500 Internal Server Error"));
+        }
+      }
+    }
+
+  public:
+    /**
+     * Binds the listening socket and starts serving, throws std::system_error if it cannot be bound.
+     */
+    http_server (http_server_options options, handler_type handler)
+      : options (std::move (options))
+      , handler (std::move (handler))
+    {
+      listener = ::socket (AF_INET, SOCK_STREAM, 0);
+      if (listener < 0)
+        throw std::system_error (errno, std::generic_category (), "http_server: socket");
+
+      int const reuse = 1;
+      ::setsockopt (listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof (reuse));
+
+      auto address = sockaddr_in {};
+      address.sin_family = AF_INET;
+      address.sin_port = htons (this->options.port);
+      if (::inet_pton (AF_INET, this->options.address.c_str (), &address.sin_addr) != 1) {
+        ::close (listener);
+        throw std::invalid_argument ("http_server: invalid address " + this->options.address);
+      }
+      if (::bind (listener, reinterpret_cast<sockaddr*> (&address), sizeof (address)) != 0 ||
+          ::listen (listener, SOMAXCONN) != 0) {
+        auto const error = errno;
+        ::close (listener);
+        throw std::system_error (error, std::generic_category (), "http_server: bind");
+      }
+
+      server = std::jthread ([this] (std::stop_token stop) {
+        run (stop);
+      });
+    }
+
+    http_server (http_server const&) = delete;
+    http_server& operator= (http_server const&) = delete;
+
+    ~http_server ()
+    {
+      server.request_stop ();
+      if (server.joinable ())
+        server.join ();
+      ::close (listener);
+    }
+
+    /**
+     * Port the server listens on, useful when options.port is zero and the system picked one.
+     */
+    auto port () const -> std::uint16_t
+    {
+      auto address = sockaddr_in {};
+      auto length = socklen_t {sizeof (address)};
+      ::getsockname (listener, reinterpret_cast<sockaddr*> (&address), &length);
+      return ntohs (address.sin_port);
+    }
+  };
+} // namespace forest
@@ -0,0 +1,36 @@
+#pragma once
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace forest
+{
+  /**
+   * Transition result that constructs the next state directly in the session's variant,
+   * from arguments captured by value so that they may be moved out of the state being left.
+   */
+  template<class S, class... Args>
+  struct in_place_state
+  {
+    using state_type = S;
+
+    std::tuple<Args...> args;
+  };
+
+  template<class S, class... Args>
+  auto emplace_state (Args&&... args) -> in_place_state<S, std::decay_t<Args>...>
+  {
+    return {std::tuple<std::decay_t<Args>...> (std::forward<Args> (args)...)};
+  }
+
+  template<class T>
+  struct is_in_place_state : std::false_type
+  {};
+
+  template<class S, class... Args>
+  struct is_in_place_state<in_place_state<S, Args...>> : std::true_type
+  {};
+
+  template<class T>
+  concept InPlaceState = is_in_place_state<std::remove_cvref_t<T>>::value;
+} // namespace forest
@@ -0,0 +1,66 @@
+#pragma once
+#include <cstddef>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <banana/api.hpp>
+
+namespace forest
+{
+  class button
+  {
+  public:
+    std::string id;
+    std::string text;
+
+    button (std::string id, std::string text)
+      : id (std::move (id))
+      , text (std::move (text))
+    {}
+  };
+
+  /**
+   * Inline keyboard built once and attached to any number of messages, see context::send_message.
+   * The markup is immutable and shared: copying a keyboard, or sending it, does not copy the buttons
+   * on the calling thread, the send queue copies them into the request right before issuing it.
+   */
+  class keyboard
+  {
+  public:
+    using markup_type = banana::api::inline_keyboard_markup_t;
+
+  private:
+    std::shared_ptr<markup_type const> shared;
+
+  public:
+    keyboard (std::initializer_list<std::initializer_list<button>> rows)
+    {
+      auto markup = std::make_shared<markup_type> ();
+      markup->inline_keyboard.reserve (rows.size ());
+      for (auto const& row : rows) {
+        auto& buttons = markup->inline_keyboard.emplace_back ();
+        buttons.reserve (row.size ());
+        for (auto const& b : row)
+          buttons.push_back (banana::api::inline_keyboard_button_t {.text = b.text, .callback_data = b.id});
+      }
+      shared = std::move (markup);
+    }
+
+    explicit keyboard (markup_type markup)
+      : shared (std::make_shared<markup_type const> (std::move (markup)))
+    {}
+
+    auto markup () const -> std::shared_ptr<markup_type const> const&
+    {
+      return shared;
+    }
+
+    auto rows () const -> std::size_t
+    {
+      return shared->inline_keyboard.size ();
+    }
+  };
+} // namespace forest
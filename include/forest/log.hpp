@@ -0,0 +1,121 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
+
+/**
+ * Messages below this level are removed at compile time, 0 keeps every level.
+ * Levels: 0 trace, 1 debug, 2 info, 3 warning, 4 error, 5 off.
+ */
+#ifndef FOREST_MIN_LOG_LEVEL
+#define FOREST_MIN_LOG_LEVEL 1
+#endif
+
+namespace forest
+{
+  enum class log_level : int
+  {
+    trace,
+    debug,
+    info,
+    warning,
+    error,
+    off
+  };
+
+  constexpr auto to_string (log_level level) -> std::string_view
+  {
+    switch (level) {
+    case log_level::trace:
+      return "trace";
+    case log_level::debug:
+      return "debug";
+    case log_level::info:
+      return "info";
+    case log_level::warning:
+      return "warning";
+    case log_level::error:
+      return "error";
+    default:
+      return "off";
+    }
+  }
+
+  inline constexpr auto compiled_log_level = static_cast<log_level> (FOREST_MIN_LOG_LEVEL);
+
+  // receives every message that passes both the compile-time and the runtime level
+  using log_sink = std::function<void (log_level, std::string_view)>;
+
+  namespace detail
+  {
+    struct logger
+    {
+      std::atomic<log_level> level = log_level::info;
+      // guards sink, messages are delivered to it one at a time
+      std::mutex mutex;
+      log_sink sink;
+
+      static auto instance () -> logger&
+      {
+        static auto result = logger ();
+        return result;
+      }
+    };
+  } // namespace detail
+
+  /**
+   * Messages below level are discarded at runtime, before being formatted. The default is info.
+   */
+  inline auto set_log_level (log_level level) -> void
+  {
+    detail::logger::instance ().level.store (level, std::memory_order_relaxed);
+  }
+
+  /**
+   * Replaces the destination of the messages, an empty sink restores the default:
+   * one line per message on std::clog, without flushing.
+   */
+  inline auto set_log_sink (log_sink sink) -> void
+  {
+    auto& logger = detail::logger::instance ();
+    auto guard = std::scoped_lock (logger.mutex);
+    logger.sink = std::move (sink);
+  }
+
+  template<log_level Level>
+  auto log_enabled () -> bool
+  {
+    if constexpr (Level < compiled_log_level || Level == log_level::off)
+      return false;
+    else
+      return Level >= detail::logger::instance ().level.load (std::memory_order_relaxed);
+  }
+
+  /**
+   * Formats the arguments with operator<< and hands the message to the sink.
+   * Below FOREST_MIN_LOG_LEVEL the call compiles to nothing.
+   */
+  template<log_level Level, class... Args>
+  auto log (Args const&... args) -> void
+  {
+    if constexpr (Level >= compiled_log_level && Level != log_level::off) {
+      if (!log_enabled<Level> ())
+        return;
+
+      auto message = std::ostringstream ();
+      (message << ... << args);
+
+      auto& logger = detail::logger::instance ();
+      auto guard = std::scoped_lock (logger.mutex);
+      if (logger.sink)
+        logger.sink (Level, message.view ());
+      else
+        std::clog << "[forest " << to_string (Level) << "] " << message.view () << '\n';
+    }
+  }
+} // namespace forest
@@ -0,0 +1,279 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <initializer_list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+
+namespace forest
+{
+  namespace detail
+  {
+    // counters are split in this many cache lines, so that threads rarely update the same one
+    inline constexpr std::size_t metric_stripes = 8;
+
+    // stripe updated by the calling thread, threads are assigned one round robin
+    inline auto metric_stripe () -> std::size_t
+    {
+      static auto next = std::atomic<std::size_t> (0);
+      thread_local auto const stripe = next.fetch_add (1, std::memory_order_relaxed) % metric_stripes;
+      return stripe;
+    }
+  } // namespace detail
+
+  /**
+   * Monotonic counter. Updates are a relaxed atomic add on a cache line mostly owned by the calling thread.
+   */
+  class metric_counter
+  {
+  private:
+    struct alignas (64) slot
+    {
+      std::atomic<std::uint64_t> value = 0;
+    };
+
+    std::array<slot, detail::metric_stripes> slots;
+
+  public:
+    auto add (std::uint64_t amount = 1) -> void
+    {
+      slots[detail::metric_stripe ()].value.fetch_add (amount, std::memory_order_relaxed);
+    }
+
+    auto value () const -> std::uint64_t
+    {
+      auto result = std::uint64_t {0};
+      for (auto const& s : slots)
+        result += s.value.load (std::memory_order_relaxed);
+      return result;
+    }
+  };
+
+  /**
+   * Latency histogram with power of two buckets, from 1us up to about 4s, and an overflow bucket.
+   * Recording costs a relaxed atomic add on a bucket and one on the sum, on the stripe of the calling thread.
+   */
+  class latency_histogram
+  {
+  public:
+    static constexpr std::size_t bucket_count = 24;
+
+    struct snapshot
+    {
+      // observations per bucket, not cumulative
+      std::array<std::uint64_t, bucket_count> buckets {};
+      std::uint64_t count = 0;
+      std::chrono::nanoseconds sum {0};
+    };
+
+    /**
+     * Upper bound of bucket i, the last bucket is unbounded.
+     */
+    static constexpr auto upper_bound (std::size_t i) -> std::chrono::microseconds
+    {
+      return std::chrono::microseconds (std::int64_t {1} << i);
+    }
+
+  private:
+    struct alignas (64) slot
+    {
+      std::array<std::atomic<std::uint64_t>, bucket_count> buckets {};
+      std::atomic<std::uint64_t> sum = 0;
+    };
+
+    std::array<slot, detail::metric_stripes> slots;
+
+    static auto bucket_of (std::chrono::nanoseconds elapsed) -> std::size_t
+    {
+      // rounded up to the microsecond, bucket i holds (2^(i-1), 2^i] microseconds
+      auto const micros = static_cast<std::uint64_t> (std::max<std::int64_t> ((elapsed.count () + 999) / 1000, 1));
+      return std::min<std::size_t> (static_cast<std::size_t> (std::bit_width (micros - 1)), bucket_count - 1);
+    }
+
+  public:
+    auto record (std::chrono::nanoseconds elapsed) -> void
+    {
+      auto& s = slots[detail::metric_stripe ()];
+      s.buckets[bucket_of (elapsed)].fetch_add (1, std::memory_order_relaxed);
+      s.sum.fetch_add (static_cast<std::uint64_t> (std::max<std::int64_t> (elapsed.count (), 0)), std::memory_order_relaxed);
+    }
+
+    auto read () const -> snapshot
+    {
+      auto result = snapshot {};
+      for (auto const& s : slots) {
+        for (std::size_t i = 0; i < bucket_count; ++i) {
+          auto const value = s.buckets[i].load (std::memory_order_relaxed);
+          result.buckets[i] += value;
+          result.count += value;
+        }
+        result.sum += std::chrono::nanoseconds (s.sum.load (std::memory_order_relaxed));
+      }
+      return result;
+    }
+  };
+
+  /**
+   * Measures the lifetime of the scope into a histogram.
+   */
+  class scoped_timer
+  {
+  private:
+    latency_histogram& target;
+    std::chrono::steady_clock::time_point start;
+
+  public:
+    explicit scoped_timer (latency_histogram& target)
+      : target (target)
+      , start (std::chrono::steady_clock::now ())
+    {}
+
+    scoped_timer (scoped_timer const&) = delete;
+    scoped_timer& operator= (scoped_timer const&) = delete;
+
+    ~scoped_timer ()
+    {
+      target.record (std::chrono::steady_clock::now () - start);
+    }
+  };
+
+  using metric_labels = std::initializer_list<std::pair<std::string_view, std::string_view>>;
+
+  /**
+   * Writes metrics in the Prometheus text exposition format.
+   * The samples of a metric must be written right after its header.
+   */
+  class prometheus_writer
+  {
+  private:
+    std::string text;
+
+    static auto format (double value) -> std::string
+    {
+      char buffer[32];
+      std::snprintf (buffer, sizeof (buffer), "%.9g", value);
+      return buffer;
+    }
+
+    auto write_labels (metric_labels labels, std::string_view le = {}) -> void
+    {
+      if (labels.size () == 0 && le.empty ())
+        return;
+      text += '{';
+      auto first = true;
+      auto const write = [&] (std::string_view name, std::string_view value) {
+        if (!first)
+          text += ',';
+        first = false;
+        text += name;
+        text += "=\"";
+        for (char c : value) {
+          if (c == '\\' || c == '"')
+            text += '\\';
+          if (c == '\n')
+            text += "\\n";
+          else
+            text += c;
+        }
+        text += '"';
+      };
+      for (auto const& [name, value] : labels)
+        write (name, value);
+      if (!le.empty ())
+        write ("le", le);
+      text += '}';
+    }
+
+    auto write_sample (std::string_view name, metric_labels labels, std::string_view value, std::string_view le = {})
+      -> void
+    {
+      text += name;
+      write_labels (labels, le);
+      text += ' ';
+      text += value;
+      text += '\n';
+    }
+
+  public:
+    /**
+     * type is counter, gauge or histogram.
+     */
+    auto header (std::string_view name, std::string_view type, std::string_view help) -> void
+    {
+      text += "# HELP ";
+      text += name;
+      text += ' ';
+      text += help;
+      text += "\n# TYPE ";
+      text += name;
+      text += ' ';
+      text += type;
+      text += '\n';
+    }
+
+    auto sample (std::string_view name, metric_labels labels, double value) -> void
+    {
+      write_sample (name, labels, format (value));
+    }
+
+    auto sample (std::string_view name, metric_labels labels, std::uint64_t value) -> void
+    {
+      write_sample (name, labels, std::to_string (value));
+    }
+
+    /**
+     * Writes the buckets, sum and count of a histogram, in seconds.
+     */
+    auto sample (std::string_view name, metric_labels labels, latency_histogram::snapshot const& value) -> void
+    {
+      auto const bucket = std::string (name) + "_bucket";
+      auto cumulative = std::uint64_t {0};
+      for (std::size_t i = 0; i + 1 < latency_histogram::bucket_count; ++i) {
+        cumulative += value.buckets[i];
+        auto const le = std::chrono::duration<double> (latency_histogram::upper_bound (i)).count ();
+        write_sample (bucket, labels, std::to_string (cumulative), format (le));
+      }
+      write_sample (bucket, labels, std::to_string (value.count), "+Inf");
+      write_sample (std::string (name) + "_sum", labels, format (std::chrono::duration<double> (value.sum).count ()));
+      write_sample (std::string (name) + "_count", labels, std::to_string (value.count));
+    }
+
+    auto str () && -> std::string
+    {
+      return std::move (text);
+    }
+  };
+
+  /**
+   * Calls function every interval on a background thread, for instance to dump metrics to the log.
+   */
+  class periodic_task
+  {
+  private:
+    std::jthread thread;
+
+  public:
+    periodic_task (std::chrono::milliseconds interval, std::function<void ()> function)
+      : thread ([interval, function = std::move (function)] (std::stop_token stop) {
+        auto mutex = std::mutex ();
+        auto cv = std::condition_variable_any ();
+        auto lock = std::unique_lock (mutex);
+        while (!cv.wait_for (lock, stop, interval, [] {
+          return false;
+        }) && !stop.stop_requested ())
+          function ();
+      })
+    {}
+  };
+} // namespace forest
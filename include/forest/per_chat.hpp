@@ -0,0 +1,48 @@
+#pragma once
+#include <concepts>
+#include <optional>
+#include <type_traits>
+#include <variant>
+
+namespace forest
+{
+  /**
+   * Opts a transition into per-chat mutable state.
+   * Transitions of a table are shared by every chat and called through const references,
+   * a transition wrapped in per_chat is instead copied from prototype into a chat's session
+   * the first time it is considered for that chat, and called through that copy.
+   * The copies live in memory only, they start over from prototype when an evicted session is restored.
+   */
+  template<std::copy_constructible T>
+  struct per_chat
+  {
+    using transition_type = T;
+
+    T prototype;
+  };
+
+  template<class T>
+  per_chat (T) -> per_chat<T>;
+
+  /**
+   * How transition_table stores and calls a transition of type T.
+   */
+  template<class T>
+  struct transition_access
+  {
+    // type of the object through which the transition is called
+    using type = T const;
+    // per-session storage of the transition, empty for shared transitions
+    using slot_type = std::monostate;
+  };
+
+  template<class T>
+  struct transition_access<per_chat<T>>
+  {
+    using type = T;
+    using slot_type = std::optional<T>;
+  };
+
+  template<class T>
+  concept PerChatTransition = !std::same_as<typename transition_access<T>::slot_type, std::monostate>;
+} // namespace forest
@@ -1,101 +1,717 @@
 #pragma once
 #include <SQLiteCpp/SQLiteCpp.h>
+#include <algorithm>
+#include <atomic>
 #include <banana/api.hpp>
+#include <bit>
 #include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <condition_variable>
+#include <limits>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <nlohmann/json.hpp>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <forest/log.hpp>
+#include <forest/metrics.hpp>
+#include <forest/value.hpp>
+#include <forest/value_cache.hpp>
 
 namespace forest
 {
+  struct persistence_options
+  {
+    // value of PRAGMA journal_mode, WAL lets readers proceed while a write is in progress
+    std::string journal_mode = "WAL";
+    // value of PRAGMA synchronous, NORMAL is durable in WAL mode except on power loss
+    std::string synchronous = "NORMAL";
+    // value of PRAGMA mmap_size in bytes, zero disables memory mapped I/O
+    std::int64_t mmap_size = 0;
+    // read-only connections used by get_value, at most 64; zero reads through the write connection
+    std::size_t read_connections = 0;
+    // how long a connection waits for a lock held by another connection
+    std::chrono::milliseconds busy_timeout {5000};
+    // approximate memory budget in bytes of the read-through value cache, zero disables it
+    std::size_t cache_budget = 0;
+  };
+
+  struct write_behind_options
+  {
+    // buffered writes are committed at least this often
+    std::chrono::milliseconds flush_interval {100};
+    // a commit is started as soon as this many keys are buffered
+    std::size_t flush_threshold = 1024;
+  };
+
+  /**
+   * Latency of the operations reaching SQLite, reads served by the cache or the write-behind buffer excluded.
+   */
+  struct persistence_metrics
+  {
+    latency_histogram read;
+    latency_histogram read_batch;
+    latency_histogram scan;
+    latency_histogram write;
+    latency_histogram write_batch;
+    // commit of the write-behind buffer
+    latency_histogram commit;
+  };
+
   class persistence
   {
   private:
+    using key_type = std::pair<banana::integer_t, std::string>;
+    // buffered mutation of a key, nullopt marks a deletion
+    using buffer_type = std::map<key_type, std::optional<stored_value>>;
+
+    // read-only connection with its own prepared statements
+    struct reader
+    {
+      SQLite::Database db;
+      SQLite::Statement stm_get_key;
+      SQLite::Statement stm_scan_prefix;
+
+      reader (std::string const& filename, persistence_options const& options)
+        : db (open_database (filename, SQLite::OPEN_READONLY, options))
+        , stm_get_key (db, str_get_key)
+        , stm_scan_prefix (db, str_scan_prefix)
+      {}
+    };
+
     SQLite::Database db;
     SQLite::Statement stm_get_key;
     SQLite::Statement stm_set_key;
     SQLite::Statement stm_del_key;
+    SQLite::Statement stm_scan_prefix;
+    // guards the write connection and its statements
     std::mutex mutex;
 
+    // bit i of free_readers is set when readers[i] is not in use
+    std::vector<std::unique_ptr<reader>> readers;
+    std::atomic<std::uint64_t> free_readers = 0;
+
+    std::unique_ptr<value_cache> cache;
+    persistence_metrics latencies;
+
+    // write-behind state, guarded by buffer_mutex
+    std::mutex buffer_mutex;
+    std::condition_variable_any cv_flush;
+    buffer_type pending;
+    buffer_type flushing;
+    std::optional<write_behind_options> write_behind;
+    // serializes commits of the buffer
+    std::mutex flush_mutex;
+    std::jthread flusher;
+
     static constexpr auto str_get_key = "SELECT kValue FROM sessions WHERE chat_id=? AND kName=?";
     static constexpr auto str_set_key =
       "INSERT OR REPLACE INTO sessions(chat_id,kName,kValue) VALUES (?,?,?)";
     static constexpr auto str_del_key = "DELETE FROM sessions WHERE chat_id=? AND kName=?";
+    // a range over the primary key, so that the scan is an index seek
+    static constexpr auto str_scan_prefix =
+      "SELECT kName, kValue FROM sessions WHERE chat_id=? AND kName>=? AND kName<?";
+    static constexpr auto str_chats_with =
+      "SELECT chat_id FROM sessions WHERE kName=? AND chat_id>? ORDER BY chat_id";
     static constexpr auto str_create_db = "CREATE TABLE IF NOT EXISTS\n"
                                           "sessions\n"
                                           "(\n"
                                           "chat_id INTEGER,\n"
                                           "kName TEXT not null,\n"
-                                          "kValue TEXT null,\n"
+                                          "kValue BLOB null,\n"
                                           "PRIMARY KEY (chat_id, kName)\n"
                                           ")";
 
+    static auto open_database (std::string const& filename, int flags, persistence_options const& options)
+      -> SQLite::Database
+    {
+      SQLite::Database db (filename, flags, static_cast<int> (options.busy_timeout.count ()));
+      if (!options.synchronous.empty ())
+        db.exec ("PRAGMA synchronous=" + options.synchronous);
+      db.exec ("PRAGMA mmap_size=" + std::to_string (options.mmap_size));
+      return db;
+    }
+
+    static auto read_column (SQLite::Column const& column) -> stored_value
+    {
+      switch (column.getType ()) {
+      case SQLite::INTEGER:
+        return static_cast<std::int64_t> (column.getInt64 ());
+      case SQLite::FLOAT:
+        return column.getDouble ();
+      case SQLite::TEXT:
+        return column.getString ();
+      case SQLite::BLOB: {
+        auto const* data = static_cast<std::uint8_t const*> (column.getBlob ());
+        return blob (data, data + column.getBytes ());
+      }
+      default:
+        return std::monostate {};
+      }
+    }
+
+    static auto bind_value (SQLite::Statement& statement, int index, stored_value const& value) -> void
+    {
+      std::visit (
+        [&]<class T> (T const& alternative) {
+          if constexpr (std::same_as<T, std::monostate>)
+            statement.bind (index);
+          else if constexpr (std::same_as<T, blob>)
+            statement.bind (index, alternative.data (), static_cast<int> (alternative.size ()));
+          else if constexpr (std::same_as<T, std::int64_t>)
+            statement.bind (index, static_cast<long long> (alternative));
+          else
+            statement.bind (index, alternative);
+        },
+        value);
+    }
+
+    // runs a prepared get statement and resets it, so that no read transaction is left open
+    static auto query_key (SQLite::Statement& statement, banana::integer_t chat_id, std::string const& kName)
+      -> std::optional<stored_value>
+    {
+      statement.reset ();
+      statement.bind (1, chat_id);
+      statement.bind (2, kName);
+
+      auto result = std::optional<stored_value> ();
+      if (statement.executeStep ())
+        result = read_column (statement.getColumn (0));
+      statement.reset ();
+      return result;
+    }
+
+    // looks up several keys within a single read transaction, so they are read from one snapshot
+    static auto query_keys (SQLite::Database& db, SQLite::Statement& statement, banana::integer_t chat_id,
+      std::vector<std::string const*> const& names, value_map& result) -> void
+    {
+      auto transaction = SQLite::Transaction (db);
+      for (auto const* name : names)
+        if (auto value = query_key (statement, chat_id, *name); value.has_value ())
+          result.insert_or_assign (*name, std::move (value.value ()));
+      transaction.commit ();
+    }
+
+    static auto query_prefix (SQLite::Statement& statement, banana::integer_t chat_id, std::string const& prefix)
+      -> value_map
+    {
+      statement.reset ();
+      statement.bind (1, chat_id);
+      statement.bind (2, prefix);
+      // 0xff never occurs in UTF-8, every name starting with prefix sorts below this bound
+      statement.bind (3, prefix + '\xff');
+
+      auto result = value_map ();
+      while (statement.executeStep ())
+        result.insert_or_assign (statement.getColumn (0).getString (), read_column (statement.getColumn (1)));
+      statement.reset ();
+      return result;
+    }
+
+    // claims a free read connection, or returns readers.size () if none is available
+    auto acquire_reader () -> std::size_t
+    {
+      auto mask = free_readers.load (std::memory_order_relaxed);
+      while (mask != 0) {
+        auto const index = static_cast<std::size_t> (std::countr_zero (mask));
+        if (free_readers.compare_exchange_weak (mask, mask & ~(std::uint64_t {1} << index), std::memory_order_acquire))
+          return index;
+      }
+      return readers.size ();
+    }
+
+    auto release_reader (std::size_t index) -> void
+    {
+      free_readers.fetch_or (std::uint64_t {1} << index, std::memory_order_release);
+    }
+
+    // calls function (db, get statement, scan statement) on a free read connection,
+    // or on the write connection if every read connection is busy
+    template<class Function>
+    auto with_reader (Function&& function)
+    {
+      // read connections are claimed without locking, the write connection is the fallback
+      if (auto index = acquire_reader (); index < readers.size ()) {
+        struct release_guard
+        {
+          persistence& self;
+          std::size_t index;
+
+          ~release_guard ()
+          {
+            self.release_reader (index);
+          }
+        } release {*this, index};
+
+        reader& r = *readers[index];
+        return function (r.db, r.stm_get_key, r.stm_scan_prefix);
+      }
+
+      auto guard = std::scoped_lock (mutex);
+      return function (db, stm_get_key, stm_scan_prefix);
+    }
+
   public:
-    static auto create_database (std::string filename)
+    static auto create_database (std::string filename, persistence_options const& options = {})
     {
-      SQLite::Database db (filename, SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE);
+      auto db = open_database (filename, SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE, options);
+      // journal_mode is persistent, it is set once by the write connection
+      if (!options.journal_mode.empty ())
+        db.exec ("PRAGMA journal_mode=" + options.journal_mode);
       db.exec (str_create_db);
       return db;
     }
 
-    persistence (std::string filename)
-      : db (create_database (filename))
+    persistence (std::string filename, persistence_options options = {})
+      : db (create_database (filename, options))
       , stm_get_key (db, str_get_key)
       , stm_set_key (db, str_set_key)
       , stm_del_key (db, str_del_key)
-    {}
+      , stm_scan_prefix (db, str_scan_prefix)
+    {
+      // in-memory databases are private to their connection
+      if (filename == ":memory:" || filename.empty ())
+        options.read_connections = 0;
+
+      options.read_connections = std::min<std::size_t> (options.read_connections, 64);
+      for (std::size_t i = 0; i < options.read_connections; ++i)
+        readers.push_back (std::make_unique<reader> (filename, options));
+      if (!readers.empty ())
+        free_readers = readers.size () == 64 ? ~std::uint64_t {0} : (std::uint64_t {1} << readers.size ()) - 1;
+
+      if (options.cache_budget > 0)
+        cache = std::make_unique<value_cache> (options.cache_budget);
+    }
+
+    ~persistence ()
+    {
+      if (flusher.joinable ()) {
+        flusher.request_stop ();
+        flusher.join ();
+      }
+      if (!try_flush ())
+        log<log_level::error> ("Buffered writes lost: ", pending.size (), " keys could not be committed");
+    }
+
+    /**
+     * Buffers writes and deletions in memory and commits them in a single transaction,
+     * every flush_interval or as soon as flush_threshold keys are buffered.
+     * Reads see buffered writes. Must be called before the storage is shared between threads.
+     */
+    void enable_write_behind (write_behind_options options = {})
+    {
+      write_behind = options;
+      flusher = std::jthread ([this] (std::stop_token stop) {
+        while (!stop.stop_requested ()) {
+          {
+            auto lock = std::unique_lock (buffer_mutex);
+            cv_flush.wait_for (lock, stop, write_behind->flush_interval, [this] {
+              return pending.size () >= write_behind->flush_threshold;
+            });
+          }
+          // a failed batch stays buffered and is retried on the next tick
+          try_flush ();
+        }
+      });
+    }
+
+    /**
+     * Durability barrier: commits every buffered write before returning.
+     */
+    void flush ()
+    {
+      auto flush_guard = std::scoped_lock (flush_mutex);
+      {
+        auto guard = std::scoped_lock (buffer_mutex);
+        if (pending.empty ())
+          return;
+        std::swap (pending, flushing);
+      }
+
+      // buffered values stay visible through flushing until they are committed
+      try {
+        auto guard = std::scoped_lock (mutex);
+        auto timer = scoped_timer (latencies.commit);
+        auto transaction = SQLite::Transaction (db);
+        for (auto const& [key, value] : flushing) {
+          if (value.has_value ())
+            write_key (key.first, key.second, value.value ());
+          else
+            erase_key (key.first, key.second);
+        }
+        transaction.commit ();
+      } catch (...) {
+        // keep the batch for the next attempt, writes buffered meanwhile are newer
+        auto guard = std::scoped_lock (buffer_mutex);
+        pending.merge (flushing);
+        flushing.clear ();
+        throw;
+      }
+
+      auto guard = std::scoped_lock (buffer_mutex);
+      flushing.clear ();
+    }
+
+    /**
+     * Same as flush, but logs the error instead of throwing it. Returns whether every buffered write was committed.
+     */
+    auto try_flush () -> bool
+    {
+      try {
+        flush ();
+        return true;
+      } catch (std::exception& e) {
+        log<log_level::warning> ("Failed to commit buffered writes: ", e.what ());
+      } catch (...) {
+        log<log_level::warning> ("Failed to commit buffered writes");
+      }
+      return false;
+    }
+
+    /**
+     * Reads a value in its stored representation.
+     */
+    auto get_stored (banana::integer_t chat_id, std::string const& kName) -> std::optional<stored_value>
+    {
+      if (!cache)
+        return load_value (chat_id, kName);
+
+      if (auto hit = cache->lookup (chat_id, kName); hit.has_value ())
+        return std::move (hit.value ());
+
+      auto const generation = cache->generation (chat_id, kName);
+      auto value = load_value (chat_id, kName);
+      cache->fill (chat_id, kName, value, generation);
+      return value;
+    }
+
+    /**
+     * Writes a value in its stored representation.
+     */
+    bool set_stored (banana::integer_t chat_id, std::string kName, stored_value kValue)
+    {
+      if (cache) {
+        auto const result = write_value (chat_id, kName, std::move (kValue));
+        cache->invalidate (chat_id, kName);
+        return result;
+      }
+      return write_value (chat_id, std::move (kName), std::move (kValue));
+    }
+
+    /**
+     * Reads a value stored with set<T>, integers and reals come back from native columns without parsing.
+     */
+    template<StorableValue T>
+    auto get (banana::integer_t chat_id, std::string const& kName) -> std::optional<T>
+    {
+      if (auto value = get_stored (chat_id, kName); value.has_value ())
+        return value_traits<T>::decode (value.value ());
+      return std::nullopt;
+    }
+
+    template<StorableValue T>
+    bool set (banana::integer_t chat_id, std::string kName, T const& kValue)
+    {
+      return set_stored (chat_id, std::move (kName), value_traits<T>::encode (kValue));
+    }
+
+    /**
+     * Writes a value unless the key exists, returns whether it was written. The check and the write are atomic
+     * with respect to the other writes of this storage, and the value is committed before returning,
+     * even with write-behind enabled.
+     */
+    template<StorableValue T>
+    bool insert (banana::integer_t chat_id, std::string kName, T const& kValue)
+    {
+      auto flush_guard = std::scoped_lock (flush_mutex);
+      // with flush_mutex held nothing is being flushed, the buffered writes are all in pending
+      auto buffer_guard = std::scoped_lock (buffer_mutex);
+      auto const key = key_type (chat_id, kName);
+      auto const buffered = pending.find (key);
+      if (buffered != pending.end () && buffered->second.has_value ())
+        return false;
+      {
+        auto guard = std::scoped_lock (mutex);
+        auto timer = scoped_timer (latencies.write);
+        // a buffered deletion hides the value in the database, which is replaced
+        if (buffered == pending.end () && query_key (stm_get_key, chat_id, kName).has_value ())
+          return false;
+        write_key (chat_id, kName, value_traits<T>::encode (kValue));
+      }
+      if (buffered != pending.end ())
+        pending.erase (buffered);
+      if (cache)
+        cache->invalidate (chat_id, kName);
+      return true;
+    }
 
     auto get_value (banana::integer_t chat_id, std::string kName) -> std::optional<std::string>
     {
-      auto guard = std::scoped_lock (mutex);
-      stm_get_key.reset ();
-      stm_get_key.bind (1, chat_id);
-      stm_get_key.bind (2, kName);
-      if (stm_get_key.executeStep ()) {
-        return stm_get_key.getColumn (0).getString ();
+      return get<std::string> (chat_id, kName);
+    }
+
+    /**
+     * Latency histograms of the SQLite operations.
+     */
+    auto metrics () const -> persistence_metrics const&
+    {
+      return latencies;
+    }
+
+    /**
+     * Hit and miss counters of the value cache, all zero when the cache is disabled.
+     */
+    auto cache_statistics () -> cache_stats
+    {
+      return cache ? cache->stats () : cache_stats {};
+    }
+
+  private:
+    // reads a value bypassing the cache: buffered writes first, then the database
+    auto load_value (banana::integer_t chat_id, std::string const& kName) -> std::optional<stored_value>
+    {
+      if (write_behind.has_value ()) {
+        auto guard = std::scoped_lock (buffer_mutex);
+        auto key = key_type (chat_id, kName);
+        if (auto it = pending.find (key); it != pending.end ())
+          return it->second;
+        if (auto it = flushing.find (key); it != flushing.end ())
+          return it->second;
+      }
+
+      auto timer = scoped_timer (latencies.read);
+      return with_reader ([&] (SQLite::Database&, SQLite::Statement& statement, SQLite::Statement&) {
+        return query_key (statement, chat_id, kName);
+      });
+    }
+
+    // batch counterpart of load_value, the names found are removed from missing
+    auto load_values (banana::integer_t chat_id, std::vector<std::string const*>& missing, value_map& result) -> void
+    {
+      if (write_behind.has_value ()) {
+        auto guard = std::scoped_lock (buffer_mutex);
+        std::erase_if (missing, [&] (std::string const* name) {
+          auto key = key_type (chat_id, *name);
+          auto it = pending.find (key);
+          if (it == pending.end () && (it = flushing.find (key)) == flushing.end ())
+            return false;
+          if (it->second.has_value ())
+            result.insert_or_assign (*name, it->second.value ());
+          return true;
+        });
+      }
+      if (missing.empty ())
+        return;
+
+      auto timer = scoped_timer (latencies.read_batch);
+      with_reader ([&] (SQLite::Database& connection, SQLite::Statement& statement, SQLite::Statement&) {
+        query_keys (connection, statement, chat_id, missing, result);
+      });
+    }
+
+    // buffered writes and deletions of the keys of chat_id starting with prefix, newest last
+    auto buffered_prefix (banana::integer_t chat_id, std::string const& prefix)
+      -> std::vector<std::pair<std::string, std::optional<stored_value>>>
+    {
+      auto result = std::vector<std::pair<std::string, std::optional<stored_value>>> ();
+      auto guard = std::scoped_lock (buffer_mutex);
+      for (buffer_type const* buffer : {&flushing, &pending})
+        for (auto it = buffer->lower_bound (key_type (chat_id, prefix));
+             it != buffer->end () && it->first.first == chat_id && it->first.second.starts_with (prefix); ++it)
+          result.emplace_back (it->first.second, it->second);
+      return result;
+    }
+
+  public:
+    /**
+     * Reads several keys of a chat with a single lock acquisition and read transaction.
+     * The result only contains the keys that exist.
+     */
+    auto get_values (banana::integer_t chat_id, std::vector<std::string> const& names) -> value_map
+    {
+      auto result = value_map ();
+      auto missing = std::vector<std::string const*> ();
+      missing.reserve (names.size ());
+
+      // tokens of the missing keys, see value_cache::fill
+      auto generations = std::vector<std::uint64_t> ();
+      if (cache) {
+        for (auto const& name : names) {
+          if (auto hit = cache->lookup (chat_id, name); !hit.has_value ()) {
+            missing.push_back (&name);
+            generations.push_back (cache->generation (chat_id, name));
+          } else if (hit->has_value ()) {
+            result.insert_or_assign (name, std::move (hit->value ()));
+          }
+        }
       } else {
-        return std::nullopt;
+        for (auto const& name : names)
+          missing.push_back (&name);
       }
+      if (missing.empty ())
+        return result;
+
+      auto const requested = missing;
+      load_values (chat_id, missing, result);
+      if (cache)
+        for (std::size_t i = 0; i < requested.size (); ++i) {
+          auto it = result.find (*requested[i]);
+          cache->fill (chat_id, *requested[i],
+            it != result.end () ? value_cache::value_type (it->second) : std::nullopt, generations[i]);
+        }
+      return result;
     }
 
-    bool set_value (banana::integer_t chat_id, std::string kName, std::string kValue)
+    /**
+     * Writes several keys of a chat in a single transaction, or a single insertion into the write-behind buffer.
+     */
+    bool set_values (banana::integer_t chat_id, value_map values)
     {
-      auto guard = std::scoped_lock (mutex);
-      stm_set_key.reset ();
-      stm_set_key.bind (1, chat_id);
-      stm_set_key.bind (2, kName);
+      auto result = true;
+      if (write_behind.has_value ()) {
+        auto guard = std::scoped_lock (buffer_mutex);
+        for (auto const& [name, value] : values)
+          pending.insert_or_assign (key_type (chat_id, name), value);
+        if (pending.size () >= write_behind->flush_threshold)
+          cv_flush.notify_one ();
+      } else {
+        auto guard = std::scoped_lock (mutex);
+        auto timer = scoped_timer (latencies.write_batch);
+        auto transaction = SQLite::Transaction (db);
+        for (auto const& [name, value] : values)
+          result = write_key (chat_id, name, value) && result;
+        transaction.commit ();
+      }
 
-      if (!kValue.empty ())
-        stm_set_key.bind (3, kValue);
-      return stm_set_key.exec ();
+      if (cache)
+        for (auto const& [name, value] : values)
+          cache->invalidate (chat_id, name);
+      return result;
+    }
+
+    /**
+     * Reads every key of a chat whose name starts with prefix, with a single statement.
+     */
+    auto scan_prefix (banana::integer_t chat_id, std::string const& prefix) -> value_map
+    {
+      // the buffer is read first, a key flushed meanwhile is then found in the database
+      auto buffered = std::vector<std::pair<std::string, std::optional<stored_value>>> ();
+      if (write_behind.has_value ())
+        buffered = buffered_prefix (chat_id, prefix);
+
+      auto result = value_map ();
+      {
+        auto timer = scoped_timer (latencies.scan);
+        result = with_reader ([&] (SQLite::Database&, SQLite::Statement&, SQLite::Statement& statement) {
+          return query_prefix (statement, chat_id, prefix);
+        });
+      }
+      for (auto& [name, value] : buffered) {
+        if (value.has_value ())
+          result.insert_or_assign (std::move (name), std::move (value.value ()));
+        else
+          result.erase (name);
+      }
+      return result;
+    }
+
+    /**
+     * Chats, in ascending order and greater than after, that have a value stored under kName:
+     * for instance every chat with a session. Buffered writes are flushed first.
+     * The name is not indexed, this scans the table and is meant for occasional jobs such as broadcasts.
+     */
+    auto chats_with (
+      std::string const& kName, banana::integer_t after = std::numeric_limits<banana::integer_t>::min ())
+      -> std::vector<banana::integer_t>
+    {
+      flush ();
+      return with_reader ([&] (SQLite::Database& database, SQLite::Statement&, SQLite::Statement&) {
+        auto statement = SQLite::Statement (database, str_chats_with);
+        statement.bind (1, kName);
+        statement.bind (2, after);
+        auto result = std::vector<banana::integer_t> ();
+        while (statement.executeStep ())
+          result.push_back (statement.getColumn (0).getInt64 ());
+        return result;
+      });
+    }
+
+  public:
+    bool set_value (banana::integer_t chat_id, std::string kName, std::string kValue)
+    {
+      return set_stored (chat_id, std::move (kName), std::move (kValue));
     }
 
     std::optional<long long> get_value_ll (banana::integer_t chat_id, std::string kName)
     {
-      if (auto value = get_value (chat_id, kName); value)
-        return std::stoll (value.value ());
-      return std::nullopt;
+      return get<long long> (chat_id, kName);
     }
 
     bool set_value_ll (banana::integer_t chat_id, std::string kName, long long kValue)
     {
-      return set_value (chat_id, kName, std::to_string (kValue));
+      return set (chat_id, std::move (kName), kValue);
     }
 
     std::optional<nlohmann::json> get_value_json (banana::integer_t chat_id, std::string kName)
     {
-      if (auto value = get_value (chat_id, kName); value)
-        return nlohmann::json::parse (value.value ());
-      return std::nullopt;
+      return get<nlohmann::json> (chat_id, kName);
     }
 
     bool set_value_json (banana::integer_t chat_id, std::string kName, nlohmann::json const& kValue)
     {
-      return set_value (chat_id, kName, kValue.dump ());
+      return set (chat_id, std::move (kName), kValue);
     }
 
     bool delete_value (banana::integer_t chat_id, std::string kName)
     {
+      auto const result = write_value (chat_id, kName, std::nullopt);
+      if (cache)
+        cache->invalidate (chat_id, kName);
+      return result;
+    }
+
+  private:
+    // writes to the write-behind buffer or to the database, nullopt deletes the key
+    bool write_value (banana::integer_t chat_id, std::string kName, std::optional<stored_value> kValue)
+    {
+      if (write_behind.has_value ())
+        return buffer (chat_id, std::move (kName), std::move (kValue));
+
       auto guard = std::scoped_lock (mutex);
+      auto timer = scoped_timer (latencies.write);
+      if (kValue.has_value ())
+        return write_key (chat_id, kName, kValue.value ());
+      return erase_key (chat_id, kName);
+    }
+
+    bool buffer (banana::integer_t chat_id, std::string kName, std::optional<stored_value> kValue)
+    {
+      auto guard = std::scoped_lock (buffer_mutex);
+      pending.insert_or_assign (key_type (chat_id, std::move (kName)), std::move (kValue));
+      if (pending.size () >= write_behind->flush_threshold)
+        cv_flush.notify_one ();
+      return true;
+    }
+
+    // statement helpers, the caller holds mutex
+    bool write_key (banana::integer_t chat_id, std::string const& kName, stored_value const& kValue)
+    {
+      stm_set_key.reset ();
+      stm_set_key.bind (1, chat_id);
+      stm_set_key.bind (2, kName);
+      bind_value (stm_set_key, 3, kValue);
+      return stm_set_key.exec ();
+    }
+
+    bool erase_key (banana::integer_t chat_id, std::string const& kName)
+    {
       stm_del_key.reset ();
       stm_del_key.bind (1, chat_id);
       stm_del_key.bind (2, kName);
@@ -0,0 +1,24 @@
+#pragma once
+#include <functional>
+#include <string>
+#include <utility>
+
+#include <forest/http.hpp>
+#include <forest/metrics.hpp>
+
+// opt-in: http_server needs POSIX sockets, forest.hpp does not include this header
+
+namespace forest
+{
+  /**
+   * Handler for an http_server serving the text returned by metrics to Prometheus scrapes, on any path.
+   */
+  inline auto prometheus_endpoint (std::function<std::string ()> metrics) -> http_server::handler_type
+  {
+    return [metrics = std::move (metrics)] (http_request const& request) {
+      if (request.method != "GET")
+        return http_response {"405 Method Not Allowed", {}, {}};
+      return http_response {"200 OK", "text/plain; version=0.0.4", metrics ()};
+    };
+  }
+} // namespace forest
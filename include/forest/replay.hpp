@@ -0,0 +1,230 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <istream>
+#include <new>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <banana/api.hpp>
+
+#include <forest/events/update.hpp>
+#include <forest/update_source.hpp>
+
+namespace forest
+{
+  /**
+   * Process-wide allocation counters, updated only by the replacement operator new
+   * defined when FOREST_COUNT_ALLOCATIONS is set, see below.
+   */
+  struct allocation_stats
+  {
+    static inline std::atomic<std::uint64_t> count = 0;
+    static inline std::atomic<std::uint64_t> bytes = 0;
+
+    static auto record (std::size_t size) -> void
+    {
+      count.fetch_add (1, std::memory_order_relaxed);
+      bytes.fetch_add (size, std::memory_order_relaxed);
+    }
+  };
+
+  struct synthetic_options
+  {
+    std::size_t chats = 1000;
+    std::size_t messages_per_chat = 10;
+    // texts sent by every chat, in turn
+    std::vector<std::string> texts = {"/start"};
+    banana::integer_t first_update_id = 1;
+  };
+
+  /**
+   * Generates a stream of text messages, interleaving the chats the way concurrent users would.
+   * Chat ids start from 1.
+   */
+  inline auto synthetic_updates (synthetic_options const& options) -> std::vector<banana::api::update_t>
+  {
+    auto result = std::vector<banana::api::update_t> ();
+    result.reserve (options.chats * options.messages_per_chat);
+
+    auto update_id = options.first_update_id;
+    for (std::size_t round = 0; round < options.messages_per_chat; ++round) {
+      for (std::size_t chat = 1; chat <= options.chats; ++chat) {
+        auto message = banana::api::message_t {};
+        message.message_id = static_cast<banana::integer_t> (round + 1);
+        message.date = 0;
+        message.chat.id = static_cast<banana::integer_t> (chat);
+        message.chat.type = "private";
+        if (!options.texts.empty ())
+          message.text = options.texts[round % options.texts.size ()];
+
+        auto update = banana::api::update_t {};
+        update.update_id = update_id++;
+        update.message = std::move (message);
+        result.push_back (std::move (update));
+      }
+    }
+    return result;
+  }
+
+  /**
+   * Reads recorded updates, one JSON object per line as delivered by telegram.
+   * Blank lines are skipped, malformed lines throw.
+   */
+  inline auto load_updates (std::istream& input) -> std::vector<banana::api::update_t>
+  {
+    auto result = std::vector<banana::api::update_t> ();
+    auto line = std::string ();
+    while (std::getline (input, line)) {
+      if (line.find_first_not_of (" \t\r") == std::string::npos)
+        continue;
+      result.push_back (decode_update (line));
+    }
+    return result;
+  }
+
+  struct replay_options
+  {
+    // threads calling handle_update, chats are partitioned among them so each chat stays in order
+    std::size_t threads = 1;
+  };
+
+  struct replay_report
+  {
+    std::size_t updates = 0;
+    std::chrono::nanoseconds elapsed {0};
+    // latency of a single handle_update call
+    std::chrono::nanoseconds p50 {0};
+    std::chrono::nanoseconds p90 {0};
+    std::chrono::nanoseconds p99 {0};
+    std::chrono::nanoseconds p999 {0};
+    std::chrono::nanoseconds max {0};
+    // zero unless FOREST_COUNT_ALLOCATIONS is set
+    double allocations_per_update = 0;
+    double bytes_per_update = 0;
+
+    auto throughput () const -> double
+    {
+      auto const seconds = std::chrono::duration<double> (elapsed).count ();
+      return seconds > 0 ? static_cast<double> (updates) / seconds : 0;
+    }
+
+    friend auto operator<< (std::ostream& out, replay_report const& report) -> std::ostream&
+    {
+      auto const micros = [] (std::chrono::nanoseconds value) {
+        return std::chrono::duration<double, std::micro> (value).count ();
+      };
+      out << "updates: " << report.updates << "\n";
+      out << "elapsed: " << std::chrono::duration<double> (report.elapsed).count () << " s\n";
+      out << "throughput: " << report.throughput () << " updates/s\n";
+      out << "latency (us): p50 " << micros (report.p50) << ", p90 " << micros (report.p90) << ", p99 "
+          << micros (report.p99) << ", p99.9 " << micros (report.p999) << ", max " << micros (report.max) << "\n";
+      out << "allocations per update: " << report.allocations_per_update << " (" << report.bytes_per_update
+          << " bytes)\n";
+      return out;
+    }
+  };
+
+  /**
+   * Feeds the updates through handler.handle_update as fast as possible and measures each call.
+   * The handler should be built on a fake_agent, with send rates high enough not to throttle the run.
+   * Allocations are counted process-wide: work of the send queue and of the checkpointer is included.
+   */
+  template<class Handler>
+  auto replay (Handler& handler, std::vector<banana::api::update_t> const& updates, replay_options options = {})
+    -> replay_report
+  {
+    using clock = std::chrono::steady_clock;
+
+    auto const threads = std::max<std::size_t> (options.threads, 1);
+    auto partitions = std::vector<std::vector<std::size_t>> (threads);
+    for (std::size_t i = 0; i < updates.size (); ++i) {
+      auto const& update = updates[i];
+      // updates carrying no event are dropped by the handler, any partition will do
+      auto chat_id = banana::integer_t {0};
+      events::visit_update (update, [&] (banana::integer_t id, auto const&) {
+        chat_id = id;
+        return true;
+      });
+      partitions[static_cast<std::uint64_t> (chat_id) % threads].push_back (i);
+    }
+
+    auto latencies = std::vector<std::vector<std::chrono::nanoseconds>> (threads);
+    auto const run = [&] (std::size_t partition) {
+      auto& measured = latencies[partition];
+      measured.reserve (partitions[partition].size ());
+      for (auto index : partitions[partition]) {
+        auto const start = clock::now ();
+        handler.handle_update (updates[index]);
+        measured.push_back (clock::now () - start);
+      }
+    };
+
+    auto const allocations_before = allocation_stats::count.load ();
+    auto const bytes_before = allocation_stats::bytes.load ();
+    auto const start = clock::now ();
+    if (threads == 1) {
+      run (0);
+    } else {
+      auto workers = std::vector<std::jthread> ();
+      for (std::size_t i = 0; i < threads; ++i)
+        workers.emplace_back (run, i);
+    }
+    auto const elapsed = clock::now () - start;
+    auto const allocations = allocation_stats::count.load () - allocations_before;
+    auto const bytes = allocation_stats::bytes.load () - bytes_before;
+
+    auto all = std::vector<std::chrono::nanoseconds> ();
+    all.reserve (updates.size ());
+    for (auto& measured : latencies)
+      all.insert (all.end (), measured.begin (), measured.end ());
+    std::ranges::sort (all);
+
+    auto report = replay_report {};
+    report.updates = updates.size ();
+    report.elapsed = std::chrono::duration_cast<std::chrono::nanoseconds> (elapsed);
+    if (!all.empty ()) {
+      auto const percentile = [&all] (double p) {
+        return all[std::min (all.size () - 1, static_cast<std::size_t> (p * static_cast<double> (all.size ())))];
+      };
+      report.p50 = percentile (0.5);
+      report.p90 = percentile (0.9);
+      report.p99 = percentile (0.99);
+      report.p999 = percentile (0.999);
+      report.max = all.back ();
+      report.allocations_per_update = static_cast<double> (allocations) / static_cast<double> (all.size ());
+      report.bytes_per_update = static_cast<double> (bytes) / static_cast<double> (all.size ());
+    }
+    return report;
+  }
+} // namespace forest
+
+/**
+ * Defining FOREST_COUNT_ALLOCATIONS before including this header replaces the global operator new
+ * to feed allocation_stats. Define it in a single translation unit of the program.
+ */
+#ifdef FOREST_COUNT_ALLOCATIONS
+void* operator new (std::size_t size)
+{
+  forest::allocation_stats::record (size);
+  if (void* pointer = std::malloc (size == 0 ? 1 : size))
+    return pointer;
+  throw std::bad_alloc ();
+}
+
+void operator delete (void* pointer) noexcept
+{
+  std::free (pointer);
+}
+
+void operator delete (void* pointer, std::size_t) noexcept
+{
+  std::free (pointer);
+}
+#endif
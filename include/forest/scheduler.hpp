@@ -0,0 +1,313 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <banana/api.hpp>
+#include <nlohmann/json.hpp>
+
+#include <forest/log.hpp>
+#include <forest/persistence.hpp>
+#include <forest/timer_wheel.hpp>
+#include <forest/value.hpp>
+
+namespace forest
+{
+  using timer_id = std::uint64_t;
+
+  struct fired_timer
+  {
+    banana::integer_t chat_id;
+    timer_id id;
+    std::string payload;
+  };
+
+  struct scheduler_options
+  {
+    // resolution of the timers, which fire up to one tick late
+    std::chrono::milliseconds tick {100};
+  };
+
+  namespace detail
+  {
+    // timers are stored under a chat id that telegram never assigns, as broadcasts
+    inline constexpr banana::integer_t timer_chat = 0;
+    inline constexpr auto timer_prefix = "forest.timer.";
+    // high-water mark of the timer ids, outside timer_prefix
+    inline constexpr auto timer_ids_key = "forest.timer_ids";
+  } // namespace detail
+
+  /**
+   * Timers of the chats of a context_handler, on a timer_wheel turned by a background thread.
+   * Every timer is also written to persistence and removed once delivered or cancelled: the timers pending
+   * when the process stops are restored by start, with a single prefix scan, and fire when due,
+   * or right away if they are overdue.
+   * Writes go through the write-behind buffer when it is enabled on the storage, so scheduling does not wait
+   * for SQLite, but a crash loses the timers scheduled since the last flush. Otherwise they are synchronous.
+   */
+  class scheduler
+  {
+  public:
+    using clock = std::chrono::steady_clock;
+    using deliver_type = std::function<void (fired_timer)>;
+
+  private:
+    struct pending_timer
+    {
+      fired_timer timer;
+      clock::time_point due;
+    };
+
+    persistence& storage;
+    scheduler_options options;
+    clock::time_point epoch = clock::now ();
+    std::mutex mutex;
+    std::condition_variable_any wake;
+    timer_wheel<pending_timer> wheel;
+    // the chat of a timer is kept here too, so that cancel checks it without leaving the wheel
+    std::unordered_map<timer_id, std::pair<banana::integer_t, timer_wheel<pending_timer>::handle>> handles;
+    // ids are not reused across restarts, so that a stale id cannot cancel a timer of the next run:
+    // the ids below reserved_ids are taken by this run, the mark is persisted a block ahead of next_id
+    timer_id next_id = 1;
+    timer_id reserved_ids = 0;
+    // set while a thread persists the next mark, without holding mutex
+    bool reserving = false;
+    std::condition_variable ids_reserved;
+    deliver_type deliver;
+    std::jthread thread;
+
+    static constexpr timer_id id_block = 1024;
+
+    // lock holds mutex, released while the new mark is persisted. The first call also reads the mark
+    // of the previous run, the later ones extend the reservation before it runs out
+    auto reserve_ids (std::unique_lock<std::mutex>& lock) -> void
+    {
+      reserving = true;
+      auto const first = reserved_ids == 0;
+      auto floor = std::max (next_id, reserved_ids);
+      lock.unlock ();
+      try {
+        if (first) {
+          auto const persisted = storage.get<std::int64_t> (detail::timer_chat, detail::timer_ids_key).value_or (0);
+          floor = std::max (floor, static_cast<timer_id> (persisted));
+        }
+        storage.set (detail::timer_chat, detail::timer_ids_key, static_cast<std::int64_t> (floor + id_block));
+      } catch (...) {
+        lock.lock ();
+        reserving = false;
+        ids_reserved.notify_all ();
+        throw;
+      }
+      lock.lock ();
+      if (first)
+        next_id = std::max (next_id, floor);
+      reserved_ids = std::max (reserved_ids, floor + id_block);
+      reserving = false;
+      ids_reserved.notify_all ();
+    }
+
+    static auto key (timer_id id) -> std::string
+    {
+      return detail::timer_prefix + std::to_string (id);
+    }
+
+    // first tick at which a timer due at the given time has expired
+    auto tick_of (clock::time_point due) const -> std::uint64_t
+    {
+      auto const elapsed = std::max (due - epoch, clock::duration::zero ());
+      return static_cast<std::uint64_t> ((elapsed + options.tick - clock::duration (1)) / options.tick);
+    }
+
+    auto add (pending_timer timer) -> void
+    {
+      auto const id = timer.timer.id;
+      auto const chat_id = timer.timer.chat_id;
+      auto const tick = tick_of (timer.due);
+      handles.insert_or_assign (id, std::pair {chat_id, wheel.schedule (tick, std::move (timer))});
+    }
+
+    auto restore () -> void
+    {
+      auto const now = clock::now ();
+      auto const wall_now = std::chrono::system_clock::now ();
+      auto const prefix = std::string (detail::timer_prefix);
+      for (auto const& [name, value] : storage.scan_prefix (detail::timer_chat, prefix)) {
+        try {
+          auto const json = value_traits<nlohmann::json>::decode (value);
+          auto const id = timer_id {std::stoull (name.substr (prefix.size ()))};
+          // scheduled before start, in this run
+          if (handles.contains (id))
+            continue;
+          auto const due = std::chrono::system_clock::time_point (
+            std::chrono::milliseconds (json.at ("due").get<std::int64_t> ()));
+          add ({{json.at ("chat").get<banana::integer_t> (), id, json.at ("payload").get<std::string> ()},
+            now + std::chrono::duration_cast<clock::duration> (due - wall_now)});
+          next_id = std::max (next_id, id + 1);
+        } catch (std::exception& e) {
+          log<log_level::warning> ("Skipping malformed timer ", name, ": ", e.what ());
+        }
+      }
+    }
+
+    auto run (std::stop_token stop) -> void
+    {
+      auto fired = std::vector<fired_timer> ();
+      auto lock = std::unique_lock (mutex);
+      while (!stop.stop_requested ()) {
+        if (wheel.size () == 0) {
+          wake.wait (lock, stop, [this] {
+            return wheel.size () != 0;
+          });
+        } else {
+          auto const next_tick = epoch + options.tick * static_cast<std::int64_t> (wheel.tick () + 1);
+          wake.wait_until (lock, stop, next_tick, [] {
+            return false;
+          });
+        }
+
+        auto const now = static_cast<std::uint64_t> ((clock::now () - epoch) / options.tick);
+        wheel.advance (now, [&] (pending_timer&& timer) {
+          handles.erase (timer.timer.id);
+          fired.push_back (std::move (timer.timer));
+        });
+        if (fired.empty ())
+          continue;
+
+        lock.unlock ();
+        for (auto& timer : fired) {
+          auto const id = timer.id;
+          try {
+            deliver (std::move (timer));
+          } catch (std::exception& e) {
+            log<log_level::error> ("Failed to deliver timer ", id, ": ", e.what ());
+          }
+          storage.delete_value (detail::timer_chat, key (id));
+        }
+        fired.clear ();
+        lock.lock ();
+      }
+    }
+
+  public:
+    explicit scheduler (persistence& storage)
+      : storage (storage)
+    {}
+
+    scheduler (scheduler const&) = delete;
+    scheduler& operator= (scheduler const&) = delete;
+
+    ~scheduler ()
+    {
+      stop ();
+    }
+
+    /**
+     * Restores the persisted timers and starts passing the expired ones to deliver, on a background thread.
+     * Timers scheduled before start are kept and delivered once it is called.
+     */
+    auto start (deliver_type function, scheduler_options new_options = {}) -> void
+    {
+      stop ();
+      auto guard = std::scoped_lock (mutex);
+      deliver = std::move (function);
+      if (new_options.tick != options.tick) {
+        // the timers scheduled so far are placed again with the new resolution
+        auto timers = std::vector<pending_timer> ();
+        for (auto const& [id, handle] : handles)
+          timers.push_back (std::move (*wheel.cancel (handle.second)));
+        options = new_options;
+        epoch = clock::now ();
+        wheel = {};
+        for (auto& timer : timers)
+          add (std::move (timer));
+      }
+      restore ();
+      thread = std::jthread ([this] (std::stop_token stop) {
+        run (stop);
+      });
+    }
+
+    /**
+     * Stops delivering timers, pending timers stay in persistence.
+     */
+    auto stop () -> void
+    {
+      if (thread.joinable ()) {
+        thread.request_stop ();
+        thread.join ();
+      }
+    }
+
+    /**
+     * Delivers {chat_id, id, payload} after delay, returns the id of the timer.
+     */
+    auto schedule (banana::integer_t chat_id, clock::duration delay, std::string payload) -> timer_id
+    {
+      auto const due = clock::now () + delay;
+      auto const wall_due = std::chrono::duration_cast<std::chrono::milliseconds> (
+        std::chrono::system_clock::now ().time_since_epoch () + delay);
+
+      auto lock = std::unique_lock (mutex);
+      // only the first ids wait for the storage, the next block is reserved when half of the current one is used
+      while (next_id >= reserved_ids) {
+        if (reserving)
+          ids_reserved.wait (lock);
+        else
+          reserve_ids (lock);
+      }
+      auto const id = next_id++;
+      if (!reserving && next_id + id_block / 2 >= reserved_ids)
+        reserve_ids (lock);
+      lock.unlock ();
+
+      storage.set_value_json (detail::timer_chat, key (id),
+        {
+          {"chat", chat_id},
+          {"due", wall_due.count ()},
+          {"payload", payload},
+        });
+
+      lock.lock ();
+      add ({{chat_id, id, std::move (payload)}, due});
+      lock.unlock ();
+      wake.notify_one ();
+      return id;
+    }
+
+    /**
+     * Cancels a timer of the chat that has not been delivered yet, returns whether it was pending.
+     */
+    auto cancel (banana::integer_t chat_id, timer_id id) -> bool
+    {
+      {
+        auto guard = std::scoped_lock (mutex);
+        auto const it = handles.find (id);
+        // the timers of other chats are left alone, as if they did not exist
+        if (it == handles.end () || it->second.first != chat_id)
+          return false;
+        wheel.cancel (it->second.second);
+        handles.erase (it);
+      }
+      storage.delete_value (detail::timer_chat, key (id));
+      return true;
+    }
+
+    /**
+     * Number of timers waiting to expire.
+     */
+    auto pending () -> std::size_t
+    {
+      auto guard = std::scoped_lock (mutex);
+      return wheel.size ();
+    }
+  };
+} // namespace forest
@@ -0,0 +1,403 @@
+#pragma once
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+#include <banana/api.hpp>
+
+#include <forest/log.hpp>
+
+namespace forest
+{
+  struct send_queue_options
+  {
+    // messages per second accepted by telegram across all chats, must be positive
+    double global_rate = 30.0;
+    // messages per second accepted by telegram for a single chat, must be positive
+    double chat_rate = 1.0;
+    // requests awaiting a response at the same time, at least one
+    std::size_t max_in_flight = 32;
+    // times a message rejected with 429 Too Many Requests is sent again, after the delay asked by telegram
+    std::size_t max_retries = 3;
+  };
+
+  namespace detail
+  {
+    // delay asked by a 429 Too Many Requests error, whose description ends with "retry after <seconds>"
+    inline auto retry_after (std::string_view error) -> std::optional<std::chrono::seconds>
+    {
+      constexpr auto marker = std::string_view ("retry after ");
+      auto const at = error.find (marker);
+      if (at == std::string_view::npos)
+        return std::nullopt;
+      auto seconds = std::int64_t {0};
+      auto const begin = error.data () + at + marker.size ();
+      if (std::from_chars (begin, error.data () + error.size (), seconds).ec != std::errc ())
+        return std::nullopt;
+      return std::chrono::seconds (seconds);
+    }
+  } // namespace detail
+
+  /**
+   * Outbound message queue with a dedicated sender thread, and a collector thread completing the requests
+   * as their responses arrive, in any order.
+   * Messages of the same chat are delivered in order, one request at a time, spaced according to the per-chat
+   * rate limit, while messages of different chats are interleaved and pipelined up to max_in_flight requests.
+   * A message rejected with 429 Too Many Requests goes back to the front of its chat,
+   * which is paused for the delay asked by telegram.
+   */
+  class send_queue
+  {
+  public:
+    using clock = std::chrono::steady_clock;
+    using args_type = banana::api::send_message_args_t;
+    using result_type = banana::api::message_t;
+    using transport_type = std::function<std::future<result_type> (args_type)>;
+    using markup_type = banana::api::inline_keyboard_markup_t;
+
+  private:
+    struct pending
+    {
+      args_type args;
+      // shared keyboard, copied into args when the request is issued
+      std::shared_ptr<markup_type const> markup;
+      std::promise<result_type> promise;
+      std::size_t retries = 0;
+    };
+
+    struct in_flight
+    {
+      // kept to be sent again if it is rate limited
+      pending message;
+      std::future<result_type> response;
+    };
+
+    struct chat_queue
+    {
+      std::deque<pending> messages;
+      clock::time_point next_send;
+      // in the schedule, or with a request in flight
+      bool scheduled = false;
+    };
+
+    struct schedule_entry
+    {
+      clock::time_point when;
+      banana::integer_t chat_id;
+
+      bool operator> (schedule_entry const& other) const
+      {
+        return when > other.when;
+      }
+    };
+
+    transport_type transport;
+    send_queue_options options;
+
+    std::mutex mutex;
+    std::condition_variable cv_work;
+    std::condition_variable cv_idle;
+    std::condition_variable cv_response;
+    std::unordered_map<banana::integer_t, chat_queue> chats;
+    std::priority_queue<schedule_entry, std::vector<schedule_entry>, std::greater<>> schedule;
+    // issued requests awaiting their response
+    std::deque<in_flight> requests;
+    std::size_t queued = 0;
+    // taken by the sender and not completed yet, including those being issued
+    std::size_t in_flight_count = 0;
+    std::size_t outstanding = 0;
+    clock::time_point next_global_send;
+    bool stopping = false;
+    bool collector_stopping = false;
+    std::thread sender;
+    std::thread collector;
+
+    // how often the collector checks the responses while requests are in flight
+    static constexpr auto collect_interval = std::chrono::milliseconds (1);
+
+    static auto chat_id_of (args_type const& args) -> banana::integer_t
+    {
+      if (auto const* id = std::get_if<banana::integer_t> (&args.chat_id))
+        return *id;
+      return static_cast<banana::integer_t> (std::hash<std::string> {}(std::get<std::string> (args.chat_id)));
+    }
+
+    static auto interval (double rate) -> clock::duration
+    {
+      return std::chrono::duration_cast<clock::duration> (std::chrono::duration<double> (1.0 / rate));
+    }
+
+    // called with the lock held when the request of a chat has completed, the next message of the chat can be sent
+    auto release (banana::integer_t chat_id) -> void
+    {
+      chat_queue& chat = chats.at (chat_id);
+      if (chat.messages.empty ())
+        chat.scheduled = false;
+      else
+        schedule.push ({chat.next_send, chat_id});
+    }
+
+    // called with the lock held once a message has been delivered or has failed for good
+    auto complete (banana::integer_t chat_id) -> void
+    {
+      release (chat_id);
+      --in_flight_count;
+      if (--outstanding == 0)
+        cv_idle.notify_all ();
+      cv_work.notify_one ();
+    }
+
+    // called with the lock held: the message goes back to the front of its chat, paused for delay
+    auto retry (pending message, clock::duration delay) -> void
+    {
+      auto const chat_id = chat_id_of (message.args);
+      chat_queue& chat = chats.at (chat_id);
+      chat.messages.push_front (std::move (message));
+      chat.next_send = std::max (chat.next_send, clock::now () + delay);
+      ++queued;
+      release (chat_id);
+      --in_flight_count;
+      cv_work.notify_one ();
+    }
+
+    // sends a message taken from its queue, the response is awaited by the collector
+    auto issue (pending message) -> void
+    {
+      try {
+        auto args = message.args;
+        if (message.markup)
+          args.reply_markup = *message.markup;
+        auto response = transport (std::move (args));
+        auto guard = std::scoped_lock (mutex);
+        requests.push_back ({std::move (message), std::move (response)});
+        cv_response.notify_one ();
+      } catch (...) {
+        message.promise.set_exception (std::current_exception ());
+        auto guard = std::scoped_lock (mutex);
+        complete (chat_id_of (message.args));
+      }
+    }
+
+    // satisfies the promise of a request whose response has arrived, returns the delay after which
+    // it is to be sent again when it was rate limited
+    auto settle (in_flight& request) -> std::optional<std::chrono::seconds>
+    {
+      try {
+        request.message.promise.set_value (request.response.get ());
+      } catch (std::exception& e) {
+        auto const delay = detail::retry_after (e.what ());
+        if (delay.has_value () && request.message.retries < options.max_retries) {
+          log<log_level::warning> ("send_queue: rate limited, retrying in ", delay->count (), "s");
+          ++request.message.retries;
+          return delay;
+        }
+        request.message.promise.set_exception (std::current_exception ());
+      } catch (...) {
+        request.message.promise.set_exception (std::current_exception ());
+      }
+      return std::nullopt;
+    }
+
+    // completes the requests whose response has arrived, whatever the order they were sent in:
+    // a slow request delays neither the others nor the retries of the rate limited ones
+    auto collect () -> void
+    {
+      auto lock = std::unique_lock (mutex);
+      while (true) {
+        cv_response.wait (lock, [this] {
+          return collector_stopping || !requests.empty ();
+        });
+        if (requests.empty ())
+          return;
+
+        auto ready = std::vector<in_flight> ();
+        for (auto it = requests.begin (); it != requests.end ();) {
+          if (it->response.wait_for (std::chrono::seconds (0)) != std::future_status::timeout) {
+            ready.push_back (std::move (*it));
+            it = requests.erase (it);
+          } else {
+            ++it;
+          }
+        }
+        if (ready.empty ()) {
+          // futures cannot be waited on together, woken up earlier by a new request
+          cv_response.wait_for (lock, collect_interval);
+          continue;
+        }
+        lock.unlock ();
+
+        auto delays = std::vector<std::optional<std::chrono::seconds>> ();
+        for (auto& request : ready)
+          delays.push_back (settle (request));
+
+        lock.lock ();
+        for (std::size_t i = 0; i < ready.size (); ++i) {
+          if (delays[i].has_value ())
+            retry (std::move (ready[i].message), *delays[i]);
+          else
+            complete (chat_id_of (ready[i].message.args));
+        }
+      }
+    }
+
+    // pops every message whose chat and global rate limits allow it to be sent now
+    auto take_ready (clock::time_point now) -> std::vector<pending>
+    {
+      auto batch = std::vector<pending> ();
+      while (!schedule.empty () && schedule.top ().when <= now && next_global_send <= now &&
+             in_flight_count < options.max_in_flight) {
+        auto chat_id = schedule.top ().chat_id;
+        schedule.pop ();
+
+        chat_queue& chat = chats.at (chat_id);
+        batch.push_back (std::move (chat.messages.front ()));
+        chat.messages.pop_front ();
+        --queued;
+        ++in_flight_count;
+
+        chat.next_send = now + interval (options.chat_rate);
+        next_global_send = std::max (next_global_send, now - std::chrono::seconds (1)) + interval (options.global_rate);
+        // the chat is scheduled again once the request completes, see release
+      }
+
+      // chats idle for longer than their rate interval no longer constrain anything
+      if (schedule.empty () && chats.size () > 1024)
+        std::erase_if (chats, [now] (auto const& entry) {
+          return !entry.second.scheduled && entry.second.next_send <= now;
+        });
+      return batch;
+    }
+
+    auto run () -> void
+    {
+      while (true) {
+        auto lock = std::unique_lock (mutex);
+        if (outstanding == 0 && stopping)
+          return;
+
+        auto const now = clock::now ();
+        auto batch = take_ready (now);
+        if (batch.empty ()) {
+          // woken up by enqueue, by a completed request freeing a slot, or when the rate limits allow a send
+          auto wake_up = clock::time_point::max ();
+          if (!schedule.empty () && in_flight_count < options.max_in_flight)
+            wake_up = std::max (schedule.top ().when, next_global_send);
+
+          if (wake_up == clock::time_point::max ())
+            cv_work.wait (lock);
+          else
+            cv_work.wait_until (lock, wake_up);
+        }
+        lock.unlock ();
+
+        // requests are issued without holding the lock, producers never wait on the network
+        for (auto& message : batch)
+          issue (std::move (message));
+      }
+    }
+
+  public:
+    /**
+     * Throws std::invalid_argument if a rate is not positive.
+     */
+    explicit send_queue (transport_type transport, send_queue_options options = {})
+      : transport (std::move (transport))
+      , options (options)
+      , next_global_send (clock::now ())
+    {
+      if (!(this->options.global_rate > 0) || !(this->options.chat_rate > 0))
+        throw std::invalid_argument ("forest: send_queue rates must be positive");
+      this->options.max_in_flight = std::max<std::size_t> (this->options.max_in_flight, 1);
+      sender = std::thread ([this] {
+        run ();
+      });
+      collector = std::thread ([this] {
+        collect ();
+      });
+    }
+
+    send_queue (send_queue const&) = delete;
+    send_queue& operator= (send_queue const&) = delete;
+
+    /**
+     * Delivers the messages still queued, then stops the sender thread.
+     */
+    ~send_queue ()
+    {
+      {
+        auto guard = std::scoped_lock (mutex);
+        stopping = true;
+      }
+      cv_work.notify_one ();
+      sender.join ();
+      {
+        auto guard = std::scoped_lock (mutex);
+        collector_stopping = true;
+      }
+      cv_response.notify_one ();
+      collector.join ();
+    }
+
+    /**
+     * Queues a message and returns immediately.
+     * The future is satisfied with telegram's response once the message has been delivered.
+     * A shared markup replaces the reply markup of args, it is copied on the sender thread.
+     */
+    auto enqueue (args_type args, std::shared_ptr<markup_type const> markup = nullptr) -> std::future<result_type>
+    {
+      auto chat_id = chat_id_of (args);
+      auto message = pending {std::move (args), std::move (markup), {}};
+      auto result = message.promise.get_future ();
+      {
+        auto guard = std::scoped_lock (mutex);
+        chat_queue& chat = chats[chat_id];
+        chat.messages.push_back (std::move (message));
+        ++queued;
+        ++outstanding;
+        if (!chat.scheduled) {
+          chat.scheduled = true;
+          schedule.push ({chat.next_send, chat_id});
+        }
+      }
+      cv_work.notify_one ();
+      return result;
+    }
+
+    /**
+     * Number of messages waiting to be sent, excluding requests already in flight.
+     */
+    auto size () -> std::size_t
+    {
+      auto guard = std::scoped_lock (mutex);
+      return queued;
+    }
+
+    /**
+     * Blocks until every queued message has been delivered.
+     */
+    auto flush () -> void
+    {
+      auto lock = std::unique_lock (mutex);
+      cv_idle.wait (lock, [this] {
+        return outstanding == 0;
+      });
+    }
+  };
+} // namespace forest
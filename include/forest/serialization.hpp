@@ -0,0 +1,108 @@
+#pragma once
+#include <array>
+#include <concepts>
+#include <cstddef>
+#include <stdexcept>
+#include <utility>
+#include <variant>
+
+#include <nlohmann/json.hpp>
+
+#include <forest/composite_state.hpp>
+#include <forest/concepts/serializable.hpp>
+
+namespace forest
+{
+  template<class T>
+  struct serializer;
+
+  /**
+   * Types for which a serializer is available, including variants of serializable alternatives
+   * and composite states with a serializable child.
+   */
+  template<class T>
+  concept SerializableSession = requires (T const& value, nlohmann::json const& json)
+  {
+    // clang-format off
+    { serializer<T>::dump (value) } -> std::same_as<nlohmann::json>;
+    { serializer<T>::load (json) } -> std::same_as<T>;
+    // clang-format on
+  };
+
+  template<Serializable T>
+  struct serializer<T>
+  {
+    static auto dump (T const& value) -> nlohmann::json
+    {
+      if constexpr (std::is_empty_v<T>)
+        return nlohmann::json::object ();
+      else
+        return nlohmann::json (value);
+    }
+
+    static auto load (nlohmann::json const& json) -> T
+    {
+      if constexpr (std::is_empty_v<T>)
+        return T {};
+      else
+        return json.get<T> ();
+    }
+  };
+
+  /**
+   * Variants are stored as {"index": alternative index, "value": alternative}.
+   */
+  template<class... Ts>
+    requires (SerializableSession<Ts> && ...)
+  struct serializer<std::variant<Ts...>>
+  {
+    using variant_type = std::variant<Ts...>;
+
+    static auto dump (variant_type const& value) -> nlohmann::json
+    {
+      return std::visit (
+        [&]<class T> (T const& alternative) {
+          return nlohmann::json {{"index", value.index ()}, {"value", serializer<T>::dump (alternative)}};
+        },
+        value);
+    }
+
+    static auto load (nlohmann::json const& json) -> variant_type
+    {
+      return load_alternative (json, std::index_sequence_for<Ts...> {});
+    }
+
+  private:
+    template<std::size_t... Is>
+    static auto load_alternative (nlohmann::json const& json, std::index_sequence<Is...>) -> variant_type
+    {
+      using loader = variant_type (*) (nlohmann::json const&);
+      static constexpr auto loaders = std::array<loader, sizeof...(Ts)> {[] (nlohmann::json const& value) {
+        return variant_type (std::in_place_index<Is>, serializer<Ts>::load (value));
+      }...};
+
+      auto const index = json.at ("index").get<std::size_t> ();
+      if (index >= loaders.size ())
+        throw std::out_of_range ("forest::serializer: variant index out of range");
+      return loaders[index](json.at ("value"));
+    }
+  };
+
+  /**
+   * Composite states are stored as their active child, the per_chat transitions of the nested table are not.
+   */
+  template<CompositeState T>
+    requires SerializableSession<typename T::child_type>
+  struct serializer<T>
+  {
+    static auto dump (T const& value) -> nlohmann::json
+    {
+      return serializer<typename T::child_type>::dump (value.child ());
+    }
+
+    static auto load (nlohmann::json const& json) -> T
+    {
+      return T (serializer<typename T::child_type>::load (json));
+    }
+  };
+} // namespace forest
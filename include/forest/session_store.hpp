@@ -0,0 +1,273 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace forest
+{
+  /**
+   * Interface required by context_handler from the container of its sessions.
+   * References returned by find and find_or_emplace must stay valid until the entry is erased:
+   * a session suspended in a coroutine is used across the insertions of other sessions.
+   */
+  template<class T, class Key, class Value>
+  concept SessionStore = requires (T store, Key key)
+  {
+    // clang-format off
+    { store.find (key) } -> std::same_as<Value*>;
+    { store.find_or_emplace (key, [] () -> Value { throw; }) } -> std::same_as<std::pair<Value&, bool>>;
+    { store.erase (key) } -> std::same_as<bool>;
+    { store.size () } -> std::same_as<std::size_t>;
+    { store.for_each ([] (Key, Value&) {}) };
+    // clang-format on
+  };
+
+  /**
+   * Bounds on the sessions kept in memory by context_handler, zero disables the corresponding limit.
+   * Evicted sessions are spilled to persistence and restored on the next update of their chat.
+   */
+  struct session_limits
+  {
+    // sessions kept in memory, least recently used sessions are evicted first
+    std::size_t max_sessions = 0;
+    // sessions that received no update for this long are evicted
+    std::chrono::steady_clock::duration idle_timeout {};
+  };
+
+  /**
+   * Open addressing hash table with linear probing, specialized for integral keys such as chat ids.
+   * Keys are kept apart from values so that probing only walks a dense array of keys.
+   * Erasure uses backward shifting, so the table never accumulates tombstones.
+   * Values live in a separate slab and never move, so references stay valid until erasure.
+   * Memory follows the size down after a burst of erasures: the table is halved when it is mostly empty,
+   * and freed slots are reused lowest first, so that the end of the slab empties and is released.
+   */
+  template<std::integral Key, std::move_constructible Value>
+  class flat_session_map
+  {
+  private:
+    struct bucket
+    {
+      Key key;
+      // index of the value in slots
+      std::uint32_t slot;
+      bool occupied;
+    };
+
+    std::vector<bucket> buckets;
+    // a deque does not relocate its elements when it grows
+    std::deque<std::optional<Value>> slots;
+    // min-heap of the empty slots, it may still hold slots released from the end of the slab
+    std::vector<std::uint32_t> free_slots;
+    std::size_t count = 0;
+
+    static auto hash (Key key) -> std::uint64_t
+    {
+      auto x = static_cast<std::uint64_t> (key);
+      x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+      x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+      return x ^ (x >> 31);
+    }
+
+    auto mask () const -> std::size_t
+    {
+      return buckets.size () - 1;
+    }
+
+    // index of the bucket holding key, or of the empty bucket where it would be inserted
+    auto probe (Key key) const -> std::size_t
+    {
+      auto i = hash (key) & mask ();
+      while (buckets[i].occupied && buckets[i].key != key)
+        i = (i + 1) & mask ();
+      return i;
+    }
+
+    // only the buckets are moved, values stay in their slots
+    auto rehash (std::size_t capacity) -> void
+    {
+      auto old_buckets = std::exchange (buckets, std::vector<bucket> (capacity, bucket {Key {}, 0, false}));
+      for (auto const& old : old_buckets)
+        if (old.occupied)
+          buckets[probe (old.key)] = old;
+    }
+
+    auto allocate_slot () -> std::uint32_t
+    {
+      while (!free_slots.empty ()) {
+        std::ranges::pop_heap (free_slots, std::greater<> ());
+        auto const slot = free_slots.back ();
+        free_slots.pop_back ();
+        // skip the slots released from the end of the slab
+        if (slot < slots.size () && !slots[slot].has_value ())
+          return slot;
+      }
+      slots.emplace_back ();
+      return static_cast<std::uint32_t> (slots.size () - 1);
+    }
+
+    auto free_slot (std::uint32_t slot) -> void
+    {
+      slots[slot].reset ();
+      free_slots.push_back (slot);
+      std::ranges::push_heap (free_slots, std::greater<> ());
+
+      // the deque releases its blocks as its end empties
+      while (!slots.empty () && !slots.back ().has_value ())
+        slots.pop_back ();
+      // more entries than slots: most of them are released slots, dropped at once
+      if (free_slots.size () > slots.size ()) {
+        std::erase_if (free_slots, [this] (std::uint32_t free) {
+          return free >= slots.size ();
+        });
+        std::ranges::make_heap (free_slots, std::greater<> ());
+      }
+      if (free_slots.capacity () > 64 && free_slots.size () * 4 < free_slots.capacity ())
+        free_slots.shrink_to_fit ();
+    }
+
+    auto erase_at (std::size_t hole) -> void
+    {
+      free_slot (buckets[hole].slot);
+      buckets[hole].occupied = false;
+      --count;
+
+      // shift back the following entries of the cluster that would become unreachable
+      for (auto i = (hole + 1) & mask (); buckets[i].occupied; i = (i + 1) & mask ()) {
+        auto home = hash (buckets[i].key) & mask ();
+        if (((i - home) & mask ()) >= ((i - hole) & mask ())) {
+          buckets[hole] = buckets[i];
+          buckets[i].occupied = false;
+          hole = i;
+        }
+      }
+    }
+
+  public:
+    flat_session_map ()
+      : buckets (16, bucket {Key {}, 0, false})
+    {}
+
+    auto size () const -> std::size_t
+    {
+      return count;
+    }
+
+    auto find (Key key) -> Value*
+    {
+      auto i = probe (key);
+      return buckets[i].occupied ? &*slots[buckets[i].slot] : nullptr;
+    }
+
+    /**
+     * Returns the value mapped to key, constructing it from make() when missing, with a single probe sequence.
+     */
+    template<std::invocable Factory>
+    auto find_or_emplace (Key key, Factory&& make) -> std::pair<Value&, bool>
+    {
+      // grow ahead of time to keep the load factor below 3/4
+      if ((count + 1) * 4 > buckets.size () * 3)
+        rehash (buckets.size () * 2);
+
+      auto i = probe (key);
+      if (buckets[i].occupied)
+        return {*slots[buckets[i].slot], false};
+
+      auto const slot = allocate_slot ();
+      try {
+        slots[slot].emplace (std::forward<Factory> (make) ());
+      } catch (...) {
+        free_slot (slot);
+        throw;
+      }
+      buckets[i] = bucket {key, slot, true};
+      ++count;
+      return {*slots[slot], true};
+    }
+
+    auto erase (Key key) -> bool
+    {
+      auto i = probe (key);
+      if (!buckets[i].occupied)
+        return false;
+      erase_at (i);
+      // halved below a load factor of 3/16, well below the 3/4 that makes it grow again
+      if (buckets.size () > 16 && count * 16 < buckets.size () * 3)
+        rehash (buckets.size () / 2);
+      return true;
+    }
+
+    template<std::invocable<Key, Value&> Function>
+    auto for_each (Function&& function) -> void
+    {
+      for (auto const& b : buckets)
+        if (b.occupied)
+          function (b.key, *slots[b.slot]);
+    }
+
+    /**
+     * Buckets of the table and slots of the slab, occupied or not, to observe the memory held.
+     */
+    auto bucket_count () const -> std::size_t
+    {
+      return buckets.size ();
+    }
+
+    auto slot_count () const -> std::size_t
+    {
+      return slots.size ();
+    }
+  };
+
+  /**
+   * Session store backed by std::map, keeps references stable across insertions.
+   */
+  template<class Key, std::move_constructible Value>
+  class ordered_session_map
+  {
+  private:
+    std::map<Key, Value> map;
+
+  public:
+    auto size () const -> std::size_t
+    {
+      return map.size ();
+    }
+
+    auto find (Key key) -> Value*
+    {
+      auto it = map.find (key);
+      return it != map.end () ? &it->second : nullptr;
+    }
+
+    template<std::invocable Factory>
+    auto find_or_emplace (Key key, Factory&& make) -> std::pair<Value&, bool>
+    {
+      auto it = map.lower_bound (key);
+      if (it != map.end () && it->first == key)
+        return {it->second, false};
+      it = map.emplace_hint (it, key, std::forward<Factory> (make) ());
+      return {it->second, true};
+    }
+
+    auto erase (Key key) -> bool
+    {
+      return map.erase (key) > 0;
+    }
+
+    template<std::invocable<Key, Value&> Function>
+    auto for_each (Function&& function) -> void
+    {
+      for (auto& [key, value] : map)
+        function (key, value);
+    }
+  };
+} // namespace forest
@@ -0,0 +1,331 @@
+#pragma once
+#include <atomic>
+#include <concepts>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+namespace forest
+{
+  template<class T = void>
+  class task;
+
+  namespace detail
+  {
+    struct task_promise_base
+    {
+      // resumed when the task completes, set by the coroutine awaiting it
+      std::coroutine_handle<> continuation = std::noop_coroutine ();
+      std::exception_ptr error;
+
+      struct final_awaiter
+      {
+        auto await_ready () const noexcept -> bool
+        {
+          return false;
+        }
+
+        template<class Promise>
+        auto await_suspend (std::coroutine_handle<Promise> done) const noexcept -> std::coroutine_handle<>
+        {
+          return done.promise ().continuation;
+        }
+
+        void await_resume () const noexcept
+        {}
+      };
+
+      // tasks are lazy: the body starts when the task is awaited
+      auto initial_suspend () const noexcept -> std::suspend_always
+      {
+        return {};
+      }
+
+      auto final_suspend () const noexcept -> final_awaiter
+      {
+        return {};
+      }
+
+      void unhandled_exception () noexcept
+      {
+        error = std::current_exception ();
+      }
+    };
+
+    template<class T>
+    struct task_promise : task_promise_base
+    {
+      std::optional<T> value;
+
+      auto get_return_object () -> task<T>;
+
+      template<std::convertible_to<T> U>
+      void return_value (U&& result)
+      {
+        value.emplace (std::forward<U> (result));
+      }
+
+      auto take () -> T
+      {
+        if (error)
+          std::rethrow_exception (error);
+        return std::move (*value);
+      }
+    };
+
+    template<>
+    struct task_promise<void> : task_promise_base
+    {
+      auto get_return_object () -> task<void>;
+
+      void return_void () noexcept
+      {}
+
+      void take ()
+      {
+        if (error)
+          std::rethrow_exception (error);
+      }
+    };
+
+    // eagerly started coroutine that destroys itself when it completes, see spawn
+    struct detached_task
+    {
+      struct promise_type
+      {
+        auto get_return_object () noexcept -> detached_task
+        {
+          return {};
+        }
+
+        auto initial_suspend () const noexcept -> std::suspend_never
+        {
+          return {};
+        }
+
+        auto final_suspend () const noexcept -> std::suspend_never
+        {
+          return {};
+        }
+
+        void return_void () noexcept
+        {}
+
+        void unhandled_exception () noexcept
+        {
+          std::terminate ();
+        }
+      };
+    };
+  } // namespace detail
+
+  /**
+   * Lazily started coroutine producing a T: the return type of asynchronous transitions (task<NextState>)
+   * and of asynchronous on_entry and on_exit (task<void>).
+   * Awaiting a task starts it and resumes the awaiting coroutine when it completes,
+   * exceptions escaping the body are rethrown to the awaiting coroutine.
+   */
+  template<class T>
+  class [[nodiscard]] task
+  {
+  public:
+    using promise_type = detail::task_promise<T>;
+    using value_type = T;
+
+  private:
+    std::coroutine_handle<promise_type> handle;
+
+  public:
+    explicit task (std::coroutine_handle<promise_type> handle)
+      : handle (handle)
+    {}
+
+    task (task&& other) noexcept
+      : handle (std::exchange (other.handle, {}))
+    {}
+
+    task& operator= (task&& other) noexcept
+    {
+      if (this != &other) {
+        if (handle)
+          handle.destroy ();
+        handle = std::exchange (other.handle, {});
+      }
+      return *this;
+    }
+
+    ~task ()
+    {
+      if (handle)
+        handle.destroy ();
+    }
+
+    auto await_ready () const noexcept -> bool
+    {
+      return false;
+    }
+
+    // symmetric transfer: chains of tasks completing synchronously do not grow the stack
+    auto await_suspend (std::coroutine_handle<> awaiting) noexcept -> std::coroutine_handle<>
+    {
+      handle.promise ().continuation = awaiting;
+      return handle;
+    }
+
+    auto await_resume () -> T
+    {
+      return handle.promise ().take ();
+    }
+  };
+
+  namespace detail
+  {
+    template<class T>
+    auto task_promise<T>::get_return_object () -> task<T>
+    {
+      return task<T> (std::coroutine_handle<task_promise<T>>::from_promise (*this));
+    }
+
+    inline auto task_promise<void>::get_return_object () -> task<void>
+    {
+      return task<void> (std::coroutine_handle<task_promise<void>>::from_promise (*this));
+    }
+  } // namespace detail
+
+  template<class T>
+  struct is_task : std::false_type
+  {};
+
+  template<class T>
+  struct is_task<task<T>> : std::true_type
+  {};
+
+  template<class T>
+  concept Task = is_task<std::remove_cvref_t<T>>::value;
+
+  /**
+   * Runs work without waiting for it: the body executes on the calling thread up to its first suspension,
+   * then on the threads that resume it. on_done (error) is called when it completes,
+   * with a null error on success, and must not throw.
+   */
+  template<std::invocable<std::exception_ptr> OnDone>
+  auto spawn (task<void> work, OnDone on_done) -> detail::detached_task
+  {
+    auto error = std::exception_ptr ();
+    try {
+      co_await std::move (work);
+    } catch (...) {
+      error = std::current_exception ();
+    }
+    on_done (error);
+  }
+
+  /**
+   * Awaitable adapting an asynchronous operation that reports its result to a callback.
+   * start (resume) begins the operation, which must call resume (value) exactly once, from any thread.
+   * The awaiting coroutine continues on that thread, or on the current one if the operation completed
+   * before start returned.
+   */
+  template<class T, std::invocable<std::function<void (T)>> Start>
+  auto on_callback (Start start)
+  {
+    class awaiter
+    {
+    private:
+      Start start;
+      std::optional<T> result;
+      std::coroutine_handle<> awaiting;
+      std::atomic<bool> arrived = false;
+
+    public:
+      explicit awaiter (Start start)
+        : start (std::move (start))
+      {}
+
+      auto await_ready () const noexcept -> bool
+      {
+        return false;
+      }
+
+      auto await_suspend (std::coroutine_handle<> handle) -> bool
+      {
+        awaiting = handle;
+        start (std::function<void (T)> ([this] (T value) {
+          result.emplace (std::move (value));
+          // the second to arrive, between the callback and await_suspend, resumes the coroutine
+          if (arrived.exchange (true, std::memory_order_acq_rel))
+            awaiting.resume ();
+        }));
+        return !arrived.exchange (true, std::memory_order_acq_rel);
+      }
+
+      auto await_resume () -> T
+      {
+        return std::move (*result);
+      }
+    };
+    return awaiter (std::move (start));
+  }
+
+  /**
+   * Runs a blocking function on a new thread and resumes the awaiting coroutine there with its result,
+   * so that a blocking call, such as a synchronous HTTP request, does not hold the thread handling updates.
+   * Each call starts a thread: clients with an asynchronous interface are better adapted with on_callback.
+   * Exceptions thrown by function are rethrown to the awaiting coroutine.
+   */
+  template<std::invocable Function>
+  auto in_background (Function function)
+  {
+    using result_type = std::invoke_result_t<Function&>;
+
+    class awaiter
+    {
+    private:
+      Function function;
+      std::optional<std::conditional_t<std::is_void_v<result_type>, std::monostate, result_type>> result;
+      std::exception_ptr error;
+
+    public:
+      explicit awaiter (Function function)
+        : function (std::move (function))
+      {}
+
+      auto await_ready () const noexcept -> bool
+      {
+        return false;
+      }
+
+      void await_suspend (std::coroutine_handle<> awaiting)
+      {
+        std::thread ([this, awaiting] {
+          try {
+            if constexpr (std::is_void_v<result_type>) {
+              function ();
+              result.emplace ();
+            } else {
+              result.emplace (function ());
+            }
+          } catch (...) {
+            error = std::current_exception ();
+          }
+          // the awaiter may be destroyed by the coroutine, it is not touched past this point
+          awaiting.resume ();
+        }).detach ();
+      }
+
+      auto await_resume () -> result_type
+      {
+        if (error)
+          std::rethrow_exception (error);
+        if constexpr (!std::is_void_v<result_type>)
+          return std::move (*result);
+      }
+    };
+    return awaiter (std::move (function));
+  }
+} // namespace forest
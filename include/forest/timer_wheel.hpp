@@ -0,0 +1,193 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace forest
+{
+  /**
+   * Hierarchical timing wheel holding a T per timer. Time is counted in ticks, starting at zero.
+   * Four levels of 256 slots: level L holds the timers due within 256^(L+1) ticks, and its slots are moved
+   * down a level as the wheel turns. schedule and cancel are O(1), advancing costs O(1) per tick plus the
+   * timers expired or moved down, each timer being moved at most three times. Not thread safe.
+   */
+  template<std::move_constructible T>
+  class timer_wheel
+  {
+  public:
+    /**
+     * Identifies a scheduled timer, stale once it has expired or has been cancelled.
+     */
+    struct handle
+    {
+      std::uint32_t index = ~std::uint32_t {0};
+      std::uint32_t generation = 0;
+    };
+
+  private:
+    static constexpr std::size_t levels = 4;
+    static constexpr std::size_t slot_bits = 8;
+    static constexpr std::size_t slots = std::size_t {1} << slot_bits;
+    static constexpr std::uint32_t none = ~std::uint32_t {0};
+
+    // timers are nodes of intrusive lists, one per slot, so that cancelling one only relinks its neighbours
+    struct node
+    {
+      std::optional<T> value;
+      std::uint64_t expiry = 0;
+      std::uint32_t prev = none;
+      std::uint32_t next = none;
+      std::uint32_t generation = 0;
+      std::uint32_t slot = 0;
+    };
+
+    std::vector<node> nodes;
+    std::vector<std::uint32_t> free_nodes;
+    std::array<std::uint32_t, levels * slots> heads;
+    std::uint64_t current = 0;
+    std::size_t count = 0;
+
+    // due at earliest: timers moved down are due in the current tick at the earliest, new ones in the next
+    auto link (std::uint32_t index, std::uint64_t earliest) -> void
+    {
+      auto& n = nodes[index];
+      auto const due = std::max (n.expiry, earliest);
+      auto const delta = due - current;
+
+      auto level = std::size_t {0};
+      while (level + 1 < levels && delta >= std::uint64_t {1} << (slot_bits * (level + 1)))
+        ++level;
+      // beyond the range of the wheel: parked in the farthest slot, then moved down and placed again
+      auto const placed = level + 1 == levels && delta >> (slot_bits * levels) != 0
+        ? current + (std::uint64_t {1} << (slot_bits * levels)) - 1
+        : due;
+      n.slot = static_cast<std::uint32_t> (level * slots + ((placed >> (slot_bits * level)) & (slots - 1)));
+
+      n.prev = none;
+      n.next = heads[n.slot];
+      if (n.next != none)
+        nodes[n.next].prev = index;
+      heads[n.slot] = index;
+    }
+
+    auto unlink (std::uint32_t index) -> void
+    {
+      auto& n = nodes[index];
+      if (n.prev != none)
+        nodes[n.prev].next = n.next;
+      else
+        heads[n.slot] = n.next;
+      if (n.next != none)
+        nodes[n.next].prev = n.prev;
+    }
+
+    auto release (std::uint32_t index) -> T
+    {
+      auto& n = nodes[index];
+      auto value = std::move (*n.value);
+      n.value.reset ();
+      ++n.generation;
+      free_nodes.push_back (index);
+      --count;
+      return value;
+    }
+
+    // moves the timers of a slot of an upper level to the levels below
+    auto cascade (std::size_t level) -> void
+    {
+      auto const slot = level * slots + ((current >> (slot_bits * level)) & (slots - 1));
+      auto index = std::exchange (heads[slot], none);
+      while (index != none) {
+        auto const next = nodes[index].next;
+        link (index, current);
+        index = next;
+      }
+    }
+
+  public:
+    timer_wheel ()
+    {
+      heads.fill (none);
+    }
+
+    /**
+     * Current tick: timers due at or before it have expired.
+     */
+    auto tick () const -> std::uint64_t
+    {
+      return current;
+    }
+
+    auto size () const -> std::size_t
+    {
+      return count;
+    }
+
+    /**
+     * Schedules value to expire at the given tick, or at the next one if it is not in the future.
+     */
+    auto schedule (std::uint64_t expiry, T value) -> handle
+    {
+      auto index = std::uint32_t {0};
+      if (free_nodes.empty ()) {
+        index = static_cast<std::uint32_t> (nodes.size ());
+        nodes.emplace_back ();
+      } else {
+        index = free_nodes.back ();
+        free_nodes.pop_back ();
+      }
+
+      auto& n = nodes[index];
+      n.value.emplace (std::move (value));
+      n.expiry = expiry;
+      link (index, current + 1);
+      ++count;
+      return {index, n.generation};
+    }
+
+    /**
+     * Removes a timer before it expires, returns its value, or nullopt if the handle is stale.
+     */
+    auto cancel (handle h) -> std::optional<T>
+    {
+      if (h.index >= nodes.size () || nodes[h.index].generation != h.generation || !nodes[h.index].value)
+        return std::nullopt;
+      unlink (h.index);
+      return release (h.index);
+    }
+
+    /**
+     * Turns the wheel up to tick, calling on_expired (value) for every timer due, tick by tick.
+     * on_expired must not schedule or cancel timers of this wheel.
+     */
+    template<std::invocable<T&&> OnExpired>
+    auto advance (std::uint64_t tick, OnExpired&& on_expired) -> void
+    {
+      while (current < tick) {
+        if (count == 0) {
+          current = tick;
+          return;
+        }
+
+        ++current;
+        for (std::size_t level = 1; level < levels; ++level) {
+          if ((current & ((std::uint64_t {1} << (slot_bits * level)) - 1)) != 0)
+            break;
+          cascade (level);
+        }
+
+        auto index = std::exchange (heads[current & (slots - 1)], none);
+        while (index != none) {
+          auto const next = nodes[index].next;
+          on_expired (release (index));
+          index = next;
+        }
+      }
+    }
+  };
+} // namespace forest
@@ -1,50 +1,449 @@
 #pragma once
+#include <forest/command_router.hpp>
+#include <forest/composite_state.hpp>
 #include <forest/concepts/context.hpp>
 #include <forest/concepts/event.hpp>
 #include <forest/concepts/state.hpp>
 #include <forest/concepts/transition.hpp>
+#include <forest/events/message.hpp>
+#include <forest/per_chat.hpp>
+#include <forest/task.hpp>
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <memory>
 #include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <variant>
 
 namespace forest
 {
-  template<std::copy_constructible GlobalState, std::copy_constructible... Ts>
+  /**
+   * Transitions exposing a command name, such as command_transition, are matched against messages
+   * through the command_router of their table instead of by calling accepts ().
+   */
+  template<class T>
+  concept RoutedTransition = requires (T const& transition)
+  {
+    // clang-format off
+    { transition.command_name () } -> std::convertible_to<std::string_view>;
+    // clang-format on
+  };
+
+  /**
+   * Transitions are shared by all the chats of a context_handler and called through const references,
+   * mutable transitions must be wrapped in per_chat.
+   */
+  template<std::move_constructible GlobalState, std::move_constructible... Ts>
   class transition_table
   {
+  public:
+    using state_type = GlobalState;
+    // per-session copies of the per_chat transitions, takes no space when there are none
+    using chat_state_type = std::tuple<typename transition_access<Ts>::slot_type...>;
+
   private:
+    struct command_index
+    {
+      command_router router;
+      // command id of every transition, npos for the transitions that are not routed
+      std::array<std::size_t, sizeof...(Ts)> ids;
+    };
+
+    // per_chat transitions are routed like the transition they wrap
+    template<class T>
+    static constexpr bool is_routed = RoutedTransition<std::remove_const_t<typename transition_access<T>::type>>;
+
+    static constexpr bool has_commands = (is_routed<Ts> || ...);
+
+    // index into Ts of the sub_table of the composite state StateType, sizeof...(Ts) if there is none
+    template<class StateType>
+    static constexpr auto sub_table_index = []
+    {
+      constexpr auto matches = std::array<bool, sizeof...(Ts)> {is_sub_table_of<Ts, StateType>...};
+      return static_cast<std::size_t> (std::ranges::find (matches, true) - matches.begin ());
+    }();
+
     std::tuple<Ts...> transitions;
+    // built once and shared by the copies of the table
+    std::shared_ptr<command_index const> commands;
+    // per_chat transitions used by the overloads of trigger that are not given a chat state
+    chat_state_type own_chat_state;
+
+    // the transition I as declared, the prototype of per_chat transitions
+    template<std::size_t I>
+    auto declared () const -> auto const&
+    {
+      if constexpr (PerChatTransition<std::tuple_element_t<I, std::tuple<Ts...>>>)
+        return std::get<I> (transitions).prototype;
+      else
+        return std::get<I> (transitions);
+    }
+
+    auto build_commands () const -> std::shared_ptr<command_index const>
+    {
+      auto index = std::make_shared<command_index> ();
+      index->ids.fill (command_router::npos);
+      [&, this]<std::size_t... Is> (std::index_sequence<Is...>) {
+        auto const add = [&, this]<std::size_t I> () {
+          if constexpr (is_routed<std::tuple_element_t<I, std::tuple<Ts...>>>)
+            index->ids[I] = index->router.add (declared<I> ().command_name ());
+        };
+        (add.template operator()<Is> (), ...);
+      }(std::index_sequence_for<Ts...> ());
+      return index;
+    }
+
+    // indices into Ts of the transitions that can fire from StateType on EventType, in declaration order
+    template<class ContextType, class StateType, class EventType>
+    static constexpr auto candidates = []
+    {
+      constexpr auto applicable = std::array<bool, sizeof...(Ts)> {
+        Transition<typename transition_access<Ts>::type, ContextType, StateType, EventType>...};
+      // a transition applicable only when non-const would otherwise be silently left out
+      constexpr auto mutable_only = std::array<bool, sizeof...(Ts)> {
+        (!Transition<typename transition_access<Ts>::type, ContextType, StateType, EventType> &&
+          Transition<std::remove_const_t<typename transition_access<Ts>::type>, ContextType, StateType, EventType>)...};
+      static_assert (std::ranges::find (mutable_only, true) == mutable_only.end (),
+        "forest: a transition is callable only when non-const, but the table is shared by every chat and calls "
+        "its transitions through const references. Make accepts and operator() const, or wrap the transition "
+        "in per_chat<T> to give each chat its own mutable copy");
+      auto result = std::array<std::size_t, std::ranges::count (applicable, true)> {};
+      for (std::size_t i = 0, n = 0; i < applicable.size (); ++i)
+        if (applicable[i])
+          result[n++] = i;
+      return result;
+    }();
+
+    template<class T, class ContextType, class EventType>
+    static constexpr auto nested_handles () -> bool
+    {
+      if constexpr (requires { typename T::composite_type; })
+        return decltype (T::table)::template handles<ContextType, EventType>;
+      else
+        return false;
+    }
+
+    // constructs the next state into target, a GlobalState or an optional<GlobalState>, with a single move
+    template<class Target, class Result>
+    static auto emplace_result (Target& target, Result&& result) -> void
+    {
+      using R = std::remove_cvref_t<Result>;
+      static_assert (!Task<R>, "transitions returning a task can only be triggered through context_handler");
+      if constexpr (InPlaceState<R>) {
+        std::apply (
+          [&] (auto&... args) {
+            if constexpr (std::same_as<Target, GlobalState>)
+              target.template emplace<typename R::state_type> (std::move (args)...);
+            else
+              target.emplace (std::in_place_type<typename R::state_type>, std::move (args)...);
+          },
+          result.args);
+      } else if constexpr (is_nested_state<R>::value) {
+        static_assert (std::same_as<Target, GlobalState>,
+          "transitions of nested tables can only be triggered in place, see trigger_in_place");
+        using composite = typename R::composite_type;
+        auto& child = std::get_if<composite> (&target)->child ();
+        composite::table_type::replace_state (child, std::move (result.next));
+      } else if constexpr (std::same_as<Target, GlobalState> && requires { target.template emplace<R> (std::move (result)); }) {
+        target.template emplace<R> (std::move (result));
+      } else {
+        target = std::move (result);
+      }
+    }
+
+    // result of a transition of the nested table of Composite, in terms of the states of this table
+    template<class Composite, class Result>
+    static auto lift (Result&& result)
+    {
+      using R = std::remove_cvref_t<Result>;
+      if constexpr (Task<R>)
+        return lift_task<Composite> (std::move (result));
+      else if constexpr (detail::is_alternative<typename detail::result_state<R>::type,
+                           typename Composite::child_type>)
+        return nested_state<Composite, R> {std::forward<Result> (result)};
+      else
+        return R (std::forward<Result> (result));
+    }
+
+    template<class Composite, class T>
+    static auto lift_task (task<T> transition) -> task<decltype (lift<Composite> (std::declval<T> ()))>
+    {
+      co_return lift<Composite> (co_await std::move (transition));
+    }
+
+    // offers the event to the nested table I from the active child of the composite state
+    template<std::size_t I, class ContextType, class Composite, class EventType, class Apply>
+    auto trigger_nested (
+      ContextType const& context, Composite& state, EventType const& event, Apply& apply) const -> bool
+    {
+      auto lifted = [&] (std::size_t, auto&& fire) {
+        apply (I, [&] () -> decltype (auto) {
+          return lift<Composite> (fire ());
+        });
+      };
+      auto const& nested = std::get<I> (transitions).table;
+      return nested.trigger_with (context, state.child (), event, state.child_transitions (), lifted);
+    }
+
+    // the shared transition I, or the chat's copy of it if it is per_chat
+    template<std::size_t I, class T = std::tuple_element_t<I, std::tuple<Ts...>>>
+    auto access (chat_state_type& chat_state) const -> typename transition_access<T>::type&
+    {
+      if constexpr (PerChatTransition<T>) {
+        auto& slot = std::get<I> (chat_state);
+        if (!slot.has_value ())
+          slot.emplace (std::get<I> (transitions).prototype);
+        return slot.value ();
+      } else {
+        return std::get<I> (transitions);
+      }
+    }
+
+    template<std::size_t I, class ContextType, class StateType, class EventType, class Apply>
+    auto try_transition (ContextType const& context,
+      StateType& state,
+      EventType const& event,
+      std::size_t route,
+      chat_state_type& chat_state,
+      Apply& apply) const -> bool
+    {
+      constexpr bool by_route =
+        is_routed<std::tuple_element_t<I, std::tuple<Ts...>>> && std::same_as<EventType, events::message>;
+      // commands are matched before a per_chat copy is made for the chat
+      if constexpr (by_route) {
+        if (route != commands->ids[I])
+          return false;
+      }
+      auto& transition = access<I> (chat_state);
+      if constexpr (!by_route) {
+        if (!transition.accepts (context, state, event))
+          return false;
+      }
+      apply (I, [&] () -> decltype (auto) {
+        return transition (context, state, event);
+      });
+      return true;
+    }
+
+    template<std::size_t StateIndex, class ContextType, class EventType, class Apply>
+    auto trigger_from (ContextType const& context,
+      GlobalState& global_state,
+      EventType const& event,
+      std::size_t route,
+      chat_state_type& chat_state,
+      Apply& apply) const -> bool
+    {
+      using StateType = std::variant_alternative_t<StateIndex, GlobalState>;
+      constexpr auto& indices = candidates<ContextType, StateType, EventType>;
+
+      auto& state = *std::get_if<StateIndex> (&global_state);
+      auto const try_candidates = [&]<bool RoutedOnly, std::size_t... Ks> (std::index_sequence<Ks...>) {
+        return (((!RoutedOnly || is_routed<std::tuple_element_t<indices[Ks], std::tuple<Ts...>>>) &&
+                  try_transition<indices[Ks]> (context, state, event, route, chat_state, apply)) ||
+          ...);
+      };
+      constexpr auto all = std::make_index_sequence<indices.size ()> ();
+
+      if constexpr (constexpr auto nested = sub_table_index<StateType>; nested < sizeof...(Ts)) {
+        // commands of the composite take precedence, so that a child accepting any message does not hide them
+        if (route != command_router::npos && try_candidates.template operator()<true> (all))
+          return true;
+        if (trigger_nested<nested> (context, state, event, apply))
+          return true;
+      }
+      return try_candidates.template operator()<false> (all);
+    }
+
+    template<class ContextType, class EventType, class Apply>
+    auto dispatch (ContextType const& context,
+      GlobalState& state,
+      EventType const& event,
+      chat_state_type& chat_state,
+      Apply& apply) const -> bool
+    {
+      using handler_type = bool (transition_table::*) (
+        ContextType const&, GlobalState&, EventType const&, std::size_t, chat_state_type&, Apply&) const;
+      static constexpr auto handlers = []<std::size_t... Is> (std::index_sequence<Is...>) {
+        return std::array<handler_type, sizeof...(Is)> {
+          &transition_table::trigger_from<Is, ContextType, EventType, Apply>...};
+      }(std::make_index_sequence<std::variant_size_v<GlobalState>> ());
+
+      if (state.valueless_by_exception ())
+        throw std::bad_variant_access ();
+
+      auto route = command_router::npos;
+      if constexpr (has_commands && std::same_as<EventType, events::message>)
+        route = commands->router.route (event.text);
+      return (this->*handlers[state.index ()]) (context, state, event, route, chat_state, apply);
+    }
 
   public:
-    transition_table () = default;
+    transition_table ()
+      requires (std::default_initializable<Ts> && ...)
+      : transition_table (Ts {}...)
+    {}
 
-    constexpr transition_table (Ts... ts)
+    transition_table (Ts... ts)
       : transitions (std::move (ts)...)
+      , commands (build_commands ())
     {}
 
+    /**
+     * Ignores the commands addressed to other bots with "/command@username".
+     */
+    void set_bot_username (std::string username)
+    {
+      auto index = std::make_shared<command_index> (*commands);
+      index->router.set_username (username);
+      commands = std::move (index);
+      [&, this]<std::size_t... Is> (std::index_sequence<Is...>) {
+        auto const propagate = [&, this]<std::size_t I> () {
+          if constexpr (requires { std::get<I> (transitions).table.set_bot_username (username); })
+            std::get<I> (transitions).table.set_bot_username (username);
+        };
+        (propagate.template operator()<Is> (), ...);
+      }(std::index_sequence_for<Ts...> ());
+    }
+
+    /**
+     * Fires the first transition, in declaration order, that applies to the current state and accepts the event.
+     * The candidate transitions of every (state, event) pair are selected at compile time,
+     * dispatch is a jump on the state index followed by the accepts() checks of those candidates only.
+     * Messages are routed to command transitions by a single lookup in the command trie.
+     * per_chat transitions are taken from chat_state.
+     * From a composite state, the transitions of its sub_table are tried first, from the active child.
+     */
+    template<Context ContextType, Event EventType>
+    auto trigger (ContextType const& context, GlobalState& state, EventType const& event, chat_state_type& chat_state)
+      const -> std::optional<GlobalState>
+    {
+      auto result = std::optional<GlobalState> ();
+      auto apply = [&result] (std::size_t, auto&& fire) {
+        emplace_result (result, fire ());
+      };
+      dispatch (context, state, event, chat_state, apply);
+      return result;
+    }
+
+    /**
+     * Same as above, per_chat transitions are taken from the table itself.
+     */
     template<Context ContextType, Event EventType>
-    auto trigger (ContextType context, GlobalState& state, EventType event) //
+    auto trigger (ContextType const& context, GlobalState& state, EventType const& event) //
       -> std::optional<GlobalState>
     {
-      auto const state_iterator = [&, this]<class CurrState> (CurrState& state) -> std::optional<GlobalState> {
-        std::optional<GlobalState> result {};
+      return trigger (context, state, event, own_chat_state);
+    }
 
-        auto const transition_iterator = [&, this]<class CurrTransition> () {
-          if constexpr (Transition<CurrTransition, ContextType, CurrState, EventType>)
-            if (!result.has_value () && std::get<CurrTransition> (transitions).accepts (context, state, event))
-              result = std::get<CurrTransition> (transitions) (context, state, event);
-        };
+    /**
+     * Same as trigger, but the next state replaces the current one in place, without an intermediate variant.
+     * on_exit (state) is called after the transition has returned, right before the current state is destroyed.
+     * on_fired (index, elapsed) receives the declaration index of the transition that fired and how long it ran.
+     * Returns whether a transition fired.
+     */
+    template<Context ContextType,
+      Event EventType,
+      std::invocable<GlobalState&> OnExit,
+      std::invocable<std::size_t, std::chrono::steady_clock::duration> OnFired>
+    auto trigger_in_place (ContextType const& context,
+      GlobalState& state,
+      EventType const& event,
+      chat_state_type& chat_state,
+      OnExit&& on_exit,
+      OnFired&& on_fired) const -> bool
+    {
+      auto apply = [&] (std::size_t index, auto&& fire) {
+        auto const start = std::chrono::steady_clock::now ();
+        decltype (auto) next = fire ();
+        on_fired (index, std::chrono::steady_clock::now () - start);
+        on_exit (state);
+        emplace_result (state, std::forward<decltype (next)> (next));
+      };
+      return dispatch (context, state, event, chat_state, apply);
+    }
 
-        (transition_iterator.template operator()<Ts> (), ...);
-        return result;
+    template<Context ContextType, Event EventType, std::invocable<GlobalState&> OnExit>
+    auto trigger_in_place (ContextType const& context,
+      GlobalState& state,
+      EventType const& event,
+      chat_state_type& chat_state,
+      OnExit&& on_exit) const -> bool
+    {
+      auto apply = [&] (std::size_t, auto&& fire) {
+        decltype (auto) next = fire ();
+        on_exit (state);
+        emplace_result (state, std::forward<decltype (next)> (next));
       };
+      return dispatch (context, state, event, chat_state, apply);
+    }
 
-      return std::visit (state_iterator, state);
+    /**
+     * Most general form of trigger: apply (index, fire) receives the declaration index of the transition
+     * accepting the event and a callable that runs it and returns its result, which apply is responsible for,
+     * for instance with replace_state. Returns whether a transition fired.
+     */
+    template<Context ContextType, Event EventType, class Apply>
+    auto trigger_with (ContextType const& context,
+      GlobalState& state,
+      EventType const& event,
+      chat_state_type& chat_state,
+      Apply&& apply) const -> bool
+    {
+      return dispatch (context, state, event, chat_state, apply);
+    }
+
+    /**
+     * Replaces state with the result of a transition, other than a task.
+     */
+    template<class Result>
+    static auto replace_state (GlobalState& state, Result&& result) -> void
+    {
+      emplace_result (state, std::forward<Result> (result));
+    }
+
+    /**
+     * Whether a transition, of this table or of a nested one, can fire on EventType from some state.
+     * Known at compile time, so that the events nothing handles can be dropped, or never requested.
+     */
+    template<class ContextType, class EventType>
+    static constexpr bool handles =
+      []<std::size_t... Is> (std::index_sequence<Is...>) {
+        auto const any = []<class State> (std::type_identity<State>) {
+          return candidates<ContextType, State, EventType>.size () != 0;
+        };
+        return (any (std::type_identity<std::variant_alternative_t<Is, GlobalState>> {}) || ...);
+      }(std::make_index_sequence<std::variant_size_v<GlobalState>> ()) ||
+      (nested_handles<Ts, ContextType, EventType> () || ...);
+
+    /**
+     * Label of every transition, in declaration order, for metrics and logs:
+     * the command name of routed transitions, the declaration index of the others.
+     */
+    auto transition_names () const -> std::array<std::string, sizeof...(Ts)>
+    {
+      auto result = std::array<std::string, sizeof...(Ts)> ();
+      [&, this]<std::size_t... Is> (std::index_sequence<Is...>) {
+        auto const name = [&, this]<std::size_t I> () {
+          if constexpr (is_routed<std::tuple_element_t<I, std::tuple<Ts...>>>)
+            result[I] = std::string (declared<I> ().command_name ());
+          else
+            result[I] = std::to_string (I);
+        };
+        (name.template operator()<Is> (), ...);
+      }(std::index_sequence_for<Ts...> ());
+      return result;
     }
   };
 
-  template<std::copy_constructible... States>
-  constexpr inline auto make_transition_table = []<std::copy_constructible... Transitions> (Transitions... ts)
+  template<std::move_constructible... States>
+  constexpr inline auto make_transition_table = []<std::move_constructible... Transitions> (Transitions... ts)
   {
     return transition_table<std::variant<States...>, Transitions...> (std::move (ts)...);
   };
@@ -21,14 +21,21 @@ namespace forest
 
     template<Context Ctx, State<Ctx> State>
       requires (std::invocable<Action&, Ctx, State&>)
-    bool accepts (Ctx ctx, State& state, events::button_pressed e)
+    bool accepts (Ctx const& ctx, State& state, events::button_pressed const& e) const
     {
       return e.id == id;
     }
 
+    template<Context Ctx, State<Ctx> State>
+      requires (std::invocable<Action const&, Ctx, State&>)
+    auto operator() (Ctx const& ctx, State& state, events::button_pressed const& e) const
+    {
+      return std::invoke (action, ctx, state);
+    }
+
     template<Context Ctx, State<Ctx> State>
       requires (std::invocable<Action&, Ctx, State&>)
-    auto operator() (Ctx ctx, State& state, events::button_pressed e)
+    auto operator() (Ctx const& ctx, State& state, events::button_pressed const& e)
     {
       return std::invoke (action, ctx, state);
     }
@@ -1,15 +1,29 @@
 #pragma once
 #include <algorithm>
 #include <banana/api.hpp>
+#include <cassert>
+#include <forest/command_router.hpp>
 #include <forest/concepts/context.hpp>
 #include <forest/concepts/transition.hpp>
 #include <forest/events/message.hpp>
+#include <forest/log.hpp>
 #include <functional>
-#include <iostream>
 #include <limits>
+#include <string>
+#include <string_view>
+#include <vector>
 
 namespace forest
 {
+  /**
+   * Actions of a command receive its arguments as a view into the message, as a string,
+   * as a list of tokens (see tokenize_arguments), or not at all.
+   */
+  template<class Action, class Ctx, class StateType>
+  concept CommandAction = std::invocable<Action&, Ctx, StateType&, std::string_view> ||
+    std::invocable<Action&, Ctx, StateType&, std::string> ||
+    std::invocable<Action&, Ctx, StateType&, std::vector<std::string>> || std::invocable<Action&, Ctx, StateType&>;
+
   template<std::copy_constructible Action>
   class command_transition
   {
@@ -18,6 +32,24 @@ namespace forest
     std::string description;
     Action action;
 
+    // A is Action or Action const, depending on whether the transition is shared or per_chat
+    template<class A, class Ctx, class StateType>
+    static auto fire (A& action, Ctx const& ctx, StateType& state, events::message const& e)
+    {
+      auto command = parse_command (e.text);
+      assert (command.has_value ());
+      auto const arguments = command->arguments;
+
+      if constexpr (std::invocable<A&, Ctx, StateType&, std::string_view>)
+        return std::invoke (action, ctx, state, arguments);
+      else if constexpr (std::invocable<A&, Ctx, StateType&, std::string>)
+        return std::invoke (action, ctx, state, std::string (arguments));
+      else if constexpr (std::invocable<A&, Ctx, StateType&, std::vector<std::string>>)
+        return std::invoke (action, ctx, state, tokenize_arguments (arguments));
+      else
+        return std::invoke (action, ctx, state);
+    }
+
   public:
     command_transition (std::string prefix, std::string description, Action action) //
       : prefix (std::move (prefix))
@@ -27,25 +59,38 @@ namespace forest
 
     operator banana::api::bot_command_t () const
     {
-      std::cerr << "Adding command " << prefix.substr (1) << ": " << description << std::endl;
+      log<log_level::debug> ("Adding command ", prefix.substr (1), ": ", description);
       return {prefix.substr (1), description};
     }
 
+    /**
+     * Name under which transition_table routes this command, without the leading slash.
+     */
+    std::string_view command_name () const
+    {
+      return std::string_view (prefix).substr (prefix.starts_with ('/') ? 1 : 0);
+    }
+
+    template<Context Ctx, State<Ctx> StateType>
+      requires (CommandAction<Action, Ctx, StateType>)
+    bool accepts (Ctx const& ctx, StateType&, events::message const& e) const
+    {
+      auto command = parse_command (e.text);
+      return command.has_value () && command->name == command_name ();
+    }
+
     template<Context Ctx, State<Ctx> StateType>
-      requires (std::invocable<Action, Ctx, StateType&, std::string>)
-    bool accepts (Ctx ctx, StateType&, events::message e) const
+      requires (CommandAction<Action const, Ctx, StateType>)
+    auto operator() (Ctx const& ctx, StateType& state, events::message const& e) const
     {
-      return e.text.starts_with (prefix);
+      return fire (action, ctx, state, e);
     }
 
     template<Context Ctx, State<Ctx> StateType>
-      requires (std::invocable<Action, Ctx, StateType&, std::string>)
-    auto operator() (Ctx ctx, StateType& state, events::message e)
+      requires (CommandAction<Action, Ctx, StateType>)
+    auto operator() (Ctx const& ctx, StateType& state, events::message const& e)
     {
-      assert (e.text.starts_with (prefix));
-      // TODO: more robust parsing of parameters
-      std::size_t param_start = std::min (prefix.length () + 1, e.text.length ());
-      return std::invoke (action, ctx, state, e.text.substr (param_start));
+      return fire (action, ctx, state, e);
     }
   };
 
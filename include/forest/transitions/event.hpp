@@ -0,0 +1,51 @@
+#pragma once
+#include <forest/concepts/context.hpp>
+#include <forest/concepts/state.hpp>
+#include <functional>
+#include <utility>
+
+namespace forest
+{
+  /**
+   * Fires on every event of type EventType, such as events::photo or events::inline_query,
+   * from the states the action accepts. The action receives the event: (ctx, state, event).
+   */
+  template<class EventType, std::copy_constructible Action>
+  class event_transition
+  {
+  private:
+    Action action;
+
+  public:
+    event_transition (Action action)
+      : action (std::move (action))
+    {}
+
+    template<Context Ctx, State<Ctx> S>
+      requires (std::invocable<Action&, Ctx, S&, EventType const&>)
+    bool accepts (Ctx const& ctx, S& state, EventType const& e) const
+    {
+      return true;
+    }
+
+    template<Context Ctx, State<Ctx> S>
+      requires (std::invocable<Action const&, Ctx, S&, EventType const&>)
+    auto operator() (Ctx const& ctx, S& state, EventType const& e) const
+    {
+      return std::invoke (action, ctx, state, e);
+    }
+
+    template<Context Ctx, State<Ctx> S>
+      requires (std::invocable<Action&, Ctx, S&, EventType const&>)
+    auto operator() (Ctx const& ctx, S& state, EventType const& e)
+    {
+      return std::invoke (action, ctx, state, e);
+    }
+  };
+
+  template<class EventType, std::copy_constructible Action>
+  auto make_event_transition (Action action) -> event_transition<EventType, Action>
+  {
+    return {std::move (action)};
+  }
+} // namespace forest
@@ -4,32 +4,59 @@
 #include <forest/concepts/transition.hpp>
 #include <forest/events/message.hpp>
 #include <functional>
+#include <string>
+#include <string_view>
 
 namespace forest
 {
+  /**
+   * Actions of a message transition receive the text as a view into the update when they accept one,
+   * otherwise as a std::string.
+   */
+  template<class Action, class Ctx, class S>
+  concept MessageAction =
+    std::invocable<Action&, Ctx, S&, std::string_view> || std::invocable<Action&, Ctx, S&, std::string>;
+
   template<std::copy_constructible Action>
   class message_transition
   {
   private:
     Action action;
 
+    // A is Action or Action const, depending on whether the transition is shared or per_chat
+    template<class A, class Ctx, class S>
+    static auto fire (A& action, Ctx const& ctx, S& state, events::message const& e)
+    {
+      if constexpr (std::invocable<A&, Ctx, S&, std::string_view>)
+        return std::invoke (action, ctx, state, e.text);
+      else
+        return std::invoke (action, ctx, state, std::string (e.text));
+    }
+
   public:
     message_transition (Action action)
       : action (std::move (action))
     {}
 
     template<Context Ctx, State<Ctx> S>
-      requires (std::invocable<Action, Ctx, S&, std::string>)
-    bool accepts (Ctx ctx, S& state, events::message e) const
+      requires (MessageAction<Action, Ctx, S>)
+    bool accepts (Ctx const& ctx, S& state, events::message const& e) const
     {
       return true;
     }
 
     template<Context Ctx, State<Ctx> S>
-      requires (std::invocable<Action, Ctx, S&, std::string>)
-    auto operator() (Ctx ctx, S& state, events::message e)
+      requires (MessageAction<Action const, Ctx, S>)
+    auto operator() (Ctx const& ctx, S& state, events::message const& e) const
+    {
+      return fire (action, ctx, state, e);
+    }
+
+    template<Context Ctx, State<Ctx> S>
+      requires (MessageAction<Action, Ctx, S>)
+    auto operator() (Ctx const& ctx, S& state, events::message const& e)
     {
-      return std::invoke (action, ctx, state, e.text);
+      return fire (action, ctx, state, e);
     }
   };
 
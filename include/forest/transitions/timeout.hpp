@@ -0,0 +1,69 @@
+#pragma once
+#include <forest/concepts/context.hpp>
+#include <forest/concepts/state.hpp>
+#include <forest/events/timeout.hpp>
+#include <functional>
+#include <string>
+
+namespace forest
+{
+  /**
+   * Actions of a timeout transition receive the expired timer when they take a third argument,
+   * for instance to ignore the timers scheduled by an earlier visit of the state.
+   */
+  template<class Action, class Ctx, class S>
+  concept TimeoutAction =
+    std::invocable<Action&, Ctx, S&> || std::invocable<Action&, Ctx, S&, events::timeout const&>;
+
+  /**
+   * Fires when a timer scheduled with the given payload expires while the chat is in a state of the action.
+   * Timers expiring in any other state are ignored.
+   */
+  template<std::copy_constructible Action>
+  class timeout_transition
+  {
+  private:
+    std::string payload;
+    Action action;
+
+    // A is Action or Action const, depending on whether the transition is shared or per_chat
+    template<class A, class Ctx, class S>
+    static auto fire (A& action, Ctx const& ctx, S& state, events::timeout const& e)
+    {
+      if constexpr (std::invocable<A&, Ctx, S&, events::timeout const&>)
+        return std::invoke (action, ctx, state, e);
+      else
+        return std::invoke (action, ctx, state);
+    }
+
+  public:
+    timeout_transition (std::string payload, Action action)
+      : payload (std::move (payload))
+      , action (std::move (action))
+    {}
+
+    template<Context Ctx, State<Ctx> S>
+      requires (TimeoutAction<Action, Ctx, S>)
+    bool accepts (Ctx const& ctx, S& state, events::timeout const& e) const
+    {
+      return e.payload == payload;
+    }
+
+    template<Context Ctx, State<Ctx> S>
+      requires (TimeoutAction<Action const, Ctx, S>)
+    auto operator() (Ctx const& ctx, S& state, events::timeout const& e) const
+    {
+      return fire (action, ctx, state, e);
+    }
+
+    template<Context Ctx, State<Ctx> S>
+      requires (TimeoutAction<Action, Ctx, S>)
+    auto operator() (Ctx const& ctx, S& state, events::timeout const& e)
+    {
+      return fire (action, ctx, state, e);
+    }
+  };
+
+  template<class Action>
+  timeout_transition (std::string, Action) -> timeout_transition<Action>;
+} // namespace forest
@@ -0,0 +1,274 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <banana/agent/cpr.hpp>
+#include <banana/api.hpp>
+
+#include <forest/agent.hpp>
+#include <forest/log.hpp>
+
+namespace forest
+{
+  struct update_queue_options
+  {
+    // updates waiting to be handled, producers block while the queue is full
+    std::size_t capacity = 1024;
+    // most recent update ids remembered to discard duplicates
+    std::size_t dedup_window = 4096;
+  };
+
+  /**
+   * Bounded queue between the sources of updates and the handler.
+   * A full queue blocks its producers, so a slow bot stops fetching instead of buffering without bound.
+   * Updates whose update_id was already seen are dropped: webhook deliveries are retried by telegram,
+   * and a restarted poller may fetch again updates it had not acknowledged.
+   */
+  class update_queue
+  {
+  private:
+    update_queue_options options;
+
+    std::mutex mutex;
+    std::condition_variable_any cv_not_full;
+    std::condition_variable cv_not_empty;
+    std::deque<banana::api::update_t> updates;
+    std::unordered_set<banana::integer_t> seen;
+    std::deque<banana::integer_t> seen_order;
+    std::uint64_t duplicates = 0;
+    bool closed = false;
+
+    // the caller holds mutex
+    auto remember (banana::integer_t update_id) -> bool
+    {
+      if (!seen.insert (update_id).second) {
+        ++duplicates;
+        return false;
+      }
+      seen_order.push_back (update_id);
+      if (seen_order.size () > options.dedup_window) {
+        seen.erase (seen_order.front ());
+        seen_order.pop_front ();
+      }
+      return true;
+    }
+
+  public:
+    explicit update_queue (update_queue_options options = {})
+      : options (options)
+    {
+      this->options.capacity = std::max<std::size_t> (this->options.capacity, 1);
+    }
+
+    update_queue (update_queue const&) = delete;
+    update_queue& operator= (update_queue const&) = delete;
+
+    /**
+     * Queues an update, blocking while the queue is full, until stop is requested.
+     * Returns false if the update is a duplicate, the queue was closed or stop was requested.
+     */
+    auto push (banana::api::update_t update, std::stop_token stop = {}) -> bool
+    {
+      auto lock = std::unique_lock (mutex);
+      auto const ready = cv_not_full.wait (lock, stop, [this] {
+        return closed || updates.size () < options.capacity;
+      });
+      if (!ready || closed || !remember (update.update_id))
+        return false;
+      updates.push_back (std::move (update));
+      lock.unlock ();
+      cv_not_empty.notify_one ();
+      return true;
+    }
+
+    /**
+     * Blocks until an update is available, returns nullopt once the queue is closed and drained.
+     */
+    auto pop () -> std::optional<banana::api::update_t>
+    {
+      auto lock = std::unique_lock (mutex);
+      cv_not_empty.wait (lock, [this] {
+        return closed || !updates.empty ();
+      });
+      if (updates.empty ())
+        return std::nullopt;
+      auto update = std::move (updates.front ());
+      updates.pop_front ();
+      lock.unlock ();
+      cv_not_full.notify_one ();
+      return update;
+    }
+
+    /**
+     * Rejects further updates and wakes up the blocked producers and consumers.
+     * Updates already queued can still be popped.
+     */
+    auto close () -> void
+    {
+      {
+        auto guard = std::scoped_lock (mutex);
+        closed = true;
+      }
+      cv_not_full.notify_all ();
+      cv_not_empty.notify_all ();
+    }
+
+    auto size () -> std::size_t
+    {
+      auto guard = std::scoped_lock (mutex);
+      return updates.size ();
+    }
+
+    /**
+     * Number of updates dropped because their update_id had already been queued.
+     */
+    auto duplicate_count () -> std::uint64_t
+    {
+      auto guard = std::scoped_lock (mutex);
+      return duplicates;
+    }
+  };
+
+  struct polling_options
+  {
+    // how long telegram holds a getUpdates request open when there are no updates
+    std::chrono::seconds timeout {30};
+    // updates fetched by a single request, between 1 and 100
+    banana::integer_t limit = 100;
+    // update types to receive, empty for telegram's default
+    std::vector<std::string> allowed_updates;
+    // pause after a failed request
+    std::chrono::milliseconds retry_delay {1000};
+  };
+
+  /**
+   * Fetches updates with long polling on a background thread and pushes them to an update_queue.
+   * The request for the next batch is sent as soon as the current batch is received,
+   * so the network round trip overlaps with queueing and handling the current batch.
+   * This acknowledges a batch to telegram before it is handled: updates still queued when the process dies are lost.
+   * Updates are fetched with the get_updates member of the agent if it has one, through banana otherwise.
+   */
+  template<Agent AgentType>
+  class long_polling_source
+  {
+  public:
+    using agent_type = AgentType;
+
+  private:
+    std::reference_wrapper<agent_type> agent_ref;
+    std::reference_wrapper<update_queue> queue_ref;
+    polling_options options;
+    std::jthread poller;
+
+    auto request (banana::integer_t offset) -> std::future<banana::array_t<banana::api::update_t>>
+    {
+      auto args = banana::api::get_updates_args_t {};
+      args.offset = offset;
+      args.limit = options.limit;
+      args.timeout = static_cast<banana::integer_t> (options.timeout.count ());
+      if (!options.allowed_updates.empty ())
+        args.allowed_updates = options.allowed_updates;
+      if constexpr (requires { agent_ref.get ().get_updates (std::move (args)); })
+        return agent_ref.get ().get_updates (std::move (args));
+      else
+        return banana::api::get_updates (agent_ref.get (), std::move (args));
+    }
+
+    auto run (std::stop_token stop, banana::integer_t offset) -> void
+    {
+      auto next = std::optional<std::future<banana::array_t<banana::api::update_t>>> ();
+      while (!stop.stop_requested ()) {
+        auto updates = banana::array_t<banana::api::update_t> ();
+        try {
+          if (!next.has_value ())
+            next = request (offset);
+          updates = std::exchange (next, std::nullopt)->get ();
+        } catch (std::exception& e) {
+          log<log_level::warning> ("long_polling_source: ", e.what ());
+          std::this_thread::sleep_for (options.retry_delay);
+          continue;
+        }
+
+        for (auto const& update : updates)
+          offset = std::max (offset, update.update_id + 1);
+        if (stop.stop_requested ())
+          break;
+
+        // prefetch the next batch while this one is queued
+        try {
+          next = request (offset);
+        } catch (std::exception& e) {
+          log<log_level::warning> ("long_polling_source: ", e.what ());
+        }
+        for (auto& update : updates)
+          queue_ref.get ().push (std::move (update), stop);
+      }
+    }
+
+  public:
+    /**
+     * Starts polling from offset, zero resumes from the first update not yet acknowledged.
+     */
+    long_polling_source (agent_type& agent, update_queue& queue, polling_options options = {},
+      banana::integer_t offset = 0)
+      : agent_ref (agent)
+      , queue_ref (queue)
+      , options (std::move (options))
+    {
+      poller = std::jthread ([this, offset] (std::stop_token stop) {
+        run (stop, offset);
+      });
+    }
+
+    long_polling_source (long_polling_source const&) = delete;
+    long_polling_source& operator= (long_polling_source const&) = delete;
+
+    /**
+     * Stops polling, also while blocked on a full queue. Waits for the request in flight, up to the polling timeout.
+     */
+    ~long_polling_source ()
+    {
+      poller.request_stop ();
+    }
+  };
+
+  /**
+   * Moves updates from the queue to the handler until the queue is closed.
+   * With a dispatcher enabled, a queue limit on the dispatcher extends backpressure up to the workers.
+   */
+  template<class Handler>
+  auto pump_updates (update_queue& queue, Handler& handler) -> void
+  {
+    while (auto update = queue.pop ())
+      handler.dispatch_update (std::move (update.value ()));
+  }
+
+  /**
+   * Decodes an update from telegram's JSON representation, as delivered to webhooks or recorded from getUpdates.
+   * The text goes through banana's own deserializer, the one decoding the responses of getUpdates,
+   * so that the update is the same whatever its source. Throws std::invalid_argument if it is not an update.
+   */
+  inline auto decode_update (std::string_view json) -> banana::api::update_t
+  {
+    auto update = banana::deser::deserialize<banana::api::update_t> (json);
+    if (!update)
+      throw std::invalid_argument ("forest: malformed update");
+    return std::move (*update);
+  }
+} // namespace forest
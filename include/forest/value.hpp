@@ -0,0 +1,195 @@
+#pragma once
+#include <charconv>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+namespace forest
+{
+  using blob = std::vector<std::uint8_t>;
+
+  /**
+   * A value as stored in the kValue column, one alternative per SQLite storage class.
+   * std::monostate is SQL NULL.
+   */
+  using stored_value = std::variant<std::monostate, std::int64_t, double, std::string, blob>;
+
+  inline auto stored_size (stored_value const& value) -> std::size_t
+  {
+    if (auto const* text = std::get_if<std::string> (&value))
+      return text->size ();
+    if (auto const* bytes = std::get_if<blob> (&value))
+      return bytes->size ();
+    return sizeof (std::int64_t);
+  }
+
+  [[noreturn]] inline void throw_bad_value (std::string_view type)
+  {
+    throw std::invalid_argument ("forest: stored value is not convertible to " + std::string (type));
+  }
+
+  /**
+   * Conversion between a C++ type and its stored representation.
+   * decode also accepts the TEXT representation written by older versions, which stored everything as text.
+   */
+  template<class T>
+  struct value_traits;
+
+  /**
+   * Blobs are read as text only when they hold a JSON document, stored as CBOR: the text is the document
+   * serialized back to JSON, as older versions stored it. Other blobs are not convertible to a string.
+   */
+  template<>
+  struct value_traits<std::string>
+  {
+    static auto encode (std::string value) -> stored_value
+    {
+      return value;
+    }
+
+    static auto decode (stored_value const& value) -> std::string
+    {
+      if (auto const* text = std::get_if<std::string> (&value))
+        return *text;
+      if (auto const* integer = std::get_if<std::int64_t> (&value))
+        return std::to_string (*integer);
+      if (auto const* real = std::get_if<double> (&value))
+        return std::to_string (*real);
+      if (auto const* bytes = std::get_if<blob> (&value)) {
+        auto const json = nlohmann::json::from_cbor (*bytes, true, false);
+        if (json.is_discarded ())
+          throw_bad_value ("a string");
+        return json.dump ();
+      }
+      return std::string ();
+    }
+  };
+
+  template<class T>
+    requires ((std::integral<T> && !std::same_as<T, bool>) || std::floating_point<T>)
+  struct value_traits<T>
+  {
+    static auto encode (T value) -> stored_value
+    {
+      if constexpr (std::integral<T>)
+        return static_cast<std::int64_t> (value);
+      else
+        return static_cast<double> (value);
+    }
+
+    static auto decode (stored_value const& value) -> T
+    {
+      if (auto const* integer = std::get_if<std::int64_t> (&value))
+        return static_cast<T> (*integer);
+      if (auto const* real = std::get_if<double> (&value))
+        return static_cast<T> (*real);
+      if (auto const* text = std::get_if<std::string> (&value)) {
+        auto result = T {};
+        auto [end, error] = std::from_chars (text->data (), text->data () + text->size (), result);
+        if (error == std::errc ())
+          return result;
+      }
+      throw_bad_value (std::is_integral_v<T> ? "an integer" : "a floating point number");
+    }
+  };
+
+  template<>
+  struct value_traits<blob>
+  {
+    static auto encode (blob value) -> stored_value
+    {
+      return value;
+    }
+
+    static auto decode (stored_value const& value) -> blob
+    {
+      if (auto const* bytes = std::get_if<blob> (&value))
+        return *bytes;
+      if (auto const* text = std::get_if<std::string> (&value))
+        return blob (text->begin (), text->end ());
+      throw_bad_value ("a blob");
+    }
+  };
+
+  /**
+   * JSON documents are stored as CBOR blobs, so reading them back does not parse text.
+   */
+  template<>
+  struct value_traits<nlohmann::json>
+  {
+    static auto encode (nlohmann::json const& value) -> stored_value
+    {
+      return nlohmann::json::to_cbor (value);
+    }
+
+    static auto decode (stored_value const& value) -> nlohmann::json
+    {
+      if (auto const* bytes = std::get_if<blob> (&value))
+        return nlohmann::json::from_cbor (*bytes);
+      if (auto const* text = std::get_if<std::string> (&value))
+        return nlohmann::json::parse (*text);
+      throw_bad_value ("json");
+    }
+  };
+
+  /**
+   * Other types with nlohmann::json to_json/from_json overloads are stored as CBOR too.
+   */
+  template<class T>
+    requires (!std::is_arithmetic_v<T> && requires (nlohmann::json json, T value) {
+      nlohmann::to_json (json, std::as_const (value));
+      nlohmann::from_json (std::as_const (json), value);
+    })
+  struct value_traits<T>
+  {
+    static auto encode (T const& value) -> stored_value
+    {
+      return value_traits<nlohmann::json>::encode (nlohmann::json (value));
+    }
+
+    static auto decode (stored_value const& value) -> T
+    {
+      return value_traits<nlohmann::json>::decode (value).template get<T> ();
+    }
+  };
+
+  template<class T>
+  concept StorableValue = requires (T value, stored_value const& stored)
+  {
+    // clang-format off
+    { value_traits<T>::encode (value) } -> std::same_as<stored_value>;
+    { value_traits<T>::decode (stored) } -> std::same_as<T>;
+    // clang-format on
+  };
+
+  /**
+   * Values of several keys of a chat, as read or written by the batch operations of persistence.
+   */
+  using value_map = std::map<std::string, stored_value, std::less<>>;
+
+  template<StorableValue T>
+  auto to_stored (T const& value) -> stored_value
+  {
+    return value_traits<T>::encode (value);
+  }
+
+  template<StorableValue T>
+  auto find_value (value_map const& values, std::string_view name) -> std::optional<T>
+  {
+    if (auto it = values.find (name); it != values.end ())
+      return value_traits<T>::decode (it->second);
+    return std::nullopt;
+  }
+} // namespace forest
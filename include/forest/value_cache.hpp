@@ -0,0 +1,232 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include <banana/api.hpp>
+
+#include <forest/value.hpp>
+
+namespace forest
+{
+  struct cache_stats
+  {
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+    std::size_t chats = 0;
+    std::size_t bytes = 0;
+  };
+
+  /**
+   * Per-chat read-through cache of persisted values, bounded by an approximate memory budget.
+   * Absent keys are cached too, so repeated misses do not reach SQLite either.
+   * When the budget is exceeded the least recently used chats are dropped as a whole,
+   * then the keys of a chat exceeding the budget on its own are dropped, absent keys first.
+   * Writes invalidate the key instead of caching the new value, the next read fills it again.
+   */
+  class value_cache
+  {
+  public:
+    // cached value of a key, nullopt when the key is known to be absent
+    using value_type = std::optional<stored_value>;
+
+    static constexpr std::size_t shard_count = 64;
+    // write counters of a shard, each shared by the keys hashing to it
+    static constexpr std::size_t generation_slots = 256;
+
+  private:
+    struct string_hash
+    {
+      using is_transparent = void;
+
+      auto operator() (std::string_view text) const -> std::size_t
+      {
+        return std::hash<std::string_view> {}(text);
+      }
+    };
+
+    using values_map = std::unordered_map<std::string, value_type, string_hash, std::equal_to<>>;
+
+    struct chat_entry
+    {
+      values_map values;
+      std::size_t bytes = 0;
+      std::list<banana::integer_t>::iterator lru_position;
+    };
+
+    struct shard
+    {
+      std::mutex mutex;
+      // bumped by the writes of the keys of a slot, a fill started before a write of its key is discarded,
+      // writes to other keys only discard it when they share its slot
+      std::array<std::uint64_t, generation_slots> generations {};
+      std::unordered_map<banana::integer_t, chat_entry> chats;
+      // most recently used chat first
+      std::list<banana::integer_t> lru;
+      std::size_t bytes = 0;
+    };
+
+    std::array<shard, shard_count> shards;
+    std::size_t shard_budget;
+    std::atomic<std::uint64_t> hits = 0;
+    std::atomic<std::uint64_t> misses = 0;
+
+    static auto entry_size (std::string_view name, value_type const& value) -> std::size_t
+    {
+      // rough per-node overhead of the hash map
+      return 64 + name.size () + (value.has_value () ? stored_size (value.value ()) : 0);
+    }
+
+    auto shard_of (banana::integer_t chat_id) -> shard&
+    {
+      return shards[static_cast<std::uint64_t> (chat_id) % shard_count];
+    }
+
+    static auto generation_slot (banana::integer_t chat_id, std::string_view name) -> std::size_t
+    {
+      auto const hash = std::hash<std::string_view> {}(name) ^ (static_cast<std::uint64_t> (chat_id) * 0x9e3779b97f4a7c15);
+      // the low bits of the chat pick the shard, the high ones are mixed into the slot
+      return (hash ^ (hash >> 32)) % generation_slots;
+    }
+
+    auto insert (shard& s, banana::integer_t chat_id, std::string_view name, value_type value) -> void
+    {
+      auto [it, inserted] = s.chats.try_emplace (chat_id);
+      chat_entry& chat = it->second;
+      if (inserted) {
+        s.lru.push_front (chat_id);
+        chat.lru_position = s.lru.begin ();
+      } else {
+        s.lru.splice (s.lru.begin (), s.lru, chat.lru_position);
+      }
+
+      auto const size = entry_size (name, value);
+      if (auto found = chat.values.find (name); found != chat.values.end ()) {
+        auto const old_size = entry_size (name, found->second);
+        chat.bytes -= old_size;
+        s.bytes -= old_size;
+        found->second = std::move (value);
+      } else {
+        chat.values.emplace (std::string (name), std::move (value));
+      }
+      chat.bytes += size;
+      s.bytes += size;
+
+      // never drop the chat that is being written
+      while (s.bytes > shard_budget && s.lru.back () != chat_id) {
+        auto victim = s.chats.find (s.lru.back ());
+        s.bytes -= victim->second.bytes;
+        s.chats.erase (victim);
+        s.lru.pop_back ();
+      }
+      if (s.bytes > shard_budget)
+        trim (s, chat, name);
+    }
+
+    // drops keys of a chat exceeding the budget on its own, other than name: absent keys first, then any
+    auto trim (shard& s, chat_entry& chat, std::string_view name) -> void
+    {
+      for (bool absent_only : {true, false}) {
+        for (auto it = chat.values.begin (); it != chat.values.end () && s.bytes > shard_budget;) {
+          if (it->first == name || (absent_only && it->second.has_value ())) {
+            ++it;
+            continue;
+          }
+          auto const size = entry_size (it->first, it->second);
+          chat.bytes -= size;
+          s.bytes -= size;
+          it = chat.values.erase (it);
+        }
+      }
+    }
+
+  public:
+    explicit value_cache (std::size_t memory_budget)
+      : shards ()
+      , shard_budget (std::max<std::size_t> (memory_budget / shard_count, 1))
+    {}
+
+    /**
+     * Returns the cached value, or nullopt on a miss.
+     */
+    auto lookup (banana::integer_t chat_id, std::string_view name) -> std::optional<value_type>
+    {
+      shard& s = shard_of (chat_id);
+      auto guard = std::scoped_lock (s.mutex);
+      if (auto chat = s.chats.find (chat_id); chat != s.chats.end ()) {
+        if (auto value = chat->second.values.find (name); value != chat->second.values.end ()) {
+          s.lru.splice (s.lru.begin (), s.lru, chat->second.lru_position);
+          hits.fetch_add (1, std::memory_order_relaxed);
+          return value->second;
+        }
+      }
+      misses.fetch_add (1, std::memory_order_relaxed);
+      return std::nullopt;
+    }
+
+    /**
+     * Token to be passed to fill, taken before reading the value of the key from the database.
+     */
+    auto generation (banana::integer_t chat_id, std::string_view name) -> std::uint64_t
+    {
+      shard& s = shard_of (chat_id);
+      auto guard = std::scoped_lock (s.mutex);
+      return s.generations[generation_slot (chat_id, name)];
+    }
+
+    /**
+     * Caches a value read from the database, unless the key was written since generation was taken.
+     */
+    auto fill (banana::integer_t chat_id, std::string_view name, value_type value, std::uint64_t generation) -> void
+    {
+      shard& s = shard_of (chat_id);
+      auto guard = std::scoped_lock (s.mutex);
+      if (s.generations[generation_slot (chat_id, name)] == generation)
+        insert (s, chat_id, name, std::move (value));
+    }
+
+    /**
+     * Drops the cached value of a key, to be called after writing or deleting it in the database.
+     * Fills started before the call are discarded, so a concurrent read cannot cache the previous value.
+     */
+    auto invalidate (banana::integer_t chat_id, std::string_view name) -> void
+    {
+      shard& s = shard_of (chat_id);
+      auto guard = std::scoped_lock (s.mutex);
+      ++s.generations[generation_slot (chat_id, name)];
+      auto chat = s.chats.find (chat_id);
+      if (chat == s.chats.end ())
+        return;
+      if (auto value = chat->second.values.find (name); value != chat->second.values.end ()) {
+        auto const size = entry_size (name, value->second);
+        chat->second.bytes -= size;
+        s.bytes -= size;
+        chat->second.values.erase (value);
+      }
+      if (chat->second.values.empty ()) {
+        s.lru.erase (chat->second.lru_position);
+        s.chats.erase (chat);
+      }
+    }
+
+    auto stats () -> cache_stats
+    {
+      auto result = cache_stats {hits.load (), misses.load ()};
+      for (auto& s : shards) {
+        auto guard = std::scoped_lock (s.mutex);
+        result.chats += s.chats.size ();
+        result.bytes += s.bytes;
+      }
+      return result;
+    }
+  };
+} // namespace forest
@@ -0,0 +1,99 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <stop_token>
+#include <string>
+#include <utility>
+
+#include <forest/http.hpp>
+#include <forest/log.hpp>
+#include <forest/update_source.hpp>
+
+namespace forest
+{
+  struct webhook_options
+  {
+    // address to listen on, TLS is expected to be terminated by a reverse proxy in front of it
+    std::string address = "127.0.0.1";
+    std::uint16_t port = 8080;
+    // requests for other paths are answered with 404
+    std::string path = "/";
+    // expected value of X-Telegram-Bot-Api-Secret-Token, empty to accept any request
+    std::string secret_token;
+    // larger request bodies are rejected
+    std::size_t max_body = 1 << 20;
+    // a connection that stays silent for this long is dropped
+    std::chrono::milliseconds read_timeout {5000};
+  };
+
+  /**
+   * Minimal HTTP receiver for telegram's webhook deliveries, pushing the updates to an update_queue.
+   * Requests are served one at a time, the response is sent once the update has been queued:
+   * while the queue is full telegram's delivery waits, and telegram slows down on its own.
+   * A delivery still waiting when the receiver is destroyed is answered with 503, telegram sends it again later.
+   * Registering the webhook with setWebhook is left to the caller.
+   */
+  class webhook_source
+  {
+  private:
+    std::reference_wrapper<update_queue> queue_ref;
+    webhook_options options;
+    // stops the delivery waiting for room in the queue, before the server is joined
+    std::stop_source stopping;
+    // declared last: stopped before the members used by its handler are destroyed
+    http_server server;
+
+    auto receive (http_request const& request) -> http_response
+    {
+      if (request.path () != options.path)
+        return {"404 Not Found", {}, {}};
+      if (request.method != "POST")
+        return {"405 Method Not Allowed", {}, {}};
+      if (!options.secret_token.empty () &&
+          request.header ("x-telegram-bot-api-secret-token").value_or ("") != options.secret_token)
+        return {"401 Unauthorized", {}, {}};
+
+      try {
+        // duplicates are acknowledged too, or telegram would keep retrying them
+        if (!queue_ref.get ().push (decode_update (request.body), stopping.get_token ()) && stopping.stop_requested ())
+          return {"503 Service Unavailable", {}, {}};
+      } catch (std::exception& e) {
+        log<log_level::warning> ("webhook_source: ", e.what ());
+        return {"400 Bad Request", {}, {}};
+      }
+      return {"200 OK", {}, {}};
+    }
+
+  public:
+    /**
+     * Binds the listening socket, throws std::system_error if it cannot be bound.
+     */
+    webhook_source (update_queue& queue, webhook_options options = {})
+      : queue_ref (queue)
+      , options (std::move (options))
+      , server (
+          {this->options.address, this->options.port, this->options.max_body, this->options.read_timeout},
+          [this] (http_request const& request) {
+            return receive (request);
+          })
+    {}
+
+    ~webhook_source ()
+    {
+      stopping.request_stop ();
+    }
+
+    webhook_source (webhook_source const&) = delete;
+    webhook_source& operator= (webhook_source const&) = delete;
+
+    /**
+     * Port the receiver listens on, useful when options.port is zero and the system picked one.
+     */
+    auto port () const -> std::uint16_t
+    {
+      return server.port ();
+    }
+  };
+} // namespace forest
@@ -78,20 +78,6 @@ int main (int argc, char** argv)
   // --- transition definitions ---
   // ==============================
 
-  auto cmd_dialogue1 =
-    // ------------------------ PREFIX ------ DESCRIPTION ----------------------------- INPUT STATE ----
-    forest::command_transition ("/dialogue1", "Start dialogue 1", [] (context_type ctx, state_start&) {
-      // --- OUTPUT STATE
-      return state_ask_name {};
-    });
-
-  auto cmd_dialogue2 =
-    // ------------------------ PREFIX ------ DESCRIPTION ----------------------------- INPUT STATE ----
-    forest::command_transition ("/dialogue2", "Start dialogue 2", [] (context_type ctx, state_start&, std::string params) {
-      // --- OUTPUT STATE
-      return state_ask_pet_name {};
-    });
-
   auto enter_ask_age_transition =
     // ---------------------------------------------- INPUT STATE ---------- INCOMING MESSAGE
     forest::message_transition ([] (context_type ctx, state_ask_name& state, std::string name, std::string params) {
@@ -105,7 +91,7 @@ int main (int argc, char** argv)
       std::string name = state.name;
       ctx.send_message ("Hi " + name + ", your age is " + age);
 
-      // --- OUTPUT STATE
+      // --- OUTPUT STATE (leaves the dialogue)
       return state_start {};
     });
 
@@ -122,7 +108,46 @@ int main (int argc, char** argv)
       std::string name = state.name;
       ctx.send_message ("Your pet's name is " + name + " and your pet's age is " + age);
 
-      // OUTPUT STATE
+      // OUTPUT STATE (leaves the dialogue)
+      return state_start {};
+    });
+
+  // the questions of both dialogues, nested in state_dialogue
+  auto dialogue_table = forest::make_transition_table<state_ask_age, //
+    state_ask_name,
+    state_ask_pet_age,
+    state_ask_pet_name> (enter_ask_age_transition, //
+    exit_ask_age_transition,
+    enter_pet_ask_age_transition,
+    exit_pet_ask_age_transition);
+
+  // while a dialogue runs, the events its question does not handle go to the transitions of state_dialogue,
+  // such as /cancel, shared by every question
+  struct state_dialogue : forest::composite_state<decltype (dialogue_table)>
+  {
+    using composite_state::composite_state;
+  };
+
+  auto cmd_dialogue1 =
+    // ------------------------ PREFIX ------ DESCRIPTION ----------------------------- INPUT STATE ----
+    forest::command_transition ("/dialogue1", "Start dialogue 1", [] (context_type ctx, state_start&) {
+      // --- OUTPUT STATE
+      return state_dialogue {state_ask_name {}};
+    });
+
+  auto cmd_dialogue2 =
+    // ------------------------ PREFIX ------ DESCRIPTION ----------------------------- INPUT STATE ----
+    forest::command_transition ("/dialogue2", "Start dialogue 2", [] (context_type ctx, state_start&, std::string params) {
+      // --- OUTPUT STATE
+      return state_dialogue {state_ask_pet_name {}};
+    });
+
+  auto cmd_cancel =
+    // ------------------------ PREFIX -- DESCRIPTION ----------------------------------- INPUT STATE ----
+    forest::command_transition ("/cancel", "Cancel the dialogue", [] (context_type ctx, state_dialogue&) {
+      ctx.send_message ("Cancelled");
+
+      // --- OUTPUT STATE
       return state_start {};
     });
 
@@ -133,37 +158,25 @@ int main (int argc, char** argv)
 
   std::cerr << "Agent started with API " << API << std::endl;
 
-  banana::api::set_my_commands (agent, {.commands = {cmd_dialogue1, cmd_dialogue2}});
+  banana::api::set_my_commands (agent, {.commands = {cmd_dialogue1, cmd_dialogue2, cmd_cancel}});
 
   std::cerr << "Commands set" << std::endl;
 
-  auto table = forest::make_transition_table<state_start, //
-    state_ask_age,
-    state_ask_name,
-    state_ask_pet_age,
-    state_ask_pet_name> (cmd_dialogue1,
+  auto table = forest::make_transition_table<state_start, state_dialogue> (cmd_dialogue1,
     cmd_dialogue2,
-    enter_ask_age_transition, //
-    exit_ask_age_transition,
-    enter_pet_ask_age_transition,
-    exit_pet_ask_age_transition);
+    cmd_cancel,
+    forest::sub_table<state_dialogue> (dialogue_table));
 
   try {
     auto handler = forest::context_handler (agent, {}, table, state_start {}, "db00.db3");
 
     std::cerr << "Handler constructed" << std::endl;
 
-    banana::integer_t offset = 0;
-    while (true) {
-      auto allowed = std::vector<std::string> {"message"};
-      auto updates = banana::api::get_updates (agent, {.offset = offset, .allowed_updates = allowed}).get ();
-
-      for (banana::api::update_t u : updates) {
-        std::cerr << "handle update " << u.update_id << std::endl;
-        offset = std::max (offset, u.update_id + 1);
-        handler.handle_update (u);
-      }
-    }
+    auto updates = forest::update_queue ();
+    // telegram only sends the update types the table has transitions for
+    auto source =
+      forest::long_polling_source (agent, updates, {.allowed_updates = handler.allowed_updates ()});
+    forest::pump_updates (updates, handler);
   } catch (std::exception& e) {
     std::cerr << typeid (e).name () << std::endl;
     std::cerr << e.what () << std::endl;
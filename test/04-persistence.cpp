@@ -1,5 +1,6 @@
 #include <cpr/cpr.h>
 #include <forest/forest.hpp>
+#include <forest/prometheus.hpp>
 #include <iostream>
 #include <optional>
 #include <random>
@@ -81,24 +82,27 @@ int main (int argc, char** argv)
 
   auto cmd_gender = forest::command_transition ("/indovinagenere",
     "stampa il genere del nome configurato",
-    [] (context_type ctx, state_start& state, std::string params) {
+    [] (context_type ctx, state_start& state, std::string params) -> forest::task<state_start> {
       /**
        * Deduce il genere del nome configurato invocando l'api rest api.genderize.io
+       * La chiamata avviene su un altro thread: la chat resta sospesa, le altre chat continuano a essere servite.
        */
 
       std::optional<std::string> nome = ctx.get_value ("nome");
       if (!nome.has_value ()) {
         ctx.send_message ("nome non configurato.");
-        return state_start {};
+        co_return state_start {};
       }
 
       std::string rest_url = "https://api.genderize.io/?name=" + nome.value ();
-      cpr::Response response = cpr::Get (cpr::Url {rest_url});
+      cpr::Response response = co_await forest::in_background ([rest_url] {
+        return cpr::Get (cpr::Url {rest_url});
+      });
 
       if (response.status_code != 200) {
         std::cerr << "status_code : " << response.status_code << std::endl;
         ctx.send_message ("errore server.");
-        return state_start {};
+        co_return state_start {};
       }
 
       try {
@@ -116,22 +120,21 @@ int main (int argc, char** argv)
         response << "nome: " << nome.value () << ", genere: " << gender
                  << ", probabilità: " << std::to_string (probability);
         ctx.send_message (response.str ());
-        return state_start {};
       } catch (std::exception& e) {
         std::cerr << typeid (e).name () << std::endl;
         std::cerr << e.what () << std::endl;
         ctx.send_message ("errore server.");
-        return state_start {};
       }
 
-      return state_start {};
+      co_return state_start {};
     });
 
-  auto cmd_options =
-    forest::command_transition ("/options", "scegli una azione", [] (context_type ctx, state_start& state, std::string params) {
-      auto btn1 = forest::button ("btn1", "stampa messaggio");
-      auto btn2 = forest::button ("btn2", "stampa misura");
-      ctx.send_message ("Seleziona una azione", {{btn1, btn2}});
+  // built once, shared by every message showing it
+  auto options_keyboard = forest::keyboard ({{{"btn1", "stampa messaggio"}, {"btn2", "stampa misura"}}});
+  auto cmd_options = forest::command_transition ("/options",
+    "scegli una azione",
+    [options_keyboard] (context_type ctx, state_start& state, std::string params) {
+      ctx.send_message ("Seleziona una azione", options_keyboard);
       std::cerr << "cmd_options" << std::endl;
       return state_start {};
     });
@@ -169,17 +172,19 @@ int main (int argc, char** argv)
     auto handler = forest::context_handler (agent, cache_type {}, table, state_start {}, "db04.db3");
     std::cerr << "handler created" << std::endl;
 
-    banana::integer_t offset = 0;
-    while (true) {
-      auto allowed = std::vector<std::string> {"message", "callback_query"};
-      auto updates = banana::api::get_updates (agent, {.offset = offset, .allowed_updates = allowed}).get ();
+    // process chats in parallel, with bounded per-worker queues
+    handler.enable_dispatcher (std::thread::hardware_concurrency (), 64);
 
-      for (banana::api::update_t u : updates) {
-        std::cerr << "handling update " << u.update_id << std::endl;
-        offset = std::max (offset, u.update_id + 1);
-        handler.handle_update (u);
-      }
-    }
+    // scraped by Prometheus at http://127.0.0.1:9100/metrics
+    auto metrics = forest::http_server ({.port = 9100}, forest::prometheus_endpoint ([&handler] {
+      return handler.metrics_text ();
+    }));
+
+    auto updates = forest::update_queue ();
+    // telegram only sends the update types the table has transitions for
+    auto source =
+      forest::long_polling_source (agent, updates, {.allowed_updates = handler.allowed_updates ()});
+    forest::pump_updates (updates, handler);
   } catch (std::exception& e) {
     std::cerr << typeid (e).name () << std::endl;
     std::cerr << e.what () << std::endl;
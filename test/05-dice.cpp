@@ -1,4 +1,5 @@
 #include <forest/forest.hpp>
+#include <charconv>
 #include <iostream>
 #include <random>
 
@@ -14,16 +15,17 @@ struct state_start
 
 struct transition_start
 {
-  bool accepts (context_type context, state_start& state, forest::events::message event)
+  bool accepts (context_type context, state_start& state, forest::events::message event) const
   {
     return event.text == "/start";
   }
 
-  state_start operator() (context_type context, state_start& state, forest::events::message event)
+  state_start operator() (context_type context, state_start& state, forest::events::message event) const
   {
     std::ostringstream response;
     response << "Available commands: \n";
-    response << "/roll rolls a dice";
+    response << "/roll rolls a dice\n";
+    response << "/remind N reminds you to roll in N minutes";
     context.send_message (response.str ());
     return state_start {};
   }
@@ -33,12 +35,12 @@ struct transition_roll_dice
 {
   std::mt19937& random_generator;
 
-  bool accepts (context_type context, state_start& state, forest::events::message event)
+  bool accepts (context_type context, state_start& state, forest::events::message event) const
   {
     return event.text == "/roll";
   }
 
-  state_start operator() (context_type context, state_start& state, forest::events::message event)
+  state_start operator() (context_type context, state_start& state, forest::events::message event) const
   {
     int dice = random_generator () % 6 + 1;
     context.send_message (std::to_string (dice));
@@ -50,26 +52,44 @@ int main (int argc, char** argv)
 {
   std::string api = argv[1];
   banana::agent::cpr_async agent (api);
-  banana::api::set_my_commands (agent, {.commands = {{"roll", "roll a dice"}}});
+  banana::api::set_my_commands (agent,
+    {.commands = {
+       {"roll", "roll a dice"},
+       {"remind", "remind me to roll"},
+     }});
 
   std::mt19937 random_generator (std::random_device {}());
+
+  auto transition_remind =
+    forest::command_transition ("/remind", "", [] (context_type context, state_start&, std::string params) {
+      int minutes = 1;
+      std::from_chars (params.data (), params.data () + params.size (), minutes);
+      // delivered as a timeout event, even if the bot is restarted in the meantime
+      context.schedule (std::chrono::minutes (minutes), "roll reminder");
+      context.send_message ("I will remind you in " + std::to_string (minutes) + " minutes");
+      return state_start {};
+    });
+
+  auto transition_reminder =
+    forest::timeout_transition ("roll reminder", [] (context_type context, state_start&) {
+      context.send_message ("Time to /roll");
+      return state_start {};
+    });
+
   auto table = forest::make_transition_table<state_start> ( //
     transition_start {},
-    transition_roll_dice {random_generator});
+    transition_roll_dice {random_generator},
+    transition_remind,
+    transition_reminder);
 
   try {
     auto handler = forest::context_handler (agent, {}, table, state_start {}, "db05.db3");
-    banana::integer_t offset = 0;
-    while (true) {
-      auto allowed = std::vector<std::string> {"message"};
-      auto updates = banana::api::get_updates (agent, {.offset = offset, .allowed_updates = allowed}).get ();
-
-      for (banana::api::update_t u : updates) {
-        std::cerr << "handle update " << u.update_id << std::endl;
-        offset = std::max (offset, u.update_id + 1);
-        handler.handle_update (u);
-      }
-    }
+    handler.enable_timers ();
+    auto updates = forest::update_queue ();
+    // telegram only sends the update types the table has transitions for
+    auto source =
+      forest::long_polling_source (agent, updates, {.allowed_updates = handler.allowed_updates ()});
+    forest::pump_updates (updates, handler);
   } catch (std::exception& e) {
     std::cerr << typeid (e).name () << ": " << e.what () << std::endl;
   }
@@ -0,0 +1,93 @@
+// counts allocations in replay reports, must precede the first include of forest
+#define FOREST_COUNT_ALLOCATIONS
+#include <forest/forest.hpp>
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+/**
+ * Load test of context_handler without a telegram token: replays a synthetic stream of updates,
+ * or the updates recorded in a file (one JSON update per line), through a fake agent.
+ *
+ * usage: 06-replay [chats] [messages per chat] [threads] [updates.jsonl]
+ */
+
+using context_type = forest::context<>;
+
+struct state_idle
+{
+  void on_entry (context_type ctx)
+  {}
+  void on_exit (context_type ctx)
+  {}
+};
+
+struct state_naming
+{
+  void on_entry (context_type ctx)
+  {
+    ctx.send_message ("what is your name?");
+  }
+  void on_exit (context_type ctx)
+  {}
+};
+
+int main (int argc, char** argv)
+{
+  auto const chats = argc > 1 ? std::stoul (argv[1]) : 10000ul;
+  auto const messages = argc > 2 ? std::stoul (argv[2]) : 10ul;
+  auto const threads = argc > 3 ? std::stoul (argv[3]) : 1ul;
+
+  auto cmd_start = forest::command_transition ("/start", "start", [] (context_type ctx, state_idle& state) {
+    ctx.send_message ("/name sets your name, /hello greets you");
+    return state_idle {};
+  });
+
+  auto cmd_name = forest::command_transition ("/name", "set your name", [] (context_type ctx, state_idle& state) {
+    return state_naming {};
+  });
+
+  auto cmd_hello = forest::command_transition ("/hello", "greet", [] (context_type ctx, state_idle& state) {
+    ctx.send_message ("hello " + ctx.get_value ("name").value_or ("stranger"));
+    return state_idle {};
+  });
+
+  auto on_name = forest::message_transition ([] (context_type ctx, state_naming& state, std::string_view text) {
+    ctx.set_value ("name", std::string (text));
+    return state_idle {};
+  });
+
+  auto table = forest::make_transition_table<state_idle, state_naming> (cmd_start, cmd_name, cmd_hello, on_name);
+
+  auto updates = std::vector<banana::api::update_t> ();
+  if (argc > 4) {
+    auto input = std::ifstream (argv[4]);
+    updates = forest::load_updates (input);
+  } else {
+    updates = forest::synthetic_updates ({
+      .chats = chats,
+      .messages_per_chat = messages,
+      .texts = {"/start", "/name", "forest", "/hello"},
+    });
+  }
+
+  std::remove ("db06.db3");
+  auto agent = forest::fake_agent ();
+  try {
+    auto handler = forest::context_handler (agent,
+      {},
+      table,
+      state_idle {},
+      "db06.db3",
+      {.global_rate = 1e9, .chat_rate = 1e9, .max_in_flight = 1024});
+
+    auto report = forest::replay (handler, updates, {.threads = threads});
+    std::cout << report;
+  } catch (std::exception& e) {
+    std::cerr << typeid (e).name () << ": " << e.what () << std::endl;
+    return 1;
+  }
+  std::cout << "messages sent: " << agent.sent_count () << std::endl;
+}
@@ -0,0 +1,336 @@
+#include "testing.hpp"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * Transition tables driven through context_handler and a recording fake agent.
+ */
+
+using forest::testing::expect;
+using context_type = forest::context<>;
+using texts = std::vector<std::string>;
+
+namespace
+{
+  struct state_idle
+  {
+    void on_entry (context_type ctx)
+    {}
+    void on_exit (context_type ctx)
+    {}
+  };
+
+  struct state_busy
+  {
+    void on_entry (context_type ctx)
+    {
+      ctx.send_message ("busy");
+    }
+    void on_exit (context_type ctx)
+    {}
+  };
+
+  // the first applicable transition in declaration order fires, the others are not tried
+  void first_transition_wins ()
+  {
+    auto from_busy = forest::message_transition ([] (context_type ctx, state_busy&, std::string_view) {
+      ctx.send_message ("from busy");
+      return state_idle {};
+    });
+    auto first = forest::message_transition ([] (context_type ctx, state_idle&, std::string_view text) {
+      ctx.send_message ("first " + std::string (text));
+      return state_busy {};
+    });
+    auto second = forest::message_transition ([] (context_type ctx, state_idle&, std::string_view) {
+      ctx.send_message ("second");
+      return state_idle {};
+    });
+    auto table = forest::make_transition_table<state_idle, state_busy> (from_busy, first, second);
+
+    auto agent = forest::fake_agent ({.record = true});
+    auto handler = forest::context_handler (
+      agent, {}, table, state_idle {}, forest::testing::scratch_db ("test07_first.db3"), forest::testing::unthrottled);
+    handler.handle_update (forest::testing::text_update (1, "hi"));
+    handler.handle_update (forest::testing::text_update (1, "again"));
+    handler.outbound ().flush ();
+
+    expect (forest::testing::sent_texts (agent, 1) == texts {"first hi", "busy", "from busy"}, "declaration order");
+    expect (forest::testing::state_index (handler, 1) == 0, "back to idle");
+  }
+
+  // commands are routed by name, arguments are passed in the requested form
+  void command_routing ()
+  {
+    auto roll = forest::command_transition ("/roll", "", [] (context_type ctx, state_idle&, std::string_view args) {
+      ctx.send_message ("roll [" + std::string (args) + "]");
+      return state_idle {};
+    });
+    auto roll_all =
+      forest::command_transition ("/rollall", "", [] (context_type ctx, state_idle&, std::vector<std::string> args) {
+        ctx.send_message ("rollall " + std::to_string (args.size ()));
+        return state_idle {};
+      });
+    auto other = forest::message_transition ([] (context_type ctx, state_idle&, std::string text) {
+      ctx.send_message ("text " + text);
+      return state_idle {};
+    });
+    auto table = forest::make_transition_table<state_idle> (roll, roll_all, other);
+
+    auto agent = forest::fake_agent ({.record = true});
+    auto handler = forest::context_handler (
+      agent, {}, table, state_idle {}, forest::testing::scratch_db ("test07_commands.db3"), forest::testing::unthrottled);
+    handler.set_bot_username ("forest_bot");
+    for (auto text : {"/roll 2d6", "/rollall a b c", "/rol", "/roll@forest_bot 1", "/roll@other_bot 1", "hello"})
+      handler.handle_update (forest::testing::text_update (1, text));
+    handler.outbound ().flush ();
+
+    expect (forest::testing::sent_texts (agent, 1) ==
+        texts {"roll [2d6]", "rollall 3", "text /rol", "roll [1]", "text /roll@other_bot 1", "text hello"},
+      "commands routed by name");
+  }
+
+  // actions taking a string_view see the text of the update itself, not a copy
+  void events_reference_the_update ()
+  {
+    static auto seen = std::string_view ();
+    auto capture = forest::message_transition ([] (context_type, state_idle&, std::string_view text) {
+      seen = text;
+      return state_idle {};
+    });
+    auto table = forest::make_transition_table<state_idle> (capture);
+
+    auto agent = forest::fake_agent ();
+    auto handler = forest::context_handler (
+      agent, {}, table, state_idle {}, forest::testing::scratch_db ("test07_views.db3"), forest::testing::unthrottled);
+    auto const update = forest::testing::text_update (1, "a message long enough not to fit in a small string");
+    handler.handle_update (update);
+    expect (seen.data () == update.message->text->data (), "the view points into the update");
+  }
+
+  struct state_holding
+  {
+    std::unique_ptr<int> value;
+
+    void on_entry (context_type ctx)
+    {
+      ctx.send_message ("holding " + std::to_string (*value));
+    }
+    void on_exit (context_type ctx)
+    {}
+  };
+
+  // a state that can only be moved is constructed in place in the session
+  void move_only_states ()
+  {
+    auto hold = forest::command_transition ("/hold", "", [] (context_type, state_idle&, std::string args) {
+      return forest::emplace_state<state_holding> (std::make_unique<int> (std::stoi (args)));
+    });
+    auto release = forest::command_transition ("/release", "", [] (context_type ctx, state_holding& state) {
+      ctx.send_message ("released " + std::to_string (*state.value));
+      return state_idle {};
+    });
+    auto table = forest::make_transition_table<state_idle, state_holding> (hold, release);
+
+    auto agent = forest::fake_agent ({.record = true});
+    auto handler = forest::context_handler (
+      agent, {}, table, state_idle {}, forest::testing::scratch_db ("test07_in_place.db3"), forest::testing::unthrottled);
+    handler.handle_update (forest::testing::text_update (1, "/hold 7"));
+    handler.handle_update (forest::testing::text_update (1, "/release"));
+    handler.outbound ().flush ();
+    expect (forest::testing::sent_texts (agent, 1) == texts {"holding 7", "released 7"}, "moved into the session");
+  }
+
+  // the table is shared, the per_chat transitions are copied into each session
+  void per_chat_transitions ()
+  {
+    auto count = forest::per_chat {forest::message_transition ([n = 0] (context_type ctx, state_idle&, std::string_view) mutable {
+      ctx.send_message (std::to_string (++n));
+      return state_idle {};
+    })};
+    auto table = forest::make_transition_table<state_idle> (count);
+
+    auto agent = forest::fake_agent ({.record = true});
+    auto handler = forest::context_handler (
+      agent, {}, table, state_idle {}, forest::testing::scratch_db ("test07_per_chat.db3"), forest::testing::unthrottled);
+    for (auto chat : {1, 2, 1, 1, 2})
+      handler.handle_update (forest::testing::text_update (chat, "count"));
+    handler.outbound ().flush ();
+    expect (forest::testing::sent_texts (agent, 1) == texts {"1", "2", "3"}, "counter of chat 1");
+    expect (forest::testing::sent_texts (agent, 2) == texts {"1", "2"}, "counter of chat 2");
+
+    // per_chat commands go through the command router, and honour the bot username
+    auto tally = forest::per_chat {forest::command_transition ("/tally", "", [n = 0] (context_type ctx, state_idle&) mutable {
+      ctx.send_message ("tally " + std::to_string (++n));
+      return state_idle {};
+    })};
+    auto other = forest::message_transition ([] (context_type ctx, state_idle&, std::string text) {
+      ctx.send_message ("text " + text);
+      return state_idle {};
+    });
+    auto commands = forest::make_transition_table<state_idle> (tally, other);
+    auto command_handler = forest::context_handler (agent, {}, commands, state_idle {},
+      forest::testing::scratch_db ("test07_per_chat_commands.db3"), forest::testing::unthrottled);
+    command_handler.set_bot_username ("forest_bot");
+    for (auto text : {"/tally", "/tally@forest_bot", "/tally@other_bot", "/tallyho"})
+      command_handler.handle_update (forest::testing::text_update (3, text));
+    command_handler.outbound ().flush ();
+    expect (forest::testing::sent_texts (agent, 3) == texts {"tally 1", "tally 2", "text /tally@other_bot", "text /tallyho"},
+      "per_chat commands routed by name");
+  }
+
+  // a coroutine transition suspends its chat, whose updates are queued meanwhile, not the handler
+  void coroutine_transitions ()
+  {
+    static auto resume = std::function<void (int)> ();
+    auto slow = forest::command_transition ("/slow", "", [] (context_type ctx, state_idle&) -> forest::task<state_busy> {
+      auto value = co_await forest::on_callback<int> ([] (std::function<void (int)> callback) {
+        resume = std::move (callback);
+      });
+      ctx.send_message ("slow " + std::to_string (value));
+      co_return state_busy {};
+    });
+    auto fast = forest::message_transition ([] (context_type ctx, auto&, std::string_view text) {
+      ctx.send_message ("fast " + std::string (text));
+      return state_idle {};
+    });
+    auto table = forest::make_transition_table<state_idle, state_busy> (slow, fast);
+
+    auto agent = forest::fake_agent ({.record = true});
+    auto handler = forest::context_handler (
+      agent, {}, table, state_idle {}, forest::testing::scratch_db ("test07_coroutine.db3"), forest::testing::unthrottled);
+    handler.handle_update (forest::testing::text_update (1, "/slow"));
+    handler.handle_update (forest::testing::text_update (1, "queued"));
+    handler.handle_update (forest::testing::text_update (2, "other chat"));
+    handler.outbound ().flush ();
+    expect (forest::testing::sent_texts (agent, 1).empty (), "chat 1 is suspended");
+    expect (forest::testing::sent_texts (agent, 2) == texts {"fast other chat"}, "chat 2 is served");
+
+    expect (static_cast<bool> (resume), "the coroutine is waiting");
+    resume (42);
+    handler.wait_idle ();
+    handler.outbound ().flush ();
+    expect (forest::testing::sent_texts (agent, 1) == texts {"slow 42", "busy", "fast queued"}, "queued update handled after");
+  }
+
+  // exceptions not derived from std::exception release the session like any other
+  void foreign_exceptions ()
+  {
+    static auto resume = std::function<void (int)> ();
+    auto slow = forest::command_transition ("/slow", "", [] (context_type, state_idle&) -> forest::task<state_idle> {
+      auto value = co_await forest::on_callback<int> ([] (std::function<void (int)> callback) {
+        resume = std::move (callback);
+      });
+      if (value != 0)
+        throw value;
+      co_return state_idle {};
+    });
+    auto boom = forest::command_transition ("/boom", "", [] (context_type, state_idle&) -> state_idle {
+      throw 42;
+    });
+    auto echo = forest::message_transition ([] (context_type ctx, state_idle&, std::string_view text) {
+      ctx.send_message ("echo " + std::string (text));
+      return state_idle {};
+    });
+    auto table = forest::make_transition_table<state_idle> (slow, boom, echo);
+
+    auto agent = forest::fake_agent ({.record = true});
+    auto handler = forest::context_handler (
+      agent, {}, table, state_idle {}, forest::testing::scratch_db ("test07_foreign.db3"), forest::testing::unthrottled);
+
+    // thrown by a queued event
+    handler.handle_update (forest::testing::text_update (1, "/slow"));
+    handler.handle_update (forest::testing::text_update (1, "/boom"));
+    handler.handle_update (forest::testing::text_update (1, "queued"));
+    resume (0);
+    handler.wait_idle ();
+
+    // thrown by the coroutine itself
+    handler.handle_update (forest::testing::text_update (1, "/slow"));
+    handler.handle_update (forest::testing::text_update (1, "queued again"));
+    resume (7);
+    handler.wait_idle ();
+
+    handler.handle_update (forest::testing::text_update (1, "released"));
+    handler.outbound ().flush ();
+    expect (forest::testing::sent_texts (agent, 1) == texts {"echo queued", "echo queued again", "echo released"},
+      "queues drained and the session released");
+  }
+
+  struct state_ask_name
+  {
+    void on_entry (context_type ctx)
+    {
+      ctx.send_message ("name?");
+    }
+    void on_exit (context_type ctx)
+    {}
+  };
+
+  struct state_ask_age
+  {
+    std::string name;
+
+    void on_entry (context_type ctx)
+    {
+      ctx.send_message ("age of " + name + "?");
+    }
+    void on_exit (context_type ctx)
+    {}
+  };
+
+  // transitions of the nested table run from the active child, the parent's ones from the composite
+  void composite_states ()
+  {
+    auto on_name = forest::message_transition ([] (context_type, state_ask_name&, std::string text) {
+      return state_ask_age {text};
+    });
+    auto on_age = forest::message_transition ([] (context_type ctx, state_ask_age& state, std::string_view text) {
+      ctx.send_message (state.name + " is " + std::string (text));
+      return state_idle {};
+    });
+    auto signup_table = forest::make_transition_table<state_ask_name, state_ask_age> (on_name, on_age);
+
+    struct state_signup : forest::composite_state<decltype (signup_table)>
+    {
+      using composite_state::composite_state;
+    };
+
+    auto start = forest::command_transition ("/signup", "", [] (context_type, state_idle&) {
+      return state_signup {state_ask_name {}};
+    });
+    auto cancel = forest::command_transition ("/cancel", "", [] (context_type ctx, state_signup&) {
+      ctx.send_message ("cancelled");
+      return state_idle {};
+    });
+    auto table = forest::make_transition_table<state_idle, state_signup> (
+      start, cancel, forest::sub_table<state_signup> (signup_table));
+
+    auto agent = forest::fake_agent ({.record = true});
+    auto handler = forest::context_handler (
+      agent, {}, table, state_idle {}, forest::testing::scratch_db ("test07_composite.db3"), forest::testing::unthrottled);
+    for (auto text : {"/signup", "ada", "36", "/signup", "bob", "/cancel"})
+      handler.handle_update (forest::testing::text_update (1, text));
+    handler.outbound ().flush ();
+    expect (forest::testing::sent_texts (agent, 1) ==
+        texts {"name?", "age of ada?", "ada is 36", "name?", "age of bob?", "cancelled"},
+      "nested transitions and parent commands");
+  }
+} // namespace
+
+int main ()
+{
+  return forest::testing::run ({
+    {"first_transition_wins", first_transition_wins},
+    {"command_routing", command_routing},
+    {"events_reference_the_update", events_reference_the_update},
+    {"move_only_states", move_only_states},
+    {"per_chat_transitions", per_chat_transitions},
+    {"coroutine_transitions", coroutine_transitions},
+    {"foreign_exceptions", foreign_exceptions},
+    {"composite_states", composite_states},
+  });
+}
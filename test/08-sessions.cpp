@@ -0,0 +1,303 @@
+#include "testing.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * Sessions of context_handler: concurrent dispatch, session stores, eviction and checkpoints.
+ */
+
+using forest::testing::expect;
+using context_type = forest::context<int>;
+using texts = std::vector<std::string>;
+
+namespace
+{
+  struct state_idle
+  {
+    void on_entry (context_type ctx)
+    {}
+    void on_exit (context_type ctx)
+    {}
+  };
+
+  struct state_counting
+  {
+    void on_entry (context_type ctx)
+    {}
+    void on_exit (context_type ctx)
+    {}
+  };
+
+  // counts the messages of each chat in its cache, the first one moves it to state_counting
+  auto counting_table ()
+  {
+    auto count = forest::message_transition ([] (context_type ctx, auto&, std::string_view text) {
+      ctx.set_cache (ctx.get_cache () + 1);
+      ctx.send_message (std::string (text) + " " + std::to_string (ctx.get_cache ()));
+      return state_counting {};
+    });
+    return forest::make_transition_table<state_idle, state_counting> (count);
+  }
+
+  // updates of a chat are handled in order, chats are spread over the workers
+  void dispatcher_keeps_chat_order ()
+  {
+    auto agent = forest::fake_agent ({.record = true});
+    auto handler = forest::context_handler (agent, 0, counting_table (), state_idle {},
+      forest::testing::scratch_db ("test08_dispatch.db3"), forest::testing::unthrottled);
+    handler.enable_dispatcher (4);
+    for (int i = 1; i <= 50; ++i)
+      for (banana::integer_t chat = 1; chat <= 20; ++chat)
+        handler.dispatch_update (forest::testing::text_update (chat, std::to_string (i)));
+    handler.wait_idle ();
+    handler.outbound ().flush ();
+
+    for (banana::integer_t chat = 1; chat <= 20; ++chat) {
+      auto expected = texts ();
+      for (int i = 1; i <= 50; ++i)
+        expected.push_back (std::to_string (i) + " " + std::to_string (i));
+      expect (forest::testing::sent_texts (agent, chat) == expected, "updates of chat " + std::to_string (chat) + " in order");
+    }
+  }
+
+  // flat_session_map behaves as a map under random insertions and erasures
+  template<template<class, class> class Store>
+  void session_store_matches_map ()
+  {
+    auto store = Store<banana::integer_t, std::string> ();
+    auto reference = std::map<banana::integer_t, std::string> ();
+    auto random = std::mt19937_64 (7);
+    for (int step = 0; step < 20000; ++step) {
+      auto const key = static_cast<banana::integer_t> (random () % 512) - 256;
+      if (random () % 3 == 0) {
+        expect (store.erase (key) == (reference.erase (key) == 1), "erase");
+      } else {
+        auto [value, inserted] = store.find_or_emplace (key, [&] {
+          return std::to_string (key);
+        });
+        expect (inserted == reference.try_emplace (key, std::to_string (key)).second, "find_or_emplace");
+        expect (value == std::to_string (key), "value");
+      }
+    }
+    expect (store.size () == reference.size (), "size");
+    auto visited = std::size_t {0};
+    store.for_each ([&] (banana::integer_t key, std::string& value) {
+      ++visited;
+      expect (reference.contains (key) && reference[key] == value, "for_each");
+    });
+    expect (visited == reference.size (), "every entry visited");
+  }
+
+  // references to values stay valid while other keys are inserted and erased
+  void session_store_references_are_stable ()
+  {
+    auto store = forest::flat_session_map<banana::integer_t, std::string> ();
+    auto& kept = store.find_or_emplace (-1, [] {
+      return std::string ("kept");
+    }).first;
+    for (banana::integer_t key = 0; key < 10000; ++key)
+      store.find_or_emplace (key, [] {
+        return std::string ("other");
+      });
+    for (banana::integer_t key = 0; key < 10000; key += 2)
+      store.erase (key);
+    expect (&kept == store.find (-1) && kept == "kept", "reference survives rehashes");
+  }
+
+  // the memory of the map follows its size down after a burst, freed slots are reused
+  void session_store_shrinks ()
+  {
+    auto store = forest::flat_session_map<banana::integer_t, std::string> ();
+    for (banana::integer_t key = 0; key < 10000; ++key)
+      store.find_or_emplace (key, [] {
+        return std::string ("burst");
+      });
+    auto const peak_buckets = store.bucket_count ();
+    for (banana::integer_t key = 10; key < 10000; ++key)
+      store.erase (key);
+    expect (store.size () == 10 && store.bucket_count () <= 128 && store.bucket_count () < peak_buckets, "table shrunk");
+    expect (store.slot_count () == 10, "end of the slab released");
+
+    for (banana::integer_t key = 0; key < 10; key += 2)
+      store.erase (key);
+    for (banana::integer_t key = 100; key < 105; ++key)
+      store.find_or_emplace (key, [] {
+        return std::string ("again");
+      });
+    expect (store.size () == 10 && store.slot_count () == 10, "freed slots reused");
+    for (banana::integer_t key = 1; key < 10; key += 2)
+      expect (store.find (key) != nullptr && *store.find (key) == "burst", "survivors kept");
+  }
+
+  // sessions beyond the limit are spilled to persistence and restored by the next update of their chat
+  void eviction_spills_sessions ()
+  {
+    auto agent = forest::fake_agent ({.record = true});
+    auto handler = forest::context_handler (agent, 0, counting_table (), state_idle {},
+      forest::testing::scratch_db ("test08_evict.db3"), forest::testing::unthrottled);
+    handler.set_session_limits ({.max_sessions = 64});
+    for (banana::integer_t chat = 1; chat <= 1000; ++chat)
+      handler.handle_update (forest::testing::text_update (chat, "a"));
+    expect (handler.session_count () <= 128, "sessions bounded by max_sessions");
+
+    handler.handle_update (forest::testing::text_update (1, "b"));
+    handler.outbound ().flush ();
+    expect (forest::testing::sent_texts (agent, 1) == texts {"a 1", "b 2"}, "evicted session restored");
+
+    handler.set_session_limits ({.idle_timeout = std::chrono::milliseconds (1)});
+    std::this_thread::sleep_for (std::chrono::milliseconds (5));
+    handler.evict_idle_sessions ();
+    expect (handler.session_count () == 0, "idle sessions evicted");
+  }
+
+  // sessions evicted and restored by several threads at once lose none of their updates
+  void concurrent_eviction ()
+  {
+    auto agent = forest::fake_agent ({.record = true});
+    auto handler = forest::context_handler (agent, 0, counting_table (), state_idle {},
+      forest::testing::scratch_db ("test08_concurrent_evict.db3"), forest::testing::unthrottled);
+    handler.set_session_limits ({.max_sessions = 64});
+    {
+      auto threads = std::vector<std::jthread> ();
+      for (int t = 0; t < 4; ++t)
+        threads.emplace_back ([&, t] {
+          for (int round = 0; round < 5; ++round)
+            for (banana::integer_t chat = 1; chat <= 300; ++chat)
+              handler.handle_update (forest::testing::text_update ((chat * 7 + t * 61) % 300 + 1, "m"));
+        });
+    }
+    handler.outbound ().flush ();
+
+    for (banana::integer_t chat = 1; chat <= 300; ++chat) {
+      auto counts = forest::testing::sent_texts (agent, chat);
+      std::ranges::sort (counts, [] (std::string const& a, std::string const& b) {
+        return std::stoi (a.substr (2)) < std::stoi (b.substr (2));
+      });
+      auto expected = texts ();
+      for (int i = 1; i <= 20; ++i)
+        expected.push_back ("m " + std::to_string (i));
+      expect (counts == expected, "every update of chat " + std::to_string (chat) + " counted once");
+    }
+  }
+
+  // a shard whose only session is suspended keeps it and grows past its capacity until the coroutine resumes
+  void suspended_sessions_are_not_evicted ()
+  {
+    static auto resume = std::function<void (int)> ();
+    auto wait = forest::command_transition ("/wait", "", [] (context_type ctx, state_idle&) -> forest::task<state_idle> {
+      auto value = co_await forest::on_callback<int> ([] (std::function<void (int)> callback) {
+        resume = std::move (callback);
+      });
+      ctx.send_message ("resumed " + std::to_string (value));
+      co_return state_idle {};
+    });
+    auto count = forest::message_transition ([] (context_type ctx, auto&, std::string_view text) {
+      ctx.set_cache (ctx.get_cache () + 1);
+      ctx.send_message (std::string (text) + " " + std::to_string (ctx.get_cache ()));
+      return state_counting {};
+    });
+    auto table = forest::make_transition_table<state_idle, state_counting> (wait, count);
+
+    auto agent = forest::fake_agent ({.record = true});
+    auto handler = forest::context_handler (
+      agent, 0, table, state_idle {}, forest::testing::scratch_db ("test08_suspended.db3"), forest::testing::unthrottled);
+    // one session per shard: chats 1, 65 and 129 share a shard
+    handler.set_session_limits ({.max_sessions = 64});
+    handler.handle_update (forest::testing::text_update (1, "/wait"));
+    handler.handle_update (forest::testing::text_update (65, "a"));
+    handler.handle_update (forest::testing::text_update (129, "b"));
+    expect (handler.session_count () == 2, "suspended session kept, the other one evicted");
+
+    resume (7);
+    handler.wait_idle ();
+    handler.handle_update (forest::testing::text_update (65, "c"));
+    handler.outbound ().flush ();
+    expect (forest::testing::sent_texts (agent, 1) == texts {"resumed 7"}, "suspended chat served");
+    expect (forest::testing::sent_texts (agent, 65) == texts {"a 1", "c 2"}, "evicted chat restored");
+    expect (handler.session_count () == 1, "resumed session evicted in turn");
+  }
+
+  // a transition blocking its thread holds its own chat only: the other chats of the shard are served,
+  // updates of the chat arriving meanwhile are handled afterwards by the same thread, in order
+  void slow_transitions_hold_their_chat_only ()
+  {
+    static auto entered = std::atomic<bool> (false);
+    static auto release = std::atomic<bool> (false);
+    auto echo = forest::message_transition ([] (context_type ctx, auto&, std::string_view text) {
+      if (text == "slow") {
+        entered = true;
+        while (!release)
+          std::this_thread::sleep_for (std::chrono::milliseconds (1));
+      }
+      ctx.send_message (std::string (text));
+      return state_idle {};
+    });
+    auto table = forest::make_transition_table<state_idle, state_counting> (echo);
+
+    auto agent = forest::fake_agent ({.record = true});
+    auto handler = forest::context_handler (
+      agent, 0, table, state_idle {}, forest::testing::scratch_db ("test08_busy.db3"), forest::testing::unthrottled);
+    auto slow = std::jthread ([&] {
+      handler.handle_update (forest::testing::text_update (1, "slow"));
+    });
+    expect (forest::testing::eventually ([] {
+      return entered.load ();
+    }),
+      "slow transition running");
+
+    // chat 65 shares the shard of chat 1
+    handler.handle_update (forest::testing::text_update (1, "queued"));
+    handler.handle_update (forest::testing::text_update (65, "other"));
+    handler.outbound ().flush ();
+    expect (forest::testing::sent_texts (agent, 65) == texts {"other"}, "other chat of the shard served");
+    expect (forest::testing::sent_texts (agent, 1).empty (), "busy chat not handled twice at once");
+
+    release = true;
+    slow.join ();
+    handler.outbound ().flush ();
+    expect (forest::testing::sent_texts (agent, 1) == texts {"slow", "queued"}, "queued update handled after");
+  }
+
+  // a new handler on the same database carries on from the last checkpoint
+  void checkpoints_survive_restarts ()
+  {
+    auto const db = forest::testing::scratch_db ("test08_checkpoint.db3");
+    {
+      auto agent = forest::fake_agent ();
+      auto handler = forest::context_handler (agent, 0, counting_table (), state_idle {}, db, forest::testing::unthrottled);
+      handler.enable_checkpoints (std::chrono::hours (1));
+      handler.handle_update (forest::testing::text_update (1, "a"));
+      handler.handle_update (forest::testing::text_update (1, "b"));
+      // the last checkpoint is taken by the destructor
+    }
+
+    auto agent = forest::fake_agent ({.record = true});
+    auto handler = forest::context_handler (agent, 0, counting_table (), state_idle {}, db, forest::testing::unthrottled);
+    expect (forest::testing::state_index (handler, 1) == 1, "state restored");
+    handler.handle_update (forest::testing::text_update (1, "c"));
+    handler.outbound ().flush ();
+    expect (forest::testing::sent_texts (agent, 1) == texts {"c 3"}, "cache restored");
+  }
+} // namespace
+
+int main ()
+{
+  return forest::testing::run ({
+    {"dispatcher_keeps_chat_order", dispatcher_keeps_chat_order},
+    {"flat_session_map_matches_map", session_store_matches_map<forest::flat_session_map>},
+    {"ordered_session_map_matches_map", session_store_matches_map<forest::ordered_session_map>},
+    {"session_store_references_are_stable", session_store_references_are_stable},
+    {"session_store_shrinks", session_store_shrinks},
+    {"eviction_spills_sessions", eviction_spills_sessions},
+    {"concurrent_eviction", concurrent_eviction},
+    {"suspended_sessions_are_not_evicted", suspended_sessions_are_not_evicted},
+    {"slow_transitions_hold_their_chat_only", slow_transitions_hold_their_chat_only},
+    {"checkpoints_survive_restarts", checkpoints_survive_restarts},
+  });
+}
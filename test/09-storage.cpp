@@ -0,0 +1,207 @@
+#include "testing.hpp"
+
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <SQLiteCpp/SQLiteCpp.h>
+
+/**
+ * persistence: write-behind, read connections, value cache, native types and batch operations.
+ */
+
+using forest::testing::expect;
+
+namespace
+{
+  // SQLite storage class of a value, read through a separate connection
+  auto stored_type (std::string const& db, banana::integer_t chat_id, std::string const& name) -> std::string
+  {
+    auto connection = SQLite::Database (db, SQLite::OPEN_READONLY);
+    auto statement = SQLite::Statement (connection, "SELECT typeof(kValue) FROM sessions WHERE chat_id=? AND kName=?");
+    statement.bind (1, chat_id);
+    statement.bind (2, name);
+    return statement.executeStep () ? statement.getColumn (0).getString () : std::string ();
+  }
+
+  // buffered writes are visible at once and reach the database with flush
+  void write_behind ()
+  {
+    auto const db = forest::testing::scratch_db ("test09_write_behind.db3");
+    {
+      auto storage = forest::persistence (db);
+      storage.enable_write_behind ({.flush_interval = std::chrono::hours (1), .flush_threshold = 1000000});
+      storage.set_value (1, "name", "ada");
+      storage.set_value (1, "gone", "soon");
+      storage.delete_value (1, "gone");
+      expect (storage.get_value (1, "name") == "ada", "buffered write visible");
+      expect (!storage.get_value (1, "gone").has_value (), "buffered deletion visible");
+      expect (stored_type (db, 1, "name").empty (), "not committed before flush");
+
+      storage.flush ();
+      expect (stored_type (db, 1, "name") == "text", "committed by flush");
+      storage.set_value (1, "late", "written");
+      // the destructor commits what is left
+    }
+    auto storage = forest::persistence (db);
+    expect (storage.get_value (1, "late") == "written", "committed on destruction");
+    expect (!storage.get_value (1, "gone").has_value (), "deletion committed");
+  }
+
+  // a failed commit is logged and retried on the next tick, neither the flusher nor the destructor throw
+  void write_behind_errors ()
+  {
+    auto const db = forest::testing::scratch_db ("test09_write_errors.db3");
+    auto warnings = std::atomic<int> (0);
+    forest::set_log_sink ([&] (forest::log_level level, std::string_view) {
+      if (level >= forest::log_level::warning)
+        ++warnings;
+    });
+    // another connection holding the write lock makes every commit fail, declared first to outlive the storage
+    auto blocker = std::optional<SQLite::Database> ();
+    auto lock = std::optional<SQLite::Transaction> ();
+    {
+      auto storage = forest::persistence (db, {.busy_timeout = std::chrono::milliseconds (1)});
+      storage.enable_write_behind ({.flush_interval = std::chrono::milliseconds (5), .flush_threshold = 1000000});
+      blocker.emplace (db, SQLite::OPEN_READWRITE);
+      lock.emplace (*blocker, SQLite::TransactionBehavior::EXCLUSIVE);
+
+      storage.set_value (1, "name", "ada");
+      expect (forest::testing::eventually ([&] {
+        return warnings >= 2;
+      }),
+        "failures logged");
+      expect (storage.get_value (1, "name") == "ada", "failed batch still buffered");
+
+      lock.reset ();
+      expect (forest::testing::eventually ([&] {
+        return stored_type (db, 1, "name") == "text";
+      }),
+        "retried once the database is writable");
+
+      lock.emplace (*blocker, SQLite::TransactionBehavior::EXCLUSIVE);
+      storage.set_value (1, "lost", "x");
+      warnings = 0;
+      // the destructor logs the writes it cannot commit
+    }
+    expect (warnings >= 1, "failure of the last flush logged");
+    forest::set_log_sink ({});
+  }
+
+  // reads on the pool of read-only connections see the committed writes
+  void read_connections ()
+  {
+    auto storage = forest::persistence (forest::testing::scratch_db ("test09_readers.db3"), {.read_connections = 4});
+    for (banana::integer_t chat = 0; chat < 100; ++chat)
+      storage.set_value_ll (chat, "n", chat);
+
+    auto readers = std::vector<std::jthread> ();
+    auto mismatches = std::atomic<int> (0);
+    for (int t = 0; t < 8; ++t)
+      readers.emplace_back ([&] {
+        for (int round = 0; round < 20; ++round)
+          for (banana::integer_t chat = 0; chat < 100; ++chat)
+            if (storage.get_value_ll (chat, "n") != chat)
+              ++mismatches;
+      });
+    readers.clear ();
+    expect (mismatches == 0, "concurrent reads see the values");
+  }
+
+  // the cache serves repeated reads and follows writes and deletions
+  void value_cache ()
+  {
+    auto storage = forest::persistence (forest::testing::scratch_db ("test09_cache.db3"), {.cache_budget = 1 << 20});
+    storage.set_value (1, "name", "ada");
+    expect (storage.get_value (1, "name") == "ada", "written value");
+    expect (storage.get_value (1, "name") == "ada", "cached value");
+    expect (!storage.get_value (1, "missing").has_value (), "absent value");
+    expect (!storage.get_value (1, "missing").has_value (), "cached absence");
+    storage.delete_value (1, "name");
+    expect (!storage.get_value (1, "name").has_value (), "deletion seen through the cache");
+    expect (storage.cache_statistics ().hits >= 2, "reads served by the cache");
+  }
+
+  // a single chat cannot grow its cache entry past the budget, with values or with absent keys
+  void value_cache_budget ()
+  {
+    auto cache = forest::value_cache (forest::value_cache::shard_count * 1024);
+    for (int i = 0; i < 1000; ++i) {
+      auto const name = "missing." + std::to_string (i);
+      cache.fill (0, name, std::nullopt, cache.generation (0, name));
+    }
+    expect (cache.stats ().bytes <= 1024, "absent keys trimmed");
+    for (int i = 0; i < 1000; ++i) {
+      auto const name = "key." + std::to_string (i);
+      cache.fill (0, name, forest::stored_value (std::string (100, 'x')), cache.generation (0, name));
+    }
+    expect (cache.stats ().bytes <= 1024 && cache.stats ().chats == 1, "values trimmed");
+    expect (cache.lookup (0, "key.999").has_value (), "last value kept");
+
+    // a fill racing with a write of its key is discarded, writes to other chats of the shard do not matter
+    auto const generation = cache.generation (1, "name");
+    cache.invalidate (1, "name");
+    cache.fill (1, "name", forest::stored_value (std::string ("stale")), generation);
+    expect (!cache.lookup (1, "name").has_value (), "stale fill discarded");
+
+    auto const other = cache.generation (2, "name");
+    cache.invalidate (2 + forest::value_cache::shard_count, "name");
+    cache.fill (2, "name", forest::stored_value (std::string ("fresh")), other);
+    expect (cache.lookup (2, "name").has_value (), "fill kept despite a write to another chat");
+  }
+
+  // integers, reals and json are stored in their native SQLite types
+  void native_types ()
+  {
+    auto const db = forest::testing::scratch_db ("test09_types.db3");
+    auto storage = forest::persistence (db);
+    storage.set (1, "int", std::int64_t {-42});
+    storage.set (1, "real", 2.5);
+    storage.set_value_json (1, "json", nlohmann::json {{"a", 1}});
+    storage.set_value (1, "text", "12");
+
+    expect (stored_type (db, 1, "int") == "integer", "integer column");
+    expect (stored_type (db, 1, "real") == "real", "real column");
+    expect (storage.get<std::int64_t> (1, "int") == -42, "integer round trip");
+    expect (storage.get<double> (1, "real") == 2.5, "real round trip");
+    expect (storage.get_value_json (1, "json") == nlohmann::json {{"a", 1}}, "json round trip");
+    expect (storage.get_value_ll (1, "text") == 12, "text written by older versions is parsed");
+    expect (storage.get_value (1, "json") == R"({"a":1})", "json read as text");
+  }
+
+  // batches and prefix scans merge the write-behind buffer with the database
+  void batch_operations ()
+  {
+    auto storage = forest::persistence (forest::testing::scratch_db ("test09_batch.db3"));
+    storage.set_values (1,
+      {
+        {"user.name", std::string ("ada")},
+        {"user.age", std::int64_t {36}},
+        {"other", std::string ("x")},
+      });
+    storage.enable_write_behind ({.flush_interval = std::chrono::hours (1), .flush_threshold = 1000000});
+    storage.set_value (1, "user.city", "london");
+    storage.delete_value (1, "user.age");
+
+    auto const values = storage.get_values (1, {"user.name", "user.age", "user.city", "missing"});
+    expect (values.size () == 2 && values.contains ("user.name") && values.contains ("user.city"), "get_values");
+
+    auto const scanned = storage.scan_prefix (1, "user.");
+    expect (scanned.size () == 2 && !scanned.contains ("other") && !scanned.contains ("user.age"), "scan_prefix");
+    expect (storage.scan_prefix (2, "user.").empty (), "scan of another chat");
+  }
+} // namespace
+
+int main ()
+{
+  return forest::testing::run ({
+    {"write_behind", write_behind},
+    {"write_behind_errors", write_behind_errors},
+    {"read_connections", read_connections},
+    {"value_cache", value_cache},
+    {"value_cache_budget", value_cache_budget},
+    {"native_types", native_types},
+    {"batch_operations", batch_operations},
+  });
+}
@@ -0,0 +1,302 @@
+#include "testing.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Outbound messages: the send queue, prebuilt keyboards and broadcasts.
+ */
+
+using forest::testing::expect;
+using context_type = forest::context<>;
+using texts = std::vector<std::string>;
+
+namespace
+{
+  struct state_idle
+  {
+    void on_entry (context_type ctx)
+    {}
+    void on_exit (context_type ctx)
+    {}
+  };
+
+  // messages of a chat are delivered in order, spaced by the chat rate
+  void send_queue_order_and_rate ()
+  {
+    auto agent = forest::fake_agent ({.latency = std::chrono::milliseconds (1), .record = true});
+    auto outbox = forest::send_queue (forest::make_transport (agent), {.global_rate = 1e9, .chat_rate = 100, .max_in_flight = 8});
+
+    auto const start = std::chrono::steady_clock::now ();
+    auto futures = std::vector<std::future<banana::api::message_t>> ();
+    for (int i = 0; i < 5; ++i)
+      for (banana::integer_t chat = 1; chat <= 3; ++chat)
+        futures.push_back (outbox.enqueue ({.chat_id = chat, .text = std::to_string (i)}));
+    outbox.flush ();
+    auto const elapsed = std::chrono::steady_clock::now () - start;
+
+    for (auto& future : futures)
+      expect (future.get ().message_id > 0, "every future satisfied");
+    for (banana::integer_t chat = 1; chat <= 3; ++chat)
+      expect (forest::testing::sent_texts (agent, chat) == texts {"0", "1", "2", "3", "4"}, "chat order");
+    // 5 messages of a chat at 100 per second take at least 40ms, chats are sent in parallel
+    expect (elapsed >= std::chrono::milliseconds (40), "chat rate enforced");
+    expect (elapsed < std::chrono::milliseconds (1000), "chats interleaved");
+  }
+
+  // a failed request fails its future only
+  void send_queue_errors ()
+  {
+    auto calls = 0;
+    auto outbox = forest::send_queue ([&] (forest::send_queue::args_type args) {
+      auto promise = std::promise<banana::api::message_t> ();
+      if (++calls == 1)
+        promise.set_exception (std::make_exception_ptr (std::runtime_error ("Bad Request: chat not found")));
+      else
+        promise.set_value ({});
+      return promise.get_future ();
+    });
+    auto failed = outbox.enqueue ({.chat_id = 1, .text = "a"});
+    auto delivered = outbox.enqueue ({.chat_id = 2, .text = "b"});
+    outbox.flush ();
+
+    auto threw = false;
+    try {
+      failed.get ();
+    } catch (std::runtime_error&) {
+      threw = true;
+    }
+    expect (threw, "error forwarded to the future");
+    delivered.get ();
+  }
+
+  // a message rejected with 429 is sent again once the delay has passed, its chat is paused meanwhile
+  void send_queue_rate_limited ()
+  {
+    auto mutex = std::mutex ();
+    auto sent = std::vector<std::pair<std::string, std::chrono::steady_clock::time_point>> ();
+    auto rejected = false;
+    auto outbox = forest::send_queue ([&] (forest::send_queue::args_type args) {
+      auto guard = std::scoped_lock (mutex);
+      auto promise = std::promise<banana::api::message_t> ();
+      if (args.text == "a" && !rejected) {
+        rejected = true;
+        promise.set_exception (std::make_exception_ptr (std::runtime_error ("Too Many Requests: retry after 1")));
+      } else {
+        sent.emplace_back (args.text, std::chrono::steady_clock::now ());
+        promise.set_value ({});
+      }
+      return promise.get_future ();
+    },
+      forest::testing::unthrottled);
+
+    auto const start = std::chrono::steady_clock::now ();
+    auto first = outbox.enqueue ({.chat_id = 1, .text = "a"});
+    outbox.enqueue ({.chat_id = 1, .text = "b"});
+    outbox.enqueue ({.chat_id = 2, .text = "c"});
+    outbox.flush ();
+    first.get ();
+
+    auto const texts_sent = [&] {
+      auto result = texts ();
+      for (auto const& [text, when] : sent)
+        result.push_back (text);
+      return result;
+    }();
+    expect (texts_sent == texts {"c", "a", "b"}, "other chats sent while the chat is paused, its order kept");
+    expect (sent[1].second - start >= std::chrono::seconds (1), "retried after the delay");
+  }
+
+  // a message rejected with 429 more than max_retries times fails
+  void send_queue_retries_exhausted ()
+  {
+    auto attempts = std::atomic<int> (0);
+    auto outbox = forest::send_queue ([&] (forest::send_queue::args_type) {
+      ++attempts;
+      auto promise = std::promise<banana::api::message_t> ();
+      promise.set_exception (std::make_exception_ptr (std::runtime_error ("Too Many Requests: retry after 0")));
+      return promise.get_future ();
+    },
+      {.global_rate = 1e9, .chat_rate = 1e9, .max_in_flight = 8, .max_retries = 2});
+    auto failed = outbox.enqueue ({.chat_id = 1, .text = "a"});
+    outbox.flush ();
+
+    auto threw = false;
+    try {
+      failed.get ();
+    } catch (std::runtime_error&) {
+      threw = true;
+    }
+    expect (threw && attempts == 3, "failed after the retries");
+  }
+
+  // a request waiting for its response delays neither the other chats nor their retries
+  void send_queue_out_of_order_responses ()
+  {
+    auto stuck = std::promise<banana::api::message_t> ();
+    auto rejected = std::atomic<bool> (false);
+    auto outbox = forest::send_queue ([&] (forest::send_queue::args_type args) {
+      if (args.text == "stuck")
+        return stuck.get_future ();
+      auto promise = std::promise<banana::api::message_t> ();
+      if (args.text == "limited" && !rejected.exchange (true))
+        promise.set_exception (std::make_exception_ptr (std::runtime_error ("Too Many Requests: retry after 0")));
+      else
+        promise.set_value ({});
+      return promise.get_future ();
+    },
+      forest::testing::unthrottled);
+
+    auto slow = outbox.enqueue ({.chat_id = 1, .text = "stuck"});
+    auto fast = outbox.enqueue ({.chat_id = 2, .text = "fast"});
+    auto limited = outbox.enqueue ({.chat_id = 3, .text = "limited"});
+    expect (fast.wait_for (std::chrono::seconds (5)) == std::future_status::ready, "later response completed first");
+    expect (limited.wait_for (std::chrono::seconds (5)) == std::future_status::ready, "rate limited message retried");
+    expect (slow.wait_for (std::chrono::seconds (0)) == std::future_status::timeout, "slow request still waiting");
+
+    stuck.set_value ({});
+    outbox.flush ();
+    slow.get ();
+  }
+
+  // rates that are not positive are rejected
+  void send_queue_rejects_bad_rates ()
+  {
+    for (auto rate : {0.0, -1.0}) {
+      auto threw = false;
+      try {
+        auto outbox = forest::send_queue ([] (forest::send_queue::args_type) {
+          return std::future<banana::api::message_t> ();
+        },
+          {.global_rate = 30, .chat_rate = rate});
+      } catch (std::invalid_argument&) {
+        threw = true;
+      }
+      expect (threw, "rate " + std::to_string (rate) + " rejected");
+    }
+  }
+
+  // a prebuilt keyboard is attached to every message sent with it
+  void prebuilt_keyboards ()
+  {
+    static auto const buttons = forest::keyboard ({{{"yes", "Yes"}, {"no", "No"}}, {{"later", "Later"}}});
+    auto ask = forest::command_transition ("/ask", "", [] (context_type ctx, state_idle&) {
+      ctx.send_message ("sure?", buttons);
+      return state_idle {};
+    });
+    auto answer = forest::button_transition ("yes", [] (context_type ctx, state_idle&) {
+      ctx.send_message ("confirmed");
+      return state_idle {};
+    });
+    auto table = forest::make_transition_table<state_idle> (ask, answer);
+
+    auto agent = forest::fake_agent ({.record = true});
+    auto handler = forest::context_handler (
+      agent, {}, table, state_idle {}, forest::testing::scratch_db ("test10_keyboard.db3"), forest::testing::unthrottled);
+    handler.handle_update (forest::testing::text_update (1, "/ask"));
+    handler.handle_update (forest::testing::text_update (2, "/ask"));
+    handler.handle_update (forest::testing::button_update (1, "yes"));
+    handler.handle_update (forest::testing::button_update (1, "no"));
+    handler.outbound ().flush ();
+
+    auto const sent = agent.sent_messages ();
+    auto with_keyboard = 0;
+    for (auto const& message : sent) {
+      if (!message.reply_markup.has_value ())
+        continue;
+      ++with_keyboard;
+      auto const& markup = std::get<banana::api::inline_keyboard_markup_t> (*message.reply_markup);
+      expect (markup.inline_keyboard.size () == 2 && markup.inline_keyboard[0].size () == 2, "rows of the keyboard");
+      expect (markup.inline_keyboard[0][1].callback_data == "no", "button data");
+    }
+    expect (with_keyboard == 2, "keyboard attached to both questions");
+    expect (forest::testing::sent_texts (agent, 1) == texts {"sure?", "confirmed"}, "button pressed");
+    expect (buttons.markup ().use_count () == 1, "no copy of the keyboard kept by the queue");
+  }
+
+  // a broadcast reaches every recipient once, a stopped one is resumed where it stopped
+  void broadcasts ()
+  {
+    auto agent = forest::fake_agent ({.record = true});
+    auto storage = forest::persistence (forest::testing::scratch_db ("test10_broadcast.db3"));
+    auto outbox = forest::send_queue (forest::make_transport (agent), forest::testing::unthrottled);
+
+    auto recipients = forest::broadcast_recipients {};
+    for (banana::integer_t chat = 100; chat > 0; --chat)
+      recipients.chats.push_back (chat);
+    recipients.chats.push_back (1);
+
+    auto stop = std::stop_source ();
+    stop.request_stop ();
+    auto const stopped = forest::broadcast (outbox, storage, "news", {"hello"}, recipients, {.batch = 10, .stop = stop.get_token ()});
+    expect (!stopped.completed && stopped.sent == 0, "stopped before the first batch");
+    expect (forest::unfinished_broadcasts (storage) == std::vector<std::string> {"news"}, "listed as unfinished");
+
+    auto const report = forest::resume_broadcast (outbox, storage, "news", {.batch = 10});
+    expect (report.has_value () && report->completed && report->sent == 100, "resumed to completion");
+    expect (agent.sent_count () == 100, "duplicates sent once");
+    expect (forest::testing::sent_texts (agent, 42) == texts {"hello"}, "message of a recipient");
+    expect (forest::unfinished_broadcasts (storage).empty (), "nothing left to resume");
+
+    auto threw = false;
+    try {
+      forest::broadcast (outbox, storage, "news", {"again"}, recipients);
+    } catch (std::invalid_argument&) {
+      threw = true;
+    }
+    expect (threw, "broadcast ids are not reused");
+  }
+
+  // concurrent broadcasts with the same id: one runs, the other throws. Progress is committed despite write-behind
+  void broadcast_ids_and_progress ()
+  {
+    auto const db = forest::testing::scratch_db ("test10_broadcast_claim.db3");
+    auto agent = forest::fake_agent ();
+    auto outbox = forest::send_queue (forest::make_transport (agent), forest::testing::unthrottled);
+    auto storage = forest::persistence (db);
+    storage.enable_write_behind ({.flush_interval = std::chrono::hours (1), .flush_threshold = 1000000});
+
+    auto recipients = forest::broadcast_recipients {};
+    for (banana::integer_t chat = 1; chat <= 50; ++chat)
+      recipients.chats.push_back (chat);
+    auto rejected = std::atomic<int> (0);
+    {
+      auto threads = std::vector<std::jthread> ();
+      for (int t = 0; t < 4; ++t)
+        threads.emplace_back ([&] {
+          try {
+            forest::broadcast (outbox, storage, "once", {"hello"}, recipients, {.batch = 10});
+          } catch (std::invalid_argument&) {
+            ++rejected;
+          }
+        });
+    }
+    expect (rejected == 3 && agent.sent_count () == 50, "a single broadcast ran");
+
+    // read through another connection, the write-behind buffer of storage is not flushed by its flusher for an hour
+    auto reader = forest::persistence (db);
+    auto const report = forest::resume_broadcast (outbox, reader, "once");
+    expect (report.has_value () && report->completed && report->sent == 50, "progress committed");
+  }
+} // namespace
+
+int main ()
+{
+  return forest::testing::run ({
+    {"send_queue_order_and_rate", send_queue_order_and_rate},
+    {"send_queue_errors", send_queue_errors},
+    {"send_queue_rate_limited", send_queue_rate_limited},
+    {"send_queue_retries_exhausted", send_queue_retries_exhausted},
+    {"send_queue_out_of_order_responses", send_queue_out_of_order_responses},
+    {"send_queue_rejects_bad_rates", send_queue_rejects_bad_rates},
+    {"prebuilt_keyboards", prebuilt_keyboards},
+    {"broadcasts", broadcasts},
+    {"broadcast_ids_and_progress", broadcast_ids_and_progress},
+  });
+}
@@ -0,0 +1,509 @@
+#include "testing.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <forest/webhook.hpp>
+
+/**
+ * The way in and around the handler: update queue, replay, typed events, timers and metrics.
+ */
+
+using forest::testing::expect;
+using context_type = forest::context<>;
+using texts = std::vector<std::string>;
+
+namespace
+{
+  struct state_idle
+  {
+    void on_entry (context_type ctx)
+    {}
+    void on_exit (context_type ctx)
+    {}
+  };
+
+  struct state_naming
+  {
+    void on_entry (context_type ctx)
+    {
+      ctx.send_message ("name?");
+    }
+    void on_exit (context_type ctx)
+    {}
+  };
+
+  // duplicates are dropped, a full queue blocks its producer until an update is popped
+  void update_queue ()
+  {
+    auto queue = forest::update_queue ({.capacity = 3, .dedup_window = 8});
+    expect (queue.push (forest::testing::text_update (1, "a")), "first update queued");
+    auto duplicate = forest::testing::text_update (1, "b");
+    expect (queue.push (duplicate), "second update queued");
+    expect (!queue.push (duplicate), "duplicate dropped");
+    expect (queue.duplicate_count () == 1, "duplicate counted");
+    expect (queue.push (forest::testing::text_update (1, "c")), "queue filled");
+
+    auto pushed = std::atomic<bool> (false);
+    auto producer = std::jthread ([&] {
+      queue.push (forest::testing::text_update (1, "d"));
+      pushed = true;
+    });
+    std::this_thread::sleep_for (std::chrono::milliseconds (20));
+    expect (!pushed, "producer blocked on a full queue");
+    expect (queue.pop ()->message->text == "a", "updates popped in order");
+    expect (forest::testing::eventually ([&] {
+      return pushed.load ();
+    }),
+      "producer released");
+    producer.join ();
+
+    queue.close ();
+    expect (!queue.push (forest::testing::text_update (1, "e")), "closed queue rejects updates");
+    for (auto text : {"b", "c", "d"})
+      expect (queue.pop ()->message->text == text, "drained after close");
+    expect (!queue.pop ().has_value (), "closed and drained");
+  }
+
+  // answers every getUpdates at once with a batch of new text messages
+  struct polling_agent
+  {
+    std::atomic<banana::integer_t> next_id = 1;
+
+    auto send_message (banana::api::send_message_args_t args) -> std::future<banana::api::message_t>
+    {
+      auto promise = std::promise<banana::api::message_t> ();
+      promise.set_value ({});
+      return promise.get_future ();
+    }
+
+    auto get_updates (banana::api::get_updates_args_t args) -> std::future<banana::array_t<banana::api::update_t>>
+    {
+      auto batch = banana::array_t<banana::api::update_t> (4);
+      for (auto& update : batch) {
+        update = forest::testing::text_update (1, "polled");
+        update.update_id = next_id++;
+      }
+      auto promise = std::promise<banana::array_t<banana::api::update_t>> ();
+      promise.set_value (std::move (batch));
+      return promise.get_future ();
+    }
+  };
+
+  // a poller blocked on a full queue is stopped by its destructor
+  void long_polling_stops ()
+  {
+    auto agent = polling_agent ();
+    auto queue = forest::update_queue ({.capacity = 2});
+    {
+      auto source = forest::long_polling_source (agent, queue);
+      expect (forest::testing::eventually ([&] {
+        return queue.size () == 2;
+      }),
+        "queue filled by the poller");
+      // nobody pops: the destructor must not wait for room in the queue
+    }
+    expect (queue.pop ()->update_id == 1 && queue.pop ()->update_id == 2, "polled updates in order");
+  }
+
+  // posts a body to the receiver on localhost, returns the status line of the response
+  auto post (std::uint16_t port, std::string const& body) -> std::string
+  {
+    auto const fd = ::socket (AF_INET, SOCK_STREAM, 0);
+    auto address = sockaddr_in {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons (port);
+    ::inet_pton (AF_INET, "127.0.0.1", &address.sin_addr);
+    auto response = std::string ();
+    if (::connect (fd, reinterpret_cast<sockaddr*> (&address), sizeof (address)) == 0) {
+      auto const request = "POST / HTTP/1.1\r\nContent-Length: " + std::to_string (body.size ()) + "\r\n\r\n" + body;
+      ::send (fd, request.data (), request.size (), MSG_NOSIGNAL);
+      char chunk[256];
+      for (auto count = ::recv (fd, chunk, sizeof (chunk), 0); count > 0; count = ::recv (fd, chunk, sizeof (chunk), 0))
+        response.append (chunk, static_cast<std::size_t> (count));
+    }
+    ::close (fd);
+    return response.substr (0, response.find ("\r\n"));
+  }
+
+  // a delivery waiting for room in the queue is answered with 503 when the receiver is destroyed
+  void webhook_stops ()
+  {
+    auto queue = forest::update_queue ({.capacity = 1});
+    auto source = std::optional<forest::webhook_source> ();
+    source.emplace (queue, forest::webhook_options {.port = 0});
+    auto const port = source->port ();
+    expect (post (port, R"({"update_id": 1})") == "HTTP/1.1 200 OK", "first delivery queued");
+
+    auto status = std::string ();
+    auto blocked = std::jthread ([&] {
+      status = post (port, R"({"update_id": 2})");
+    });
+    // nobody pops: the second delivery waits for room in the queue
+    std::this_thread::sleep_for (std::chrono::milliseconds (100));
+    source.reset ();
+    blocked.join ();
+    expect (status == "HTTP/1.1 503 Service Unavailable", "waiting delivery refused");
+    expect (queue.size () == 1, "only the first update queued");
+  }
+
+  auto naming_table ()
+  {
+    auto cmd_name = forest::command_transition ("/name", "", [] (context_type, state_idle&) {
+      return state_naming {};
+    });
+    auto cmd_hello = forest::command_transition ("/hello", "", [] (context_type ctx, state_idle&) {
+      ctx.send_message ("hello " + ctx.get_value ("name").value_or ("stranger"));
+      return state_idle {};
+    });
+    auto on_name = forest::message_transition ([] (context_type ctx, state_naming&, std::string_view text) {
+      ctx.set_value ("name", std::string (text));
+      return state_idle {};
+    });
+    return forest::make_transition_table<state_idle, state_naming> (cmd_name, cmd_hello, on_name);
+  }
+
+  // a synthetic load replayed on several threads: every chat ends in the same state with the same replies
+  void replay_synthetic_load ()
+  {
+    auto agent = forest::fake_agent ({.record = true});
+    auto handler = forest::context_handler (agent, {}, naming_table (), state_idle {},
+      forest::testing::scratch_db ("test11_replay.db3"), forest::testing::unthrottled);
+    auto const updates = forest::synthetic_updates ({
+      .chats = 200,
+      .messages_per_chat = 5,
+      .texts = {"/hello", "/name", "forest", "/hello", "/name"},
+    });
+    auto const report = forest::replay (handler, updates, {.threads = 4});
+    handler.outbound ().flush ();
+
+    expect (report.updates == 1000 && report.p50 <= report.p99 && report.p99 <= report.max, "report");
+    expect (agent.sent_count () == 200 * 4, "replies of every chat");
+    for (banana::integer_t chat : {1, 77, 200}) {
+      expect (forest::testing::sent_texts (agent, chat) == texts {"hello stranger", "name?", "hello forest", "name?"},
+        "replies of chat " + std::to_string (chat));
+      expect (forest::testing::state_index (handler, chat) == 1, "final state of chat " + std::to_string (chat));
+    }
+  }
+
+  // every update type carrying an event reaches the transition of that event, the others are dropped
+  void typed_events ()
+  {
+    auto log = std::make_shared<std::vector<std::string>> ();
+    auto mutex = std::make_shared<std::mutex> ();
+    auto const record = [=] (std::string entry) {
+      auto guard = std::scoped_lock (*mutex);
+      log->push_back (std::move (entry));
+    };
+    auto on_photo = forest::make_event_transition<forest::events::photo> (
+      [=] (context_type, state_idle&, forest::events::photo const& e) {
+        record ("photo " + e.largest ().file_id + " " + std::string (e.caption ()));
+        return state_idle {};
+      });
+    auto on_document = forest::make_event_transition<forest::events::document> (
+      [=] (context_type, state_idle&, forest::events::document const& e) {
+        record ("document " + e.file ().file_id);
+        return state_idle {};
+      });
+    auto on_edit = forest::make_event_transition<forest::events::edited_message> (
+      [=] (context_type, state_idle&, forest::events::edited_message const& e) {
+        record ("edited " + std::string (e.text ()));
+        return state_idle {};
+      });
+    auto on_query = forest::make_event_transition<forest::events::inline_query> (
+      [=] (context_type, state_idle&, forest::events::inline_query const& e) {
+        record ("query " + e.query.query);
+        return state_idle {};
+      });
+    auto on_member = forest::make_event_transition<forest::events::chat_member_updated> (
+      [=] (context_type, state_idle&, forest::events::chat_member_updated const& e) {
+        record (std::string ("member ") + (e.bot ? "bot" : "other"));
+        return state_idle {};
+      });
+    auto table = forest::make_transition_table<state_idle> (on_photo, on_document, on_edit, on_query, on_member);
+    using handler_type = forest::context_handler<std::monostate, decltype (table)>;
+
+    auto const allowed = handler_type::allowed_updates ();
+    expect (std::ranges::find (allowed, "my_chat_member") != allowed.end (), "chat member updates allowed");
+    expect (std::ranges::find (allowed, "callback_query") == allowed.end (), "button presses not requested");
+
+    auto agent = forest::fake_agent ();
+    auto handler = handler_type (agent, {}, table, state_idle {}, forest::testing::scratch_db ("test11_events.db3"));
+
+    auto photo = forest::testing::text_update (1, "");
+    photo.message->text.reset ();
+    photo.message->caption = "cat";
+    photo.message->photo = std::vector<banana::api::photo_size_t> (2);
+    photo.message->photo->back ().file_id = "big";
+    handler.handle_update (photo);
+
+    auto document = forest::testing::text_update (1, "");
+    document.message->text.reset ();
+    document.message->document = banana::api::document_t {};
+    document.message->document->file_id = "doc";
+    handler.handle_update (document);
+
+    auto edited = forest::testing::text_update (1, "fixed");
+    edited.edited_message = std::move (edited.message);
+    edited.message.reset ();
+    handler.handle_update (edited);
+
+    auto query = banana::api::update_t {};
+    query.inline_query = banana::api::inline_query_t {};
+    query.inline_query->from.id = 1;
+    query.inline_query->query = "forest";
+    handler.handle_update (query);
+
+    auto member = banana::api::update_t {};
+    member.my_chat_member = banana::api::chat_member_updated_t {};
+    member.my_chat_member->chat.id = 1;
+    handler.handle_update (member);
+
+    handler.handle_update (forest::testing::text_update (1, "not handled"));
+    expect (*log == texts {"photo big cat", "document doc", "edited fixed", "query forest", "member bot"}, "events delivered");
+  }
+
+  // a recording of every update type carrying an event, decoded and replayed: each reaches its transition
+  void recorded_updates ()
+  {
+    auto log = std::make_shared<std::vector<std::string>> ();
+    auto on_text = forest::message_transition ([=] (context_type ctx, state_idle&, std::string_view text) {
+      log->push_back ("text " + std::string (text));
+      return state_idle {};
+    });
+    auto on_photo = forest::make_event_transition<forest::events::photo> (
+      [=] (context_type, state_idle&, forest::events::photo const& e) {
+        log->push_back ("photo " + e.largest ().file_id + " " + std::to_string (e.largest ().width) + " " +
+          std::string (e.caption ()));
+        return state_idle {};
+      });
+    auto on_document = forest::make_event_transition<forest::events::document> (
+      [=] (context_type, state_idle&, forest::events::document const& e) {
+        log->push_back ("document " + e.file ().file_id + " " + e.file ().file_name.value_or (""));
+        return state_idle {};
+      });
+    auto on_edit = forest::make_event_transition<forest::events::edited_message> (
+      [=] (context_type, state_idle&, forest::events::edited_message const& e) {
+        log->push_back ("edited " + std::string (e.text ()) + " " + std::to_string (e.message.edit_date.value_or (0)));
+        return state_idle {};
+      });
+    auto on_button = forest::button_transition ("yes", [=] (context_type, state_idle&) {
+      log->push_back ("button yes");
+      return state_idle {};
+    });
+    auto on_query = forest::make_event_transition<forest::events::inline_query> (
+      [=] (context_type, state_idle&, forest::events::inline_query const& e) {
+        log->push_back ("query " + e.query.query + " " + e.query.chat_type.value_or (""));
+        return state_idle {};
+      });
+    auto on_member = forest::make_event_transition<forest::events::chat_member_updated> (
+      [=] (context_type, state_idle&, forest::events::chat_member_updated const& e) {
+        log->push_back (std::string (e.bot ? "bot " : "member ") + e.update.from.first_name + " " +
+          e.update.old_chat_member.status + " " + e.update.new_chat_member.status);
+        return state_idle {};
+      });
+    auto table = forest::make_transition_table<state_idle> (
+      on_text, on_photo, on_document, on_edit, on_button, on_query, on_member);
+
+    auto input = std::ifstream (FOREST_TEST_DATA_DIR "/updates.jsonl");
+    expect (input.is_open (), "fixture found");
+    auto const updates = forest::load_updates (input);
+    expect (updates.size () == 9, "blank lines skipped");
+    expect (updates[0].message->from->last_name == "Lovelace" && updates[0].message->from->language_code == "en" &&
+        updates[0].message->chat.username == "ada",
+      "fields beyond the ones of the events kept");
+
+    auto agent = forest::fake_agent ();
+    auto handler = forest::context_handler (
+      agent, {}, table, state_idle {}, forest::testing::scratch_db ("test11_recorded.db3"), forest::testing::unthrottled);
+    auto const report = forest::replay (handler, updates);
+    expect (report.updates == 9, "every update replayed");
+    expect (*log ==
+        texts {
+          "text /start",
+          "photo large 1280 a cat",
+          "document report report.pdf",
+          "edited /start again 1700000010",
+          "button yes",
+          "query forest sender",
+          "bot Ada member kicked",
+          "member Bob left member",
+        },
+      "events decoded");
+  }
+
+  // timers fire as timeout events, cancelled ones do not
+  void timers ()
+  {
+    auto remind = forest::command_transition ("/remind", "", [] (context_type ctx, state_idle&, std::string args) {
+      ctx.schedule (std::chrono::milliseconds (20), args);
+      return state_idle {};
+    });
+    auto forget = forest::command_transition ("/forget", "", [] (context_type ctx, state_idle&) {
+      ctx.cancel_timer (ctx.schedule (std::chrono::milliseconds (20), "never"));
+      return state_idle {};
+    });
+    auto ring = forest::timeout_transition ("ring", [] (context_type ctx, state_idle&, forest::events::timeout const& e) {
+      ctx.send_message ("ring");
+      return state_idle {};
+    });
+    auto never = forest::timeout_transition ("never", [] (context_type ctx, state_idle&) {
+      ctx.send_message ("never");
+      return state_idle {};
+    });
+    auto table = forest::make_transition_table<state_idle> (remind, forget, ring, never);
+
+    auto agent = forest::fake_agent ({.record = true});
+    auto handler = forest::context_handler (
+      agent, {}, table, state_idle {}, forest::testing::scratch_db ("test11_timers.db3"), forest::testing::unthrottled);
+    handler.enable_timers ({.tick = std::chrono::milliseconds (5)});
+    handler.handle_update (forest::testing::text_update (1, "/forget"));
+    handler.handle_update (forest::testing::text_update (1, "/remind ring"));
+    expect (forest::testing::eventually ([&] {
+      return agent.sent_count () == 1;
+    }),
+      "timer fired");
+    std::this_thread::sleep_for (std::chrono::milliseconds (50));
+    handler.outbound ().flush ();
+    expect (forest::testing::sent_texts (agent, 1) == texts {"ring"}, "cancelled timer did not fire");
+  }
+
+  // a timer fired for a table without timeout transitions does not restore the session of its chat
+  void unhandled_timers ()
+  {
+    auto remind = forest::command_transition ("/remind", "", [] (context_type ctx, state_idle&) {
+      ctx.schedule (std::chrono::milliseconds (20), "ring");
+      return state_idle {};
+    });
+    auto table = forest::make_transition_table<state_idle> (remind);
+
+    auto agent = forest::fake_agent ();
+    auto handler = forest::context_handler (agent, {}, table, state_idle {},
+      forest::testing::scratch_db ("test11_unhandled_timers.db3"), forest::testing::unthrottled);
+    handler.enable_timers ({.tick = std::chrono::milliseconds (5)});
+    handler.set_session_limits ({.idle_timeout = std::chrono::milliseconds (1)});
+    handler.handle_update (forest::testing::text_update (1, "/remind"));
+    std::this_thread::sleep_for (std::chrono::milliseconds (5));
+    handler.evict_idle_sessions ();
+    expect (handler.session_count () == 0, "session evicted");
+
+    expect (forest::testing::eventually ([&] {
+      return handler.metrics_text ().find ("forest_timers_fired_total 1\n") != std::string::npos;
+    }),
+      "timer fired");
+    std::this_thread::sleep_for (std::chrono::milliseconds (20));
+    expect (handler.session_count () == 0, "session left alone");
+  }
+
+  // timers pending when the handler stops fire once the next one enables timers
+  void timers_survive_restarts ()
+  {
+    auto const db = forest::testing::scratch_db ("test11_timers_restart.db3");
+    auto remind = forest::command_transition ("/remind", "", [] (context_type ctx, state_idle&) {
+      ctx.schedule (std::chrono::milliseconds (10), "ring");
+      return state_idle {};
+    });
+    auto ring = forest::timeout_transition ("ring", [] (context_type ctx, state_idle&) {
+      ctx.send_message ("ring");
+      return state_idle {};
+    });
+    auto table = forest::make_transition_table<state_idle> (remind, ring);
+    {
+      auto agent = forest::fake_agent ();
+      auto handler = forest::context_handler (agent, {}, table, state_idle {}, db, forest::testing::unthrottled);
+      handler.handle_update (forest::testing::text_update (1, "/remind"));
+    }
+
+    auto agent = forest::fake_agent ({.record = true});
+    auto handler = forest::context_handler (agent, {}, table, state_idle {}, db, forest::testing::unthrottled);
+    handler.enable_timers ({.tick = std::chrono::milliseconds (5)});
+    expect (forest::testing::eventually ([&] {
+      return agent.sent_count () == 1;
+    }),
+      "restored timer fired");
+  }
+
+  // ids come from a counter whose high-water mark is persisted: no id is handed out twice across restarts
+  void timer_ids_are_not_reused ()
+  {
+    auto storage = forest::persistence (forest::testing::scratch_db ("test11_timer_ids.db3"));
+    auto ids = std::vector<forest::timer_id> ();
+    for (int run = 0; run < 3; ++run) {
+      auto timers = forest::scheduler (storage);
+      for (int i = 0; i < 1500; ++i)
+        ids.push_back (timers.schedule (1, std::chrono::hours (1), ""));
+    }
+    expect (std::ranges::adjacent_find (ids, std::ranges::greater_equal ()) == ids.end (), "ids increase");
+    expect (ids.front () == 1, "ids start from 1");
+
+    // reservations made while other threads schedule hand out every id once
+    auto timers = forest::scheduler (storage);
+    auto mutex = std::mutex ();
+    auto concurrent = std::vector<forest::timer_id> ();
+    {
+      auto threads = std::vector<std::jthread> ();
+      for (int t = 0; t < 4; ++t)
+        threads.emplace_back ([&] {
+          for (int i = 0; i < 1000; ++i) {
+            auto const id = timers.schedule (1, std::chrono::hours (1), "");
+            auto guard = std::scoped_lock (mutex);
+            concurrent.push_back (id);
+          }
+        });
+    }
+    std::ranges::sort (concurrent);
+    expect (std::ranges::adjacent_find (concurrent) == concurrent.end () && concurrent.front () > ids.back (),
+      "concurrent ids unique and new");
+  }
+
+  // handled updates show up in the metrics, log messages go to the sink above the level
+  void metrics_and_log ()
+  {
+    auto agent = forest::fake_agent ();
+    auto handler = forest::context_handler (agent, {}, naming_table (), state_idle {},
+      forest::testing::scratch_db ("test11_metrics.db3"), forest::testing::unthrottled);
+    handler.handle_update (forest::testing::text_update (1, "/name"));
+    handler.handle_update (forest::testing::text_update (1, "ada"));
+    handler.handle_update (forest::testing::text_update (1, "unhandled"));
+
+    auto const text = handler.metrics_text ();
+    expect (text.find ("forest_updates_total 3\n") != std::string::npos, "updates counted");
+    expect (text.find ("forest_events_unhandled_total 1\n") != std::string::npos, "unhandled events counted");
+    expect (text.find ("forest_transition_duration_seconds_count{transition=\"name\"} 1\n") != std::string::npos,
+      "transitions timed by name");
+
+    auto messages = std::vector<std::string> ();
+    forest::set_log_sink ([&] (forest::log_level level, std::string_view message) {
+      messages.emplace_back (message);
+    });
+    forest::set_log_level (forest::log_level::warning);
+    forest::log<forest::log_level::info> ("dropped");
+    forest::log<forest::log_level::error> ("kept ", 1);
+    forest::set_log_sink ({});
+    forest::set_log_level (forest::log_level::info);
+    expect (messages == texts {"kept 1"}, "messages filtered by level");
+  }
+} // namespace
+
+int main ()
+{
+  return forest::testing::run ({
+    {"update_queue", update_queue},
+    {"long_polling_stops", long_polling_stops},
+    {"webhook_stops", webhook_stops},
+    {"replay_synthetic_load", replay_synthetic_load},
+    {"typed_events", typed_events},
+    {"recorded_updates", recorded_updates},
+    {"timers", timers},
+    {"unhandled_timers", unhandled_timers},
+    {"timers_survive_restarts", timers_survive_restarts},
+    {"timer_ids_are_not_reused", timer_ids_are_not_reused},
+    {"metrics_and_log", metrics_and_log},
+  });
+}
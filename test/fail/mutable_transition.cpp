@@ -0,0 +1,39 @@
+#include <forest/forest.hpp>
+
+/**
+ * Must not compile: a transition with non-const accepts and operator() would never fire from a shared table.
+ */
+
+using context_type = forest::context<>;
+
+struct state_idle
+{
+  void on_entry (context_type ctx)
+  {}
+  void on_exit (context_type ctx)
+  {}
+};
+
+struct counting_transition
+{
+  int count = 0;
+
+  bool accepts (context_type const& ctx, state_idle& state, forest::events::message const& e)
+  {
+    return true;
+  }
+
+  state_idle operator() (context_type const& ctx, state_idle& state, forest::events::message const& e)
+  {
+    ++count;
+    return state_idle {};
+  }
+};
+
+int main ()
+{
+  auto table = forest::make_transition_table<state_idle> (counting_transition {});
+  auto agent = forest::fake_agent ();
+  auto handler = forest::context_handler (agent, {}, table, state_idle {}, "mutable_transition.db3");
+  handler.handle_update (banana::api::update_t {});
+}
@@ -0,0 +1,139 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <functional>
+#include <initializer_list>
+#include <source_location>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <typeinfo>
+#include <vector>
+
+#include <forest/forest.hpp>
+
+/**
+ * Minimal assertions for the tests registered with CTest: a failed expect is reported and the test
+ * carries on, run returns a non zero exit code if any expect failed or a test case threw.
+ */
+namespace forest::testing
+{
+  struct test_case
+  {
+    std::string_view name;
+    std::function<void ()> body;
+  };
+
+  inline int failures = 0;
+
+  inline auto expect (bool condition, std::string_view what, std::source_location where = std::source_location::current ())
+    -> bool
+  {
+    if (!condition) {
+      ++failures;
+      std::fprintf (stderr, "%s:%u: expected %.*s\n", where.file_name (), static_cast<unsigned> (where.line ()),
+        static_cast<int> (what.size ()), what.data ());
+    }
+    return condition;
+  }
+
+  /**
+   * Polls condition until it holds or timeout expires, for effects of background threads.
+   */
+  template<std::predicate Condition>
+  auto eventually (Condition condition, std::chrono::milliseconds timeout = std::chrono::seconds (5)) -> bool
+  {
+    auto const deadline = std::chrono::steady_clock::now () + timeout;
+    while (!condition ()) {
+      if (std::chrono::steady_clock::now () >= deadline)
+        return false;
+      std::this_thread::sleep_for (std::chrono::milliseconds (1));
+    }
+    return true;
+  }
+
+  inline auto run (std::initializer_list<test_case> cases) -> int
+  {
+    for (auto const& test : cases) {
+      auto const before = failures;
+      try {
+        test.body ();
+      } catch (std::exception& e) {
+        ++failures;
+        std::fprintf (stderr, "%.*s: %s: %s\n", static_cast<int> (test.name.size ()), test.name.data (),
+          typeid (e).name (), e.what ());
+      }
+      std::printf ("%s %.*s\n", failures == before ? "ok  " : "FAIL", static_cast<int> (test.name.size ()),
+        test.name.data ());
+    }
+    return failures == 0 ? 0 : 1;
+  }
+
+  // send rates that never throttle a test
+  inline constexpr auto unthrottled = send_queue_options {.global_rate = 1e9, .chat_rate = 1e9, .max_in_flight = 1024};
+
+  /**
+   * Removes the database file and its WAL files left by a previous run, returns its name.
+   */
+  inline auto scratch_db (std::string name) -> std::string
+  {
+    for (auto suffix : {"", "-wal", "-shm"})
+      std::remove ((name + suffix).c_str ());
+    return name;
+  }
+
+  inline auto text_update (banana::integer_t chat_id, std::string text) -> banana::api::update_t
+  {
+    static auto next_id = std::atomic<banana::integer_t> (1);
+    auto message = banana::api::message_t {};
+    message.message_id = next_id.fetch_add (1);
+    message.date = 0;
+    message.chat.id = chat_id;
+    message.chat.type = "private";
+    message.text = std::move (text);
+
+    auto update = banana::api::update_t {};
+    update.update_id = message.message_id;
+    update.message = std::move (message);
+    return update;
+  }
+
+  inline auto button_update (banana::integer_t chat_id, std::string data) -> banana::api::update_t
+  {
+    auto update = text_update (chat_id, "");
+    auto query = banana::api::callback_query_t {};
+    query.id = std::to_string (update.update_id);
+    query.message = std::move (update.message);
+    query.message->text.reset ();
+    query.data = std::move (data);
+    update.message.reset ();
+    update.callback_query = std::move (query);
+    return update;
+  }
+
+  /**
+   * Texts of the messages sent to chat_id, in order. The agent must record, see fake_agent_options.
+   */
+  inline auto sent_texts (fake_agent& agent, banana::integer_t chat_id) -> std::vector<std::string>
+  {
+    auto result = std::vector<std::string> ();
+    for (auto const& message : agent.sent_messages ())
+      if (auto const* id = std::get_if<banana::integer_t> (&message.chat_id); id != nullptr && *id == chat_id)
+        result.push_back (message.text);
+    return result;
+  }
+
+  /**
+   * Index in the state variant of the current state of a chat, read from its checkpointed snapshot.
+   */
+  template<class Handler>
+  auto state_index (Handler& handler, banana::integer_t chat_id) -> std::size_t
+  {
+    handler.checkpoint ();
+    auto snapshot = handler.storage ().get_value_json (chat_id, Handler::session_key);
+    return snapshot.has_value () ? snapshot->at ("state").at ("index").template get<std::size_t> () : std::size_t (-1);
+  }
+} // namespace forest::testing